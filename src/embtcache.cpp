@@ -0,0 +1,408 @@
+#include "embtcache.hpp"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <unordered_map>
+
+namespace ngcomp
+{
+  /// 64 bit FNV-1a hash, fed with the bytes of plain values and strings
+  class EmbTrefftzCacheHasher
+  {
+    uint64_t hash = 14695981039346656037ull;
+
+  public:
+    void AddBytes (const void *data, const size_t size)
+    {
+      const auto bytes = static_cast<const unsigned char *> (data);
+      for (size_t i = 0; i < size; i++)
+        {
+          hash ^= bytes[i];
+          hash *= 1099511628211ull;
+        }
+    }
+
+    template <typename T> void Add (const T &value)
+    {
+      static_assert (std::is_trivially_copyable_v<T>);
+      AddBytes (&value, sizeof (T));
+    }
+
+    void Add (const string &str)
+    {
+      Add (str.size ());
+      AddBytes (str.data (), str.size ());
+    }
+
+    size_t Get () const { return hash; }
+  };
+
+  template <int D>
+  bool hashMesh (EmbTrefftzCacheHasher &hasher, const MeshAccess &ma)
+  {
+    hasher.Add (ma.GetNV ());
+    for (size_t v = 0; v < ma.GetNV (); v++)
+      {
+        const Vec<D> point = ma.GetPoint<D> (v);
+        for (int d = 0; d < D; d++)
+          hasher.Add (point[d]);
+      }
+    hasher.Add (ma.GetNE (VOL));
+    for (auto el : ma.Elements (VOL))
+      {
+        // the geometry of curved elements is not given by their vertices
+        if (el.is_curved)
+          return false;
+        hasher.Add (el.GetType ());
+        for (auto v : el.Vertices ())
+          hasher.Add (v);
+      }
+    return true;
+  }
+
+  /// @returns false, if the geometry of the mesh is not determined by the
+  /// vertex coordinates
+  bool hashMesh (EmbTrefftzCacheHasher &hasher, const MeshAccess &ma)
+  {
+    if (ma.GetDeformation ())
+      return false;
+    hasher.Add (ma.GetDimension ());
+    switch (ma.GetDimension ())
+      {
+      case 1:
+        return hashMesh<1> (hasher, ma);
+      case 2:
+        return hashMesh<2> (hasher, ma);
+      default:
+        return hashMesh<3> (hasher, ma);
+      }
+  }
+
+  void hashSpace (EmbTrefftzCacheHasher &hasher, const FESpace &fes)
+  {
+    stringstream flags;
+    flags << fes.GetFlags ();
+    hasher.Add (fes.GetClassName ());
+    hasher.Add (flags.str ());
+    hasher.Add (fes.GetNDof ());
+    hasher.Add (fes.IsComplex ());
+  }
+
+  /// adds the values of the parameters in `cf`, which are not part of its
+  /// printed form.
+  /// @returns false, if `cf` depends on grid functions, their values are not
+  /// hashed
+  bool hashCFData (EmbTrefftzCacheHasher &hasher, CoefficientFunction &cf)
+  {
+    bool hashable = true;
+    cf.TraverseTree ([&] (CoefficientFunction &node) {
+      if (dynamic_cast<GridFunctionCoefficientFunction *> (&node))
+        hashable = false;
+      else if (auto param
+               = dynamic_cast<ParameterCoefficientFunction<double> *> (&node))
+        hasher.Add (param->GetValue ());
+      else if (auto param
+               = dynamic_cast<ParameterCoefficientFunction<Complex> *> (
+                   &node))
+        hasher.Add (param->GetValue ());
+    });
+    return hashable;
+  }
+
+  /// @returns false, if the form depends on data which is not hashed
+  bool hashForm (EmbTrefftzCacheHasher &hasher, const SumOfIntegrals &form)
+  {
+    hasher.Add (form.icfs.Size ());
+    for (const auto &icf : form.icfs)
+      {
+        stringstream cf;
+        cf << *icf->cf;
+        hasher.Add (cf.str ());
+        if (!hashCFData (hasher, *icf->cf))
+          return false;
+        // the values of the deformation are not hashed, like the ones of
+        // any other grid function
+        if (icf->dx.deformation)
+          return false;
+        hasher.Add (icf->dx.vb);
+        hasher.Add (icf->dx.element_vb);
+        hasher.Add (icf->dx.skeleton);
+        hasher.Add (icf->dx.bonus_intorder);
+        // the elements of the form decide which elements are embedded
+        hasher.Add (bool (icf->dx.definedonelements));
+        if (icf->dx.definedonelements)
+          {
+            const BitArray &elements = *icf->dx.definedonelements;
+            hasher.Add (elements.Size ());
+            for (size_t i = 0; i < elements.Size (); i++)
+              hasher.Add (elements.Test (i));
+          }
+        if (icf->dx.definedon)
+          {
+            if (auto regions = get_if<BitArray> (&*icf->dx.definedon))
+              for (size_t i = 0; i < regions->Size (); i++)
+                hasher.Add (regions->Test (i));
+            else
+              hasher.Add (get<string> (*icf->dx.definedon));
+          }
+      }
+    return true;
+  }
+
+  std::optional<size_t> EmbTrefftzCacheKey (
+      const std::optional<SumOfIntegrals> &op, const FESpace &fes,
+      const FESpace &fes_test,
+      const std::optional<ngfem::SumOfIntegrals> &cop_lhs,
+      const std::optional<ngfem::SumOfIntegrals> &cop_rhs,
+      const shared_ptr<const FESpace> fes_conformity,
+      FlatArray<shared_ptr<const ngfem::SumOfIntegrals>> linear_forms,
+      const std::variant<size_t, double> ndof_trefftz, const bool get_range,
+      const bool is_complex, const EmbTrefftzMethod method)
+  {
+    static Timer timer ("EmbTrefftz: cache key");
+    RegionTimer reg (timer);
+
+    EmbTrefftzCacheHasher hasher;
+    if (!hashMesh (hasher, *fes.GetMeshAccess ()))
+      return nullopt;
+    hashSpace (hasher, fes);
+    hashSpace (hasher, fes_test);
+    hasher.Add (bool (fes_conformity));
+    if (fes_conformity)
+      hashSpace (hasher, *fes_conformity);
+    for (const auto &form : { op, cop_lhs, cop_rhs })
+      {
+        hasher.Add (form.has_value ());
+        if (form && !hashForm (hasher, *form))
+          return nullopt;
+      }
+    hasher.Add (linear_forms.Size ());
+    for (const auto &linear_form : linear_forms)
+      if (!hashForm (hasher, *linear_form))
+        return nullopt;
+    hasher.Add (ndof_trefftz.index ());
+    if (holds_alternative<size_t> (ndof_trefftz))
+      hasher.Add (get<size_t> (ndof_trefftz));
+    else
+      hasher.Add (get<double> (ndof_trefftz));
+    hasher.Add (get_range);
+    hasher.Add (is_complex);
+    hasher.Add (method);
+    return hasher.Get ();
+  }
+
+  std::string EmbTrefftzCacheFile (const std::string &cache_dir,
+                                   const size_t key)
+  {
+    stringstream name;
+    name << "embt_" << std::hex << std::setw (16) << std::setfill ('0') << key
+         << ".bin";
+    return (std::filesystem::path (cache_dir) / name.str ()).string ();
+  }
+
+  constexpr char embt_cache_magic[8] = "NGSEMBT";
+  constexpr uint32_t embt_cache_version = 2;
+
+  size_t alignCacheOffset (const size_t offset)
+  {
+    return (offset + EMBT_CACHE_ALIGNMENT - 1) / EMBT_CACHE_ALIGNMENT
+           * EMBT_CACHE_ALIGNMENT;
+  }
+
+  template <typename SCAL>
+  optional<pair<ElmatArena<SCAL>, Array<shared_ptr<BaseVector>>>>
+  LoadEmbTrefftzCache (const std::string &filename, const size_t key,
+                       const size_t num_elements)
+  {
+    static Timer timer ("EmbTrefftz: load cache");
+    RegionTimer reg (timer);
+
+    std::ifstream in (filename, std::ios::binary | std::ios::ate);
+    if (!in)
+      return nullopt;
+    const uint64_t file_size = in.tellg ();
+    in.seekg (0);
+    // true, if `count` items of `size` bytes at `offset` are inside the file
+    const auto fits = [file_size] (const uint64_t offset, const uint64_t count,
+                                   const uint64_t size) {
+      return offset <= file_size
+             && (size == 0 || count <= (file_size - offset) / size);
+    };
+
+    EmbTrefftzCacheHeader header;
+    if (!in.read (reinterpret_cast<char *> (&header), sizeof (header))
+        || std::memcmp (header.magic, embt_cache_magic, 8) != 0
+        || header.version != embt_cache_version
+        || header.scalar_size != sizeof (SCAL) || header.key != key
+        || header.num_elements != num_elements
+        || !fits (header.table_offset, header.num_elements,
+                  sizeof (EmbTrefftzCacheEntry)))
+      return nullopt;
+
+    Array<EmbTrefftzCacheEntry> table (header.num_elements);
+    in.seekg (header.table_offset);
+    if (!in.read (reinterpret_cast<char *> (table.Data ()),
+                  table.Size () * sizeof (EmbTrefftzCacheEntry)))
+      return nullopt;
+    // a truncated or corrupt file must not lead to huge allocations below
+    for (const auto &entry : table)
+      if (entry.offset != 0
+          && !fits (entry.offset, uint64_t (entry.height) * entry.width,
+                    sizeof (SCAL)))
+        return nullopt;
+    if (!fits (header.particular_solution_offset,
+               header.num_particular_solutions,
+               header.particular_solution_size * sizeof (SCAL)))
+      return nullopt;
+
+    // entries sharing the same block are aliases of the first one
+    std::unordered_map<uint64_t, size_t> owner_of_block;
+    Array<size_t> capacities (table.Size ());
+    for (size_t i = 0; i < table.Size (); i++)
+      {
+        capacities[i] = 0;
+        if (table[i].offset != 0
+            && owner_of_block.emplace (table[i].offset, i).second)
+          capacities[i] = size_t (table[i].height) * table[i].width;
+      }
+
+    ElmatArena<SCAL> element_matrices;
+    element_matrices.Reserve (capacities);
+    for (size_t i = 0; i < table.Size () && in; i++)
+      {
+        if (table[i].offset == 0)
+          continue;
+        const size_t owner = owner_of_block[table[i].offset];
+        if (owner != i)
+          {
+            element_matrices.Alias (i, owner);
+            continue;
+          }
+        auto elmat = element_matrices.SetElmat (
+            i, table[i].height, table[i].width, table[i].ndof_trefftz);
+        in.seekg (table[i].offset);
+        in.read (reinterpret_cast<char *> (elmat.Data ()),
+                 elmat.Height () * elmat.Width () * sizeof (SCAL));
+      }
+    element_matrices.Compact ();
+
+    Array<shared_ptr<BaseVector>> particular_solutions (
+        header.num_particular_solutions);
+    in.seekg (header.particular_solution_offset);
+    for (auto &particular_solution : particular_solutions)
+      {
+        auto vec
+            = make_shared<VVector<SCAL>> (header.particular_solution_size);
+        in.read (reinterpret_cast<char *> (vec->FV ().Data ()),
+                 header.particular_solution_size * sizeof (SCAL));
+        particular_solution = vec;
+      }
+
+    if (!in)
+      return nullopt;
+    return make_pair (std::move (element_matrices),
+                      std::move (particular_solutions));
+  }
+
+  template <typename SCAL>
+  void StoreEmbTrefftzCache (
+      const std::string &filename, const size_t key,
+      const ElmatArena<SCAL> &element_matrices,
+      FlatArray<shared_ptr<BaseVector>> particular_solutions)
+  {
+    static Timer timer ("EmbTrefftz: store cache");
+    RegionTimer reg (timer);
+
+    EmbTrefftzCacheHeader header{};
+    std::memcpy (header.magic, embt_cache_magic, 8);
+    header.version = embt_cache_version;
+    header.scalar_size = sizeof (SCAL);
+    header.key = key;
+    header.num_elements = element_matrices.Size ();
+    header.table_offset = alignCacheOffset (sizeof (header));
+
+    Array<EmbTrefftzCacheEntry> table (header.num_elements);
+    size_t offset = alignCacheOffset (
+        header.table_offset + table.Size () * sizeof (EmbTrefftzCacheEntry));
+    // elements sharing a matrix in the arena share the block in the file
+    std::unordered_map<const SCAL *, uint64_t> block_of_matrix;
+    Array<bool> owns_block (table.Size ());
+    for (size_t i = 0; i < element_matrices.Size (); i++)
+      {
+        table[i] = EmbTrefftzCacheEntry{ 0, 0, 0, 0 };
+        owns_block[i] = false;
+        if (!element_matrices.IsDefined (i))
+          continue;
+        const auto elmat = element_matrices.GetElmat (i);
+        const auto [block, inserted]
+            = block_of_matrix.emplace (elmat.Data (), offset);
+        table[i] = EmbTrefftzCacheEntry{
+          block->second, uint32_t (elmat.Height ()),
+          uint32_t (elmat.Width ()), element_matrices.GetNdofTrefftz (i)
+        };
+        owns_block[i] = inserted;
+        if (inserted)
+          offset = alignCacheOffset (offset + elmat.Height () * elmat.Width ()
+                                                  * sizeof (SCAL));
+      }
+    header.particular_solution_offset = offset;
+    header.num_particular_solutions = particular_solutions.Size ();
+    header.particular_solution_size
+        = (particular_solutions.Size ()) ? particular_solutions[0]->Size ()
+                                         : 0;
+
+    std::random_device random;
+    const std::string tmp_filename
+        = filename + ".tmp" + std::to_string (random ());
+    {
+      std::ofstream out (tmp_filename, std::ios::binary);
+      const auto pad_to = [&out] (const size_t position) {
+        static const char zeros[EMBT_CACHE_ALIGNMENT] = {};
+        out.write (zeros, position - size_t (out.tellp ()));
+      };
+      out.write (reinterpret_cast<const char *> (&header), sizeof (header));
+      pad_to (header.table_offset);
+      out.write (reinterpret_cast<const char *> (table.Data ()),
+                 table.Size () * sizeof (EmbTrefftzCacheEntry));
+      for (size_t i = 0; i < element_matrices.Size (); i++)
+        {
+          if (!owns_block[i])
+            continue;
+          const auto elmat = element_matrices.GetElmat (i);
+          pad_to (table[i].offset);
+          out.write (reinterpret_cast<const char *> (elmat.Data ()),
+                     elmat.Height () * elmat.Width () * sizeof (SCAL));
+        }
+      pad_to (header.particular_solution_offset);
+      for (const auto &particular_solution : particular_solutions)
+        out.write (reinterpret_cast<const char *> (
+                       particular_solution->FV<SCAL> ().Data ()),
+                   header.particular_solution_size * sizeof (SCAL));
+      if (!out)
+        {
+          out.close ();
+          std::filesystem::remove (tmp_filename);
+          throw Exception ("EmbTrefftz: could not write cache file "
+                           + tmp_filename);
+        }
+    }
+    std::filesystem::rename (tmp_filename, filename);
+  }
+
+  template optional<pair<ElmatArena<double>, Array<shared_ptr<BaseVector>>>>
+  LoadEmbTrefftzCache<double> (const std::string &, const size_t,
+                               const size_t);
+  template optional<pair<ElmatArena<Complex>, Array<shared_ptr<BaseVector>>>>
+  LoadEmbTrefftzCache<Complex> (const std::string &, const size_t,
+                                const size_t);
+  template void
+  StoreEmbTrefftzCache<double> (const std::string &, const size_t,
+                                const ElmatArena<double> &,
+                                FlatArray<shared_ptr<BaseVector>>);
+  template void
+  StoreEmbTrefftzCache<Complex> (const std::string &, const size_t,
+                                 const ElmatArena<Complex> &,
+                                 FlatArray<shared_ptr<BaseVector>>);
+}
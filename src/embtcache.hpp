@@ -0,0 +1,85 @@
+#ifndef FILE_EMBTCACHE_HPP
+#define FILE_EMBTCACHE_HPP
+#include "embtrefftz.hpp"
+
+namespace ngcomp
+{
+  /// @returns a hash of everything the result of `EmbTrefftz` depends on:
+  /// the mesh (vertex coordinates and element vertices), the spaces (type,
+  /// flags, ndof), the printed symbolic forms together with the values of
+  /// their parameters and their integration domains and elements, the
+  /// choice of `ndof_trefftz`, `get_range` and the method.
+  /// `nullopt`, if the result cannot be cached: the forms contain grid
+  /// functions, whose values are not hashed, or the mesh is curved or
+  /// deformed, s.t. its geometry is not given by the vertices.
+  ///
+  /// Note: apart from parameters, coefficient functions enter the key by
+  /// their printed representation only.
+  std::optional<size_t> EmbTrefftzCacheKey (
+      const std::optional<SumOfIntegrals> &op, const FESpace &fes,
+      const FESpace &fes_test,
+      const std::optional<ngfem::SumOfIntegrals> &cop_lhs,
+      const std::optional<ngfem::SumOfIntegrals> &cop_rhs,
+      const shared_ptr<const FESpace> fes_conformity,
+      FlatArray<shared_ptr<const ngfem::SumOfIntegrals>> linear_forms,
+      const std::variant<size_t, double> ndof_trefftz, const bool get_range,
+      const bool is_complex, const EmbTrefftzMethod method);
+
+  /// @returns the path of the cache file for `key` inside `cache_dir`
+  std::string EmbTrefftzCacheFile (const std::string &cache_dir,
+                                   const size_t key);
+
+  /// Cache file layout (native byte order, all offsets relative to the
+  /// start of the file, all blocks are aligned to `EMBT_CACHE_ALIGNMENT`
+  /// bytes, s.t. the file can be memory mapped):
+  ///
+  ///   EmbTrefftzCacheHeader
+  ///   EmbTrefftzCacheEntry[num_elements]
+  ///   element matrices, row major
+  ///   particular solutions, one after the other
+  struct EmbTrefftzCacheHeader
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t scalar_size;
+    uint64_t key;
+    uint64_t num_elements;
+    uint64_t table_offset;
+    uint64_t particular_solution_offset;
+    uint64_t particular_solution_size;
+    uint64_t num_particular_solutions;
+  };
+
+  /// location and shape of one element matrix, `offset == 0` marks elements
+  /// without embedding. Elements sharing a matrix share the block.
+  struct EmbTrefftzCacheEntry
+  {
+    uint64_t offset;
+    uint32_t height;
+    uint32_t width;
+    uint64_t ndof_trefftz;
+  };
+
+  constexpr size_t EMBT_CACHE_ALIGNMENT = 64;
+
+  /// loads the embedding of the `num_elements` volume elements stored in
+  /// `filename`.
+  /// @returns `nullopt`, if the file does not exist, was not written for
+  /// `key`, `SCAL` and `num_elements`, or is truncated or corrupt.
+  template <typename SCAL>
+  optional<pair<ElmatArena<SCAL>, Array<shared_ptr<BaseVector>>>>
+  LoadEmbTrefftzCache (const std::string &filename, const size_t key,
+                       const size_t num_elements);
+
+  /// stores the embedding and the particular solutions in `filename`.
+  /// The file is written to a temporary file first and renamed afterwards,
+  /// s.t. concurrent runs never see a partially written cache.
+  /// @throws Exception if the file cannot be written.
+  template <typename SCAL>
+  void StoreEmbTrefftzCache (
+      const std::string &filename, const size_t key,
+      const ElmatArena<SCAL> &element_matrices,
+      FlatArray<shared_ptr<BaseVector>> particular_solutions);
+}
+
+#endif
@@ -1,6 +1,9 @@
 #include "embtrefftz.hpp"
+#include "embtcache.hpp"
+#include "embttrace.hpp"
 #include "monomialfespace.hpp"
 #include <cfloat>
+#include <unordered_map>
 
 using namespace ngbla;
 using namespace ngcomp;
@@ -157,15 +160,44 @@ void extractVisibleDofs (FlatMatrix<SCAL> &elmat, const ElementId &element_id,
   elmat.Assign (velmat);
 }
 
-/// Fills the two creators with the sparsity pattern needed for
-/// the Trefftz embedding.
+/// @returns the hidden dofs of `fes` in increasing order
+INLINE Array<DofId> collectHiddenDofs (const FESpace &fes)
+{
+  const IntRange dofs (fes.GetNDof ());
+  // fixed partition of the dofs, s.t. the order does not depend on the
+  // scheduling
+  const size_t num_blocks = 4 * TaskManager::GetNumThreads ();
+  Array<size_t> first_hidden (num_blocks + 1);
+  first_hidden[0] = 0;
+  ParallelFor (num_blocks, [&] (size_t block) {
+    size_t num_hidden = 0;
+    for (DofId d : dofs.Split (block, num_blocks))
+      num_hidden += (HIDDEN_DOF == fes.GetDofCouplingType (d));
+    first_hidden[block + 1] = num_hidden;
+  });
+  for (size_t block = 0; block < num_blocks; block++)
+    first_hidden[block + 1] += first_hidden[block];
+
+  Array<DofId> hidden_dofs (first_hidden[num_blocks]);
+  ParallelFor (num_blocks, [&] (size_t block) {
+    size_t i = first_hidden[block];
+    for (DofId d : dofs.Split (block, num_blocks))
+      if (HIDDEN_DOF == fes.GetDofCouplingType (d))
+        hidden_dofs[i++] = d;
+  });
+  return hidden_dofs;
+}
+
+/// Numbers the Trefftz dofs element by element, starting with `offset`.
+/// Elements without embedding or without regular dofs get no Trefftz dofs.
+/// @returns for every element its first Trefftz dof, followed by the end
+/// of the numbering.
 /// @tparam NZ_FUNC has signature `(ElementId) -> size_t`
 template <typename SCAL, typename NZ_FUNC>
-INLINE size_t fillTrefftzTableCreators (
-    TableCreator<int> &creator, TableCreator<int> &creator2,
-    const vector<optional<ElmatWithTrefftzInfo<SCAL>>> &ETmats,
-    const MeshAccess &ma, const FESpace &fes, NZ_FUNC nz_from_elnr,
-    const size_t offset)
+INLINE Array<size_t>
+numberTrefftzDofs (const ElmatArena<SCAL> &ETmats, const MeshAccess &ma,
+                   const FESpace &fes, NZ_FUNC nz_from_elnr,
+                   const size_t offset)
 {
   static_assert (std::is_invocable_v<NZ_FUNC, ElementId>,
                  "NZ_FUNC must be invocable on (ElementId)");
@@ -173,49 +205,77 @@ INLINE size_t fillTrefftzTableCreators (
       std::is_same_v<std::invoke_result_t<NZ_FUNC, ElementId>, size_t>,
       "NZ_FUNC must have return type size_t");
 
-  const size_t ndof = fes.GetNDof ();
   const size_t ne = ma.GetNE (VOL);
-  // number of the next Trefftz dof to create
-  size_t next_trefftz_dof = offset;
-  for (auto ei : ma.Elements (VOL))
-    {
-      if (!ETmats[ei.Nr ()])
-        continue;
-
-      size_t nz = nz_from_elnr (ei);
-      Array<DofId> dnums;
-      fes.GetDofNrs (ei, dnums, VISIBLE_DOF);
-      bool hasregdof = false;
-      for (DofId d : dnums)
-        if (IsRegularDof (d))
-          {
-            creator.Add (ei.Nr (), d);
-            hasregdof = true;
-          }
-      // assumption here: Either all or no dof is regular
-      if (hasregdof)
-        {
-          for (size_t d = 0; d < nz; d++)
-            creator2.Add (ei.Nr (), next_trefftz_dof++);
-        }
-    }
+  Array<size_t> first_trefftz_dof (ne + 1);
+  first_trefftz_dof[0] = offset;
+  ParallelForRange (ne, [&] (IntRange r) {
+    Array<DofId> dnums;
+    for (size_t elnr : r)
+      {
+        first_trefftz_dof[elnr + 1] = 0;
+        if (!ETmats.IsDefined (elnr))
+          continue;
+        const ElementId ei (VOL, elnr);
+        fes.GetDofNrs (ei, dnums, VISIBLE_DOF);
+        // assumption here: Either all or no dof is regular
+        bool hasregdof = false;
+        for (DofId d : dnums)
+          hasregdof = hasregdof || IsRegularDof (d);
+        if (hasregdof)
+          first_trefftz_dof[elnr + 1] = nz_from_elnr (ei);
+      }
+  });
+  for (size_t elnr = 0; elnr < ne; elnr++)
+    first_trefftz_dof[elnr + 1] += first_trefftz_dof[elnr];
+  return first_trefftz_dof;
+}
 
-  for (size_t d = 0, hcnt = 0; d < ndof; d++)
-    if (HIDDEN_DOF == fes.GetDofCouplingType (d))
+/// Fills the two creators with the sparsity pattern needed for
+/// the Trefftz embedding. Every element fills only its own rows, so the
+/// rows are filled in parallel without changing their order.
+/// @param first_trefftz_dof numbering of the Trefftz dofs, see
+///   \ref numberTrefftzDofs
+/// @param hidden_dofs hidden dofs of `fes`, see \ref collectHiddenDofs
+template <typename SCAL>
+INLINE size_t fillTrefftzTableCreators (
+    TableCreator<int> &creator, TableCreator<int> &creator2,
+    const ElmatArena<SCAL> &ETmats, const MeshAccess &ma, const FESpace &fes,
+    FlatArray<size_t> first_trefftz_dof, FlatArray<DofId> hidden_dofs)
+{
+  const size_t ne = ma.GetNE (VOL);
+  ParallelForRange (ne, [&] (IntRange r) {
+    Array<DofId> dnums;
+    for (size_t elnr : r)
       {
-        creator.Add (ne + hcnt, d);
-        creator2.Add (ne + hcnt++, next_trefftz_dof++);
+        if (!ETmats.IsDefined (elnr))
+          continue;
+        fes.GetDofNrs (ElementId (VOL, elnr), dnums, VISIBLE_DOF);
+        for (DofId d : dnums)
+          if (IsRegularDof (d))
+            creator.Add (elnr, d);
+        for (size_t d = first_trefftz_dof[elnr];
+             d < first_trefftz_dof[elnr + 1]; d++)
+          creator2.Add (elnr, d);
       }
-  return next_trefftz_dof - offset;
+  });
+
+  const size_t next_trefftz_dof = first_trefftz_dof[ne];
+  ParallelFor (hidden_dofs.Size (), [&] (size_t hcnt) {
+    creator.Add (ne + hcnt, hidden_dofs[hcnt]);
+    creator2.Add (ne + hcnt, next_trefftz_dof + hcnt);
+  });
+  return next_trefftz_dof + hidden_dofs.Size () - first_trefftz_dof[0];
 }
 
 template <typename SCAL>
 INLINE size_t createConformingTrefftzTables (
-    Table<int> &table, Table<int> &table2,
-    const vector<optional<ElmatWithTrefftzInfo<SCAL>>> &ETmats,
+    Table<int> &table, Table<int> &table2, const ElmatArena<SCAL> &ETmats,
     const FESpace &fes, shared_ptr<const FESpace> fes_conformity,
     const size_t hidden_dofs)
 {
+  static Timer timer ("EmbTrefftz: create tables");
+  RegionTimer reg (timer);
+
   const auto ma = fes.GetMeshAccess ();
   const size_t ne = ma->GetNE (VOL);
   const size_t ndof_conforming
@@ -224,52 +284,55 @@ INLINE size_t createConformingTrefftzTables (
   TableCreator<int> creator2 (ne + hidden_dofs);
   size_t global_trefftz_ndof = 0;
 
+  // The dof numbers of the Trefftz dofs are shifted up by conforming_ndof,
+  // to avoid conflicts between Trefftz and Constraint dofs.
+  const Array<size_t> first_trefftz_dof = numberTrefftzDofs (
+      ETmats, *ma, fes,
+      [&] (ElementId ei) { return ETmats.GetNdofTrefftz (ei.Nr ()); },
+      ndof_conforming);
+  const Array<DofId> fes_hidden_dofs = collectHiddenDofs (fes);
+  const Array<DofId> conforming_hidden_dofs
+      = (fes_conformity) ? collectHiddenDofs (*fes_conformity)
+                         : Array<DofId> ();
+
   for (; !creator.Done (); creator++, creator2++)
     {
-      // first compute the Trefftz dofs. The dof numbers of the Trefftz dofs
-      // are shifted up by conforming_ndof, to avoid conflicts between Trefftz
-      // and Constraint dofs.
+      // first compute the Trefftz dofs.
       global_trefftz_ndof = fillTrefftzTableCreators (
-          creator, creator2, ETmats, *ma, fes,
-          [&] (ElementId ei) {
-            return (ETmats[ei.Nr ()]) ? ETmats[ei.Nr ()]->ndof_trefftz : 0;
-          },
-          ndof_conforming);
+          creator, creator2, ETmats, *ma, fes, first_trefftz_dof,
+          fes_hidden_dofs);
       (*testout) << "created " << global_trefftz_ndof << " many trefftz dofs"
                  << std::endl;
 
       // then compute the Constraint dofs.
       if (fes_conformity)
         {
-          for (auto ei : ma->Elements (VOL))
-            {
-              if (!ETmats[ei.Nr ()])
-                continue;
+          ParallelForRange (ne, [&] (IntRange r) {
+            Array<DofId> dofs_conforming;
+            for (size_t elnr : r)
+              {
+                if (!ETmats.IsDefined (elnr))
+                  continue;
 
-              Array<DofId> dofs_conforming;
-              fes_conformity->GetDofNrs (ei, dofs_conforming, VISIBLE_DOF);
+                fes_conformity->GetDofNrs (ElementId (VOL, elnr),
+                                           dofs_conforming, VISIBLE_DOF);
 
-              bool hasregdof = false;
-              for (DofId d : dofs_conforming)
-                if (IsRegularDof (d))
+                bool hasregdof = false;
+                for (DofId d : dofs_conforming)
+                  hasregdof = hasregdof || IsRegularDof (d);
+                // assumption here: Either all or no dof is regular
+                if (hasregdof)
                   {
-                    // creator.Add (ei.Nr (), d);
-                    hasregdof = true;
+                    for (DofId d : dofs_conforming)
+                      creator2.Add (elnr, d);
                   }
-              // assumption here: Either all or no dof is regular
-              if (hasregdof)
-                {
-                  for (DofId d : dofs_conforming)
-                    creator2.Add (ei.Nr (), d);
-                }
-            }
-
-          for (size_t d = 0, hcnt = 0; d < ndof_conforming; d++)
-            if (HIDDEN_DOF == fes_conformity->GetDofCouplingType (d))
-              {
-                creator.Add (ne + hcnt, d);
-                creator2.Add (ne + hcnt++, d);
               }
+          });
+
+          ParallelFor (conforming_hidden_dofs.Size (), [&] (size_t hcnt) {
+            creator.Add (ne + hcnt, conforming_hidden_dofs[hcnt]);
+            creator2.Add (ne + hcnt, conforming_hidden_dofs[hcnt]);
+          });
         }
     }
 
@@ -280,19 +343,38 @@ INLINE size_t createConformingTrefftzTables (
 
 template <typename SCAL>
 INLINE void fillSparseMatrixWithData (
-    SparseMatrix<SCAL> &P,
-    const vector<optional<ElmatWithTrefftzInfo<SCAL>>> &ETmats,
+    SparseMatrix<SCAL> &P, const ElmatArena<SCAL> &ETmats,
     const Table<int> &table, const Table<int> &table2, const MeshAccess &ma,
     const size_t hidden_dofs)
 {
+  static Timer timer ("EmbTrefftz: fill sparse matrix");
+  RegionTimer reg (timer);
+
   const size_t ne = ma.GetNE (VOL);
   P.SetZero ();
-  for (auto ei : ma.Elements (VOL))
-    if (ETmats[ei.Nr ()])
-      {
-        P.AddElementMatrix (table[ei.Nr ()], table2[ei.Nr ()],
-                            ETmats[ei.Nr ()]->elmat);
-      }
+
+  // If no row of P is shared between elements, every entry is written by
+  // exactly one element and the elements can be added in parallel.
+  // Otherwise, the elements are added in order, s.t. the sums do not
+  // depend on the number of threads.
+  Array<int> row_count (P.Height ());
+  row_count = 0;
+  std::atomic<bool> rows_shared = false;
+  ParallelFor (table.Size (), [&] (size_t i) {
+    for (int d : table[i])
+      if (AsAtomic (row_count[d]).fetch_add (1) > 0)
+        rows_shared = true;
+  });
+
+  const auto add_element = [&] (size_t elnr) {
+    if (ETmats.IsDefined (elnr))
+      P.AddElementMatrix (table[elnr], table2[elnr], ETmats.GetElmat (elnr));
+  };
+  if (rows_shared)
+    for (size_t elnr = 0; elnr < ne; elnr++)
+      add_element (elnr);
+  else
+    ParallelFor (ne, add_element);
 
   SCAL one = 1;
   FlatMatrix<SCAL> I (1, 1, &one);
@@ -302,26 +384,100 @@ INLINE void fillSparseMatrixWithData (
 
 INLINE size_t countHiddenDofs (const FESpace &fes)
 {
-  size_t hidden_dofs = 0;
-  const size_t ndof = fes.GetNDof ();
-  for (DofId d : Range (ndof))
-    // branchless version of
-    // if (HIDDEN_DOF == fes.GetDofCouplingType (d))
-    //   hidden_dofs++;
-    hidden_dofs += (HIDDEN_DOF == fes.GetDofCouplingType (d));
-  return hidden_dofs;
+  return ParallelReduce (
+      fes.GetNDof (),
+      [&fes] (size_t d) {
+        return size_t (HIDDEN_DOF == fes.GetDofCouplingType (d));
+      },
+      std::plus<size_t> (), size_t (0));
 }
 
 namespace ngcomp
 {
+  /// @returns a vector on `fes` for a particular solution. On distributed
+  /// meshes, it is a cumulated parallel vector, every element sets its own
+  /// entries.
+  template <typename SCAL>
+  shared_ptr<BaseVector> createSolutionVector (const FESpace &fes)
+  {
+    if (auto pardofs = fes.GetParallelDofs ())
+      return CreateParallelVector (pardofs, CUMULATED);
+    return make_shared<VVector<SCAL>> (fes.GetNDof ());
+  }
+
+  /// @returns the parallel dofs of a subset of the dofs of `pardofs`,
+  /// renumbered by `old2new` (negative for dropped dofs). A new dof is
+  /// shared with the same ranks as the old one.
+  shared_ptr<ParallelDofs> restrictParallelDofs (const ParallelDofs &pardofs,
+                                                 FlatArray<DofId> old2new,
+                                                 const size_t new_ndof)
+  {
+    TableCreator<int> creator (new_ndof);
+    for (; !creator.Done (); creator++)
+      for (size_t d = 0; d < old2new.Size (); d++)
+        if (old2new[d] >= 0)
+          for (const int proc : pardofs.GetDistantProcs (d))
+            creator.Add (old2new[d], proc);
+    return make_shared<ParallelDofs> (pardofs.GetCommunicator (),
+                                      creator.MoveTable (),
+                                      pardofs.GetEntrySize (),
+                                      pardofs.IsComplex ());
+  }
+
+  /// wraps the embedding `P` built from the element embeddings in a
+  /// ParallelMatrix, if the mesh is distributed. The columns are numbered as
+  /// in \ref createConformingTrefftzTables: the conforming dofs come first
+  /// and are shared like the ones of `fes_conformity`, the Trefftz dofs
+  /// belong to one element and are local to its rank. `P` is applied element
+  /// by element, so it maps cumulated to distributed vectors.
+  /// @param col_pardofs parallel dofs of the columns, if they are already
+  ///   known, e.g. the ones of the Trefftz space. Built from
+  ///   `fes_conformity` otherwise, which needs all ranks.
+  template <typename SCAL>
+  shared_ptr<BaseMatrix>
+  toParallelEmbedding (shared_ptr<BaseMatrix> P, const FESpace &fes,
+                       shared_ptr<const FESpace> fes_conformity,
+                       shared_ptr<ParallelDofs> col_pardofs = nullptr)
+  {
+    const auto row_pardofs = fes.GetParallelDofs ();
+    if (!row_pardofs)
+      return P;
+    if (col_pardofs)
+      {
+        if (col_pardofs->GetNDofLocal () != P->Width ())
+          throw Exception ("toParallelEmbedding: the parallel dofs of the "
+                           "columns do not match the width of the embedding");
+        return make_shared<ParallelMatrix> (P, row_pardofs, col_pardofs,
+                                            C2D);
+      }
+
+    const size_t ndof_conforming
+        = (fes_conformity) ? fes_conformity->GetNDof () : 0;
+    const auto conforming_pardofs
+        = (fes_conformity) ? fes_conformity->GetParallelDofs () : nullptr;
+    TableCreator<int> creator (P->Width ());
+    for (; !creator.Done (); creator++)
+      if (conforming_pardofs)
+        for (size_t d = 0; d < ndof_conforming; d++)
+          for (const int proc : conforming_pardofs->GetDistantProcs (d))
+            creator.Add (d, proc);
+    col_pardofs = make_shared<ParallelDofs> (row_pardofs->GetCommunicator (),
+                                             creator.MoveTable (), 1,
+                                             std::is_same_v<SCAL, Complex>);
+    return make_shared<ParallelMatrix> (P, row_pardofs, col_pardofs, C2D);
+  }
+
   /// assembles a global sparse matrix from the given element matrices.
-  /// @param ETMats vector of all element matrices
+  /// @param ETMats arena of all element matrices
   /// @param fes non-Trefftz finite element space
+  /// @param col_pardofs parallel dofs of the columns, see
+  ///   \ref toParallelEmbedding
   /// @tparam SCAL scalar type of the matrix entries
   template <typename SCAL>
   shared_ptr<BaseMatrix>
-  Elmats2Sparse (const vector<optional<ElmatWithTrefftzInfo<SCAL>>> ETmats,
-                 const FESpace &fes, shared_ptr<const FESpace> fes_conformity)
+  Elmats2Sparse (const ElmatArena<SCAL> &ETmats, const FESpace &fes,
+                 shared_ptr<const FESpace> fes_conformity,
+                 shared_ptr<ParallelDofs> col_pardofs = nullptr)
   {
     const auto ma = fes.GetMeshAccess ();
 
@@ -335,7 +491,238 @@ namespace ngcomp
         fes.GetNDof (), conformity_plus_trefftz_dofs, table, table2, false);
     fillSparseMatrixWithData (*P, ETmats, table, table2, *ma, hidden_dofs);
 
-    return P;
+    return toParallelEmbedding<SCAL> (P, fes, fes_conformity, col_pardofs);
+  }
+
+  /// assembles the square block diagonal matrix with the block of element
+  /// `elnr` on the dofs `dofs[elnr]`. The blocks must not share dofs.
+  template <typename SCAL>
+  shared_ptr<BaseMatrix> blocks2Sparse (const ElmatArena<SCAL> &blocks,
+                                        const Table<int> &dofs,
+                                        const size_t ndof)
+  {
+    auto mat
+        = make_shared<SparseMatrix<SCAL>> (ndof, ndof, dofs, dofs, false);
+    mat->SetZero ();
+    ParallelFor (dofs.Size (), [&] (size_t elnr) {
+      if (blocks.IsDefined (elnr))
+        mat->AddElementMatrix (dofs[elnr], dofs[elnr],
+                               blocks.GetElmat (elnr));
+    });
+    return mat;
+  }
+
+  template <typename SCAL>
+  EmbeddingBlockMatrix<SCAL>::EmbeddingBlockMatrix (
+      shared_ptr<const ElmatArena<SCAL>> blocks, Table<int> row_dofs,
+      Table<int> col_dofs, size_t height, size_t width)
+      : blocks (blocks), row_dofs (std::move (row_dofs)),
+        col_dofs (std::move (col_dofs)), height (height), width (width)
+  {
+    const size_t ne = blocks->Size ();
+    for (size_t i = ne; i < this->row_dofs.Size (); i++)
+      {
+        hidden_row_dofs.Append (this->row_dofs[i][0]);
+        hidden_col_dofs.Append (this->col_dofs[i][0]);
+      }
+    for (size_t elnr = 0; elnr < ne; elnr++)
+      if (blocks->IsDefined (elnr))
+        {
+          const auto block = blocks->GetElmat (elnr);
+          max_block_height = max (max_block_height, block.Height ());
+          max_block_width = max (max_block_width, block.Width ());
+        }
+  }
+
+  template <typename SCAL>
+  template <bool TRANSPOSE, typename TSCAL>
+  void EmbeddingBlockMatrix<SCAL>::multAdd (TSCAL s, const BaseVector &x,
+                                            BaseVector &y) const
+  {
+    static Timer timer ("EmbeddingBlockMatrix: MultAdd");
+    static Timer timer_trans ("EmbeddingBlockMatrix: MultTransAdd");
+    RegionTimer reg (TRANSPOSE ? timer_trans : timer);
+
+    const auto fx = x.FV<SCAL> ();
+    auto fy = y.FV<SCAL> ();
+    ParallelForRange (blocks->Size (), [&] (IntRange r) {
+      Vector<SCAL> buffer (max_block_height + max_block_width);
+      for (size_t elnr : r)
+        {
+          // elements without regular dofs are not part of the embedding
+          if (!blocks->IsDefined (elnr) || row_dofs[elnr].Size () == 0)
+            continue;
+          const auto block = blocks->GetElmat (elnr);
+          const auto x_dofs = TRANSPOSE ? row_dofs[elnr] : col_dofs[elnr];
+          const auto y_dofs = TRANSPOSE ? col_dofs[elnr] : row_dofs[elnr];
+          FlatVector<SCAL> elx (x_dofs.Size (), buffer.Data ());
+          FlatVector<SCAL> ely (y_dofs.Size (),
+                                buffer.Data () + x_dofs.Size ());
+          for (size_t i = 0; i < x_dofs.Size (); i++)
+            elx[i] = fx[x_dofs[i]];
+          if constexpr (TRANSPOSE)
+            ely = s * Trans (block) * elx;
+          else
+            ely = s * block * elx;
+          // the Trefftz dofs are local to the elements, the dofs of the
+          // underlying space may be shared
+          if constexpr (TRANSPOSE)
+            for (size_t i = 0; i < y_dofs.Size (); i++)
+              fy[y_dofs[i]] += ely[i];
+          else
+            for (size_t i = 0; i < y_dofs.Size (); i++)
+              AtomicAdd (fy[y_dofs[i]], ely[i]);
+        }
+    });
+
+    const auto &x_hidden = TRANSPOSE ? hidden_row_dofs : hidden_col_dofs;
+    const auto &y_hidden = TRANSPOSE ? hidden_col_dofs : hidden_row_dofs;
+    for (size_t i = 0; i < x_hidden.Size (); i++)
+      fy[y_hidden[i]] += s * fx[x_hidden[i]];
+  }
+
+  template <typename SCAL>
+  shared_ptr<BaseMatrix> EmbeddingBlockMatrix<SCAL>::CreateTranspose () const
+  {
+    auto transpose = make_shared<EmbeddingBlockMatrix<SCAL>> (*this);
+    transpose->transposed = !transposed;
+    return transpose;
+  }
+
+  template <typename SCAL>
+  void EmbeddingBlockMatrix<SCAL>::Mult (const BaseVector &x,
+                                         BaseVector &y) const
+  {
+    y = 0.0;
+    applyAdd<double> (false, 1.0, x, y);
+  }
+
+  template <typename SCAL>
+  void EmbeddingBlockMatrix<SCAL>::MultAdd (double s, const BaseVector &x,
+                                            BaseVector &y) const
+  {
+    applyAdd (false, s, x, y);
+  }
+
+  template <typename SCAL>
+  void EmbeddingBlockMatrix<SCAL>::MultAdd (Complex s, const BaseVector &x,
+                                            BaseVector &y) const
+  {
+    if constexpr (std::is_same_v<SCAL, Complex>)
+      applyAdd (false, s, x, y);
+    else
+      BaseMatrix::MultAdd (s, x, y);
+  }
+
+  template <typename SCAL>
+  void EmbeddingBlockMatrix<SCAL>::MultTrans (const BaseVector &x,
+                                              BaseVector &y) const
+  {
+    y = 0.0;
+    applyAdd<double> (true, 1.0, x, y);
+  }
+
+  template <typename SCAL>
+  void EmbeddingBlockMatrix<SCAL>::MultTransAdd (double s,
+                                                 const BaseVector &x,
+                                                 BaseVector &y) const
+  {
+    applyAdd (true, s, x, y);
+  }
+
+  template <typename SCAL>
+  void EmbeddingBlockMatrix<SCAL>::MultTransAdd (Complex s,
+                                                 const BaseVector &x,
+                                                 BaseVector &y) const
+  {
+    if constexpr (std::is_same_v<SCAL, Complex>)
+      applyAdd (true, s, x, y);
+    else
+      BaseMatrix::MultTransAdd (s, x, y);
+  }
+
+  template <typename SCAL>
+  void EmbeddingBlockMatrix<SCAL>::Mult (const MultiVector &x,
+                                         MultiVector &y) const
+  {
+    static Timer timer ("EmbeddingBlockMatrix: Mult MultiVector");
+    RegionTimer reg (timer);
+
+    const size_t num_vectors = x.Size ();
+    for (size_t j = 0; j < num_vectors; j++)
+      *y[j] = 0.0;
+
+    const auto &x_dofs = transposed ? row_dofs : col_dofs;
+    const auto &y_dofs = transposed ? col_dofs : row_dofs;
+    const size_t max_x = transposed ? max_block_height : max_block_width;
+    const size_t max_y = transposed ? max_block_width : max_block_height;
+
+    // the element vectors of all vectors are the rows of one matrix, s.t.
+    // every block is applied by one matrix-matrix product
+    ParallelForRange (blocks->Size (), [&] (IntRange r) {
+      Matrix<SCAL> elx_buffer (num_vectors, max_x);
+      Matrix<SCAL> ely_buffer (num_vectors, max_y);
+      for (size_t elnr : r)
+        {
+          if (!blocks->IsDefined (elnr) || row_dofs[elnr].Size () == 0)
+            continue;
+          const auto block = blocks->GetElmat (elnr);
+          FlatMatrix<SCAL> elx (num_vectors, x_dofs[elnr].Size (),
+                                elx_buffer.Data ());
+          FlatMatrix<SCAL> ely (num_vectors, y_dofs[elnr].Size (),
+                                ely_buffer.Data ());
+          for (size_t j = 0; j < num_vectors; j++)
+            {
+              FlatVector<SCAL> row = elx.Row (j);
+              x[j]->GetIndirect (x_dofs[elnr], row);
+            }
+          if (transposed)
+            ely = elx * block;
+          else
+            ely = elx * Trans (block);
+          for (size_t j = 0; j < num_vectors; j++)
+            y[j]->AddIndirect (y_dofs[elnr], ely.Row (j), true);
+        }
+    });
+
+    const auto &x_hidden = transposed ? hidden_row_dofs : hidden_col_dofs;
+    const auto &y_hidden = transposed ? hidden_col_dofs : hidden_row_dofs;
+    for (size_t j = 0; j < num_vectors; j++)
+      {
+        const auto fx = x[j]->FV<SCAL> ();
+        auto fy = y[j]->FV<SCAL> ();
+        for (size_t i = 0; i < x_hidden.Size (); i++)
+          fy[y_hidden[i]] += fx[x_hidden[i]];
+      }
+  }
+
+  template class EmbeddingBlockMatrix<double>;
+  template class EmbeddingBlockMatrix<Complex>;
+
+  /// stores the given element matrices as the blocks of an
+  /// \ref EmbeddingBlockMatrix.
+  /// @param ETMats arena of all element matrices
+  /// @param fes non-Trefftz finite element space
+  /// @param col_pardofs parallel dofs of the columns, see
+  ///   \ref toParallelEmbedding
+  /// @tparam SCAL scalar type of the matrix entries
+  template <typename SCAL>
+  shared_ptr<BaseMatrix>
+  Elmats2Blocks (shared_ptr<const ElmatArena<SCAL>> ETmats, const FESpace &fes,
+                 shared_ptr<ParallelDofs> col_pardofs = nullptr)
+  {
+    static Timer timer ("EmbTrefftz: Elmats2Blocks");
+    RegionTimer reg (timer);
+
+    const size_t hidden_dofs = countHiddenDofs (fes);
+    Table<int> table, table2;
+    const size_t trefftz_dofs = createConformingTrefftzTables (
+        table, table2, *ETmats, fes, nullptr, hidden_dofs);
+    return toParallelEmbedding<SCAL> (
+        make_shared<EmbeddingBlockMatrix<SCAL>> (
+            ETmats, std::move (table), std::move (table2), fes.GetNDof (),
+            trefftz_dofs),
+        fes, nullptr, col_pardofs);
   }
 }
 
@@ -462,138 +849,926 @@ namespace ngbla
     for (size_t i = 0; i < min (A.Width (), A.Height ()); i++)
       A (i, i) = AA (i, i);
   }
+
+#ifdef NGSTREFFTZ_USE_LAPACK
+  /// column pivoted QR decomposition `A^H Pi = Q R`.
+  /// Q (ndof x ndof) gets the full orthonormal basis,
+  /// A gets overwritten with |diag(R)| on its diagonal.
+  void LapackPivotedQR (FlatMatrix<double> A, SliceMatrix<double, ColMajor> Q)
+  {
+    static Timer t ("LapackPivotedQR");
+    RegionTimer reg (t);
+    // the row major A is A^T in column major order
+    ngbla::integer m = A.Width (), n = A.Height ();
+    ngbla::integer k = min (m, n), lda = m, ldq = Q.Dist ();
+    Array<ngbla::integer> jpvt (n);
+    jpvt = 0;
+    Vector<> tau (k);
+    Array<double> work ((n + 1) * 64 + 2 * n + m * 64);
+    ngbla::integer lwork = work.Size ();
+    ngbla::integer info;
+
+    dgeqp3_ (&m, &n, A.Data (), &lda, jpvt.Data (), tau.Data (), work.Data (),
+             &lwork, &info);
+    if (info != 0)
+      throw Exception ("something went wrong in the pivoted qr "
+                       + std::to_string (info));
+    Q = 0.0;
+    for (ngbla::integer j = 0; j < k; j++)
+      Q.Col (j) = A.Row (j);
+    dorgqr_ (&m, &m, &k, Q.Data (), &ldq, tau.Data (), work.Data (), &lwork,
+             &info);
+    if (info != 0)
+      throw Exception ("something went wrong in the pivoted qr "
+                       + std::to_string (info));
+
+    Vector<> R_diag (k);
+    for (ngbla::integer i = 0; i < k; i++)
+      R_diag[i] = abs (A (i, i));
+    A = 0.0;
+    A.Diag (0) = R_diag;
+  }
+
+  void LapackPivotedQR (FlatMatrix<Complex> A,
+                        SliceMatrix<Complex, ColMajor> Q)
+  {
+    static Timer t ("LapackPivotedQR");
+    RegionTimer reg (t);
+    // the row major conj(A) is A^H in column major order
+    A = Conj (A);
+    ngbla::integer m = A.Width (), n = A.Height ();
+    ngbla::integer k = min (m, n), lda = m, ldq = Q.Dist ();
+    Array<ngbla::integer> jpvt (n);
+    jpvt = 0;
+    Vector<Complex> tau (k);
+    Array<Complex> work ((n + 1) * 64 + 2 * n + m * 64);
+    Array<double> rwork (2 * n);
+    ngbla::integer lwork = work.Size ();
+    ngbla::integer info;
+
+    zgeqp3_ (&m, &n, A.Data (), &lda, jpvt.Data (), tau.Data (), work.Data (),
+             &lwork, rwork.Data (), &info);
+    if (info != 0)
+      throw Exception ("something went wrong in the pivoted qr "
+                       + std::to_string (info));
+    Q = 0.0;
+    for (ngbla::integer j = 0; j < k; j++)
+      Q.Col (j) = A.Row (j);
+    zungqr_ (&m, &m, &k, Q.Data (), &ldq, tau.Data (), work.Data (), &lwork,
+             &info);
+    if (info != 0)
+      throw Exception ("something went wrong in the pivoted qr "
+                       + std::to_string (info));
+
+    Vector<> R_diag (k);
+    for (ngbla::integer i = 0; i < k; i++)
+      R_diag[i] = abs (A (i, i));
+    A = 0.0;
+    A.Diag (0) = R_diag;
+  }
+
+  /// eigenvalues (ascending) and eigenvectors of the hermitian G, the
+  /// eigenvectors overwrite G
+  void LapackHermitianEigenSystem (SliceMatrix<double, ColMajor> G,
+                                   FlatVector<double> lami)
+  {
+    static Timer t ("LapackHermitianEigenSystem");
+    RegionTimer reg (t);
+    char jobz = 'V', uplo = 'U';
+    ngbla::integer n = G.Width (), ldg = G.Dist ();
+    Array<double> work (n * 66);
+    ngbla::integer lwork = work.Size ();
+    ngbla::integer info;
+    dsyev_ (&jobz, &uplo, &n, G.Data (), &ldg, lami.Data (), work.Data (),
+            &lwork, &info);
+    if (info != 0)
+      throw Exception ("something went wrong in the eigen decomposition "
+                       + std::to_string (info));
+  }
+
+  void LapackHermitianEigenSystem (SliceMatrix<Complex, ColMajor> G,
+                                   FlatVector<double> lami)
+  {
+    static Timer t ("LapackHermitianEigenSystem");
+    RegionTimer reg (t);
+    char jobz = 'V', uplo = 'U';
+    ngbla::integer n = G.Width (), ldg = G.Dist ();
+    Array<Complex> work (n * 66);
+    Array<double> rwork (max (ngbla::integer (1), 3 * n - 2));
+    ngbla::integer lwork = work.Size ();
+    ngbla::integer info;
+    zheev_ (&jobz, &uplo, &n, G.Data (), &ldg, lami.Data (), work.Data (),
+            &lwork, rwork.Data (), &info);
+    if (info != 0)
+      throw Exception ("something went wrong in the eigen decomposition "
+                       + std::to_string (info));
+  }
+
+  /// `A^H A = W Lambda W^H`, with the eigenvalues in descending order.
+  /// W (ndof x ndof) gets the eigenvectors,
+  /// A gets overwritten with sqrt(Lambda), i.e. the singular values.
+  template <typename SCAL>
+  void getEigenBasis (FlatMatrix<SCAL> A, FlatMatrix<SCAL, ColMajor> W,
+                      LocalHeap &lh)
+  {
+    const HeapReset hr (lh);
+    const auto [height, width] = A.Shape ();
+    FlatMatrix<SCAL, ColMajor> G (width, width, lh);
+    G = Trans (Conj (A)) * A;
+    FlatVector<double> lami (width, lh);
+    LapackHermitianEigenSystem (G, lami);
+
+    for (size_t i = 0; i < width; i++)
+      W.Col (i) = G.Col (width - 1 - i);
+    A = static_cast<SCAL> (0.0);
+    for (size_t i = 0; i < min (height, width); i++)
+      A (i, i) = sqrt (max (lami[width - 1 - i], 0.0));
+  }
+#endif
 }
 
-/// @return pseudoinverse of A (as some `ngbla::Expr` type to avoid
-/// allocations)
-template <typename SCAL, typename TDIST>
-auto invertSVD (const FlatMatrix<SCAL, ColMajor> &U,
-                const MatrixView<SCAL, RowMajor, size_t, size_t, TDIST> &Sigma,
-                const FlatMatrix<SCAL, ColMajor> &V, size_t nz, LocalHeap &lh)
+/// @return pseudoinverse of A, if the rows of A lie in the span of the
+/// orthonormal columns of W1: `A^+ = W1 ((A W1)^H A W1)^{-1} (A W1)^H`.
+/// A_inv has to be allocated by the caller.
+template <typename SCAL>
+void invertWithBasis (FlatMatrix<SCAL> A, SliceMatrix<SCAL, ColMajor> W1,
+                      FlatMatrix<SCAL> A_inv, LocalHeap &lh)
 {
-  auto U_T = Trans (U);
-  auto V_T = Trans (V);
-  const auto [m, n] = Sigma.Shape ();
-  FlatMatrix<SCAL> Sigma_inv (n, m, lh);
-  Sigma_inv = 0.;
-  auto Sigma_el = Sigma.Diag ().begin ();
-  auto Sigma_inv_el = Sigma_inv.Diag ().begin ();
+  const HeapReset hr (lh);
+  const size_t rank = W1.Width ();
+  FlatMatrix<SCAL> AW (A.Height (), rank, lh);
+  AW = A * W1;
+  FlatMatrix<SCAL> AW_H (rank, A.Height (), lh);
+  AW_H = Trans (Conj (AW));
+  FlatMatrix<SCAL> G (rank, rank, lh);
+  G = AW_H * AW;
+  CalcInverse (G);
+  FlatMatrix<SCAL> X (rank, A.Height (), lh);
+  X = G * AW_H;
+  A_inv = W1 * X;
+}
 
-  // Sigma_inv.Diag () = 1.0 / elmat_a.Diag ();
-  for (size_t i = 0; i < m; i++)
+/// in place Cholesky factorization `G = L L^H`, L overwrites the lower
+/// triangle of G
+/// @returns false, if G is not numerically positive definite
+template <typename SCAL> bool choleskyFactor (FlatMatrix<SCAL> G)
+{
+  const size_t n = G.Height ();
+  for (size_t j = 0; j < n; j++)
     {
-      if (i < n - nz)
-        *(Sigma_inv_el++) = 1.0 / *(Sigma_el++);
-      else
-        *(Sigma_inv_el++) = 0.0;
+      double diag = std::real (G (j, j));
+      for (size_t k = 0; k < j; k++)
+        diag -= std::norm (G (j, k));
+      if (!(diag > 0))
+        return false;
+      const double l_jj = sqrt (diag);
+      G (j, j) = l_jj;
+      for (size_t i = j + 1; i < n; i++)
+        {
+          SCAL sum = G (i, j);
+          for (size_t k = 0; k < j; k++)
+            sum -= G (i, k) * Conj (G (j, k));
+          G (i, j) = sum / l_jj;
+        }
     }
-  return V_T * Sigma_inv * U_T;
+  return true;
 }
 
-/// calculates from the given space and linear form integrators a particular
-/// solution. note: allocates the solution on the given local heap.
-/// @param lfis arrays of linear form integrators, for `VOL`, `BND`, `BBND`,
-/// `BBBND`
-/// @return the element-local solution, allocated on the local heap `mlh`
-/// @tparam T type of matrix expression
-template <typename SCAL, typename T>
-FlatVector<SCAL>
-calculateParticularSolution (Array<shared_ptr<LinearFormIntegrator>> lfis[4],
-                             const FESpace &test_fes, const ElementId ei,
-                             const MeshAccess &ma, const Array<DofId> &dofs,
-                             const size_t ndof_test,
-                             const Expr<T> &inverse_elmat, LocalHeap &mlh)
+/// solves `L L^H y = x` in place for every column of Y, with L from
+/// \ref choleskyFactor
+template <typename SCAL>
+void choleskySolve (FlatMatrix<SCAL> L, FlatMatrix<SCAL, ColMajor> Y)
 {
-  if (inverse_elmat.Width () < ndof_test)
-    throw std::invalid_argument (
-        "The width of inverse_elmat must be at least as long as ndof_test");
-
-  // shall not be deallocated after function scope ends
-  FlatVector<SCAL> elsol (dofs.Size (), mlh);
-
-  const HeapReset hr (mlh);
-  const auto &test_fel = test_fes.GetFE (ei, mlh);
-  const auto &trafo = ma.GetTrafo (ei, mlh);
-  FlatVector<SCAL> elvec (inverse_elmat.Width (), mlh),
-      elveci (ndof_test, mlh);
-  elvec = static_cast<SCAL> (0.0);
-
-  // elvec: (... conformity part ... | ... Trefftz part ...)
-  // len:    --- ndof_conforming --- | --- ndof_test ------
-  auto elvec_trefftz = elvec.Range (inverse_elmat.Width () - ndof_test,
-                                    inverse_elmat.Width ());
-  // now write into the Trefftz part of the vector linear_form(*, v_h)
-  for (const auto vorb : { VOL, BND, BBND, BBBND })
+  const size_t n = L.Height ();
+  for (size_t c = 0; c < Y.Width (); c++)
     {
-      for (const auto &lfi : lfis[vorb])
+      FlatVector<SCAL> y = Y.Col (c);
+      for (size_t i = 0; i < n; i++)
         {
-          if (lfi->DefinedOnElement (ei.Nr ()))
-            {
-              auto &mapped_trafo
-                  = trafo.AddDeformation (lfi->GetDeformation ().get (), mlh);
-              lfi->CalcElementVector (test_fel, mapped_trafo, elveci, mlh);
-              elvec_trefftz += elveci;
-            }
+          SCAL sum = y[i];
+          for (size_t k = 0; k < i; k++)
+            sum -= L (i, k) * y[k];
+          y[i] = sum / L (i, i);
+        }
+      for (size_t i = n; i-- > 0;)
+        {
+          SCAL sum = y[i];
+          for (size_t k = i + 1; k < n; k++)
+            sum -= Conj (L (k, i)) * y[k];
+          y[i] = sum / L (i, i);
         }
     }
-  elsol = inverse_elmat * elvec;
-  return elsol;
 }
 
-namespace ngcomp
+/// orthonormalizes the columns of X by modified Gram-Schmidt, applied twice
+/// for stability
+/// @returns false, if the columns are numerically dependent
+template <typename SCAL>
+bool orthonormalizeColumns (FlatMatrix<SCAL, ColMajor> X)
 {
-  mutex stats_mutex;
-
-  template <typename SCAL>
-  pair<vector<optional<ElmatWithTrefftzInfo<SCAL>>>,
-       shared_ptr<ngla::BaseVector>>
-  EmbTrefftz (const std::optional<SumOfIntegrals> &op, const FESpace &fes,
-              const FESpace &fes_test,
-              const std::optional<ngfem::SumOfIntegrals> &cop_lhs,
-              const std::optional<ngfem::SumOfIntegrals> &cop_rhs,
-              const shared_ptr<const FESpace> fes_conformity,
-              shared_ptr<const ngfem::SumOfIntegrals> linear_form,
-              const std::variant<size_t, double> ndof_trefftz,
-              shared_ptr<std::map<std::string, Vector<SCAL>>> stats,
-              const bool get_range)
-  {
-    // statistics stuff
-    Vector<SCAL> sing_val_avg;
-    Vector<double> sing_val_max;
-    Vector<double> sing_val_min;
-    std::atomic<size_t> active_elements = 0;
-
-    auto mesh_access = fes.GetMeshAccess ();
-    const size_t num_elements = mesh_access->GetNE (VOL);
-    // #TODO what is a good size for the local heap?
-    // For the moment: large enough constant size.
-    LocalHeap local_heap
-        = LocalHeap (getNumberOfThreads () * 10 * 1000 * 1000);
-
-    // calculate the integrators for the three bilinear forms,
-    // each for VOL, BND, BBND, BBBND, hence 4 arrays per bilnear form
-    Array<shared_ptr<BilinearFormIntegrator>> op_integrators[4],
-        cop_lhs_integrators[4], cop_rhs_integrators[4];
-    if (op)
-      calculateBilinearFormIntegrators (*op, op_integrators);
-    if (cop_lhs && cop_rhs)
+  for (int pass = 0; pass < 2; pass++)
+    for (size_t j = 0; j < X.Width (); j++)
       {
-        calculateBilinearFormIntegrators (*cop_lhs, cop_lhs_integrators);
-        calculateBilinearFormIntegrators (*cop_rhs, cop_rhs_integrators);
+        FlatVector<SCAL> x = X.Col (j);
+        for (size_t k = 0; k < j; k++)
+          {
+            FlatVector<SCAL> q = X.Col (k);
+            SCAL projection = 0;
+            for (size_t i = 0; i < x.Size (); i++)
+              projection += Conj (q[i]) * x[i];
+            x -= projection * q;
+          }
+        const double norm = L2Norm (x);
+        if (!(norm > 1e-12))
+          return false;
+        x /= norm;
       }
+  return true;
+}
 
-    vector<optional<ElmatWithTrefftzInfo<SCAL>>> element_matrices (
-        num_elements);
+/// Block inverse subspace iteration for the kernel of A, whose dimension
+/// X.Width () is known. The columns of X converge to the eigenvectors of
+/// the smallest eigenvalues of `A^H A + shift I`, which costs one Cholesky
+/// factorization and triangular solves for X.Width () right hand sides per
+/// iteration, instead of a full SVD.
+/// On success, X is an orthonormal basis of the kernel, A_inv (allocated
+/// by the caller) the pseudoinverse `(A^H A + X X^H)^{-1} A^H`, and A is
+/// overwritten by its column norms in descending order, as estimates of
+/// its singular values.
+/// @returns false, if the iteration does not converge, e.g. if the kernel
+/// is smaller than X.Width () or the gap to the next singular value is too
+/// small. A is left untouched then.
+template <typename SCAL>
+bool subspaceKernel (FlatMatrix<SCAL> A, FlatMatrix<SCAL, ColMajor> X,
+                     FlatMatrix<SCAL> A_inv, LocalHeap &lh)
+{
+  static Timer timer ("EmbTrefftz: subspace iteration");
+  RegionTimer reg (timer);
+
+  constexpr size_t max_iterations = 8;
+  // |A x| <= tolerance * |A|_F for every column x of X
+  constexpr double tolerance = 1e-8;
+  const HeapReset hr (lh);
+  const auto [height, width] = A.Shape ();
+  const size_t ndof_trefftz = X.Width ();
+
+  FlatMatrix<SCAL> G (width, width, lh);
+  G = Trans (Conj (A)) * A;
+  double trace = 0;
+  for (size_t i = 0; i < width; i++)
+    trace += std::real (G (i, i));
+  if (!(trace > 0))
+    return false;
+
+  // the shift keeps the factorization stable, the kernel converges with
+  // the rate shift / (sigma^2 + shift) for the smallest nonzero sigma
+  FlatMatrix<SCAL> L (width, width, lh);
+  L = G;
+  for (size_t i = 0; i < width; i++)
+    L (i, i) += 1e-10 * trace;
+  if (!choleskyFactor<SCAL> (L))
+    return false;
+
+  // the same pseudo random start for every element
+  uint32_t seed = 1;
+  for (size_t j = 0; j < ndof_trefftz; j++)
+    for (size_t i = 0; i < width; i++)
+      {
+        seed = seed * 1664525u + 1013904223u;
+        X (i, j) = double (seed >> 8) / double (1u << 24) - 0.5;
+      }
+  if (!orthonormalizeColumns<SCAL> (X))
+    return false;
 
-    const bool fes_has_hidden_dofs = fesHasHiddenDofs (fes);
-    // const bool fes_conformity_has_hidden_dofs
-    //     = fesHasHiddenDofs (fes_conformity);
+  FlatMatrix<SCAL, ColMajor> AX (height, ndof_trefftz, lh);
+  bool converged = false;
+  for (size_t it = 0; it < max_iterations && !converged; it++)
+    {
+      choleskySolve<SCAL> (L, X);
+      if (!orthonormalizeColumns<SCAL> (X))
+        return false;
+      AX = A * X;
+      double residual = 0;
+      for (size_t j = 0; j < ndof_trefftz; j++)
+        residual = max (residual, L2Norm (AX.Col (j)));
+      converged = residual * residual <= tolerance * tolerance * trace;
+    }
+  if (!converged)
+    return false;
+
+  // G + X X^H is G on the complement of the kernel and the identity on it
+  L = G + X * Trans (Conj (X));
+  if (!choleskyFactor<SCAL> (L))
+    return false;
+  FlatMatrix<SCAL, ColMajor> AH (width, height, lh);
+  AH = Trans (Conj (A));
+  choleskySolve<SCAL> (L, AH);
+  A_inv = AH;
+
+  FlatArray<double> norms (width, lh);
+  for (size_t i = 0; i < width; i++)
+    norms[i] = sqrt (std::real (G (i, i)));
+  QuickSort (norms);
+  A = static_cast<SCAL> (0.0);
+  for (size_t i = 0; i < min (height, width); i++)
+    A (i, i) = norms[width - 1 - i];
+  return true;
+}
 
-    auto particular_solution_vec = make_shared<VVector<SCAL>> (fes.GetNDof ());
-    particular_solution_vec->operator= (0.0);
-    Array<shared_ptr<LinearFormIntegrator>> lfis[4];
-    if (linear_form)
-      calculateLinearFormIntegrators (*linear_form, lfis);
+INLINE double jacobiAbs2 (double x) { return x * x; }
+INLINE SIMD<double> jacobiAbs2 (SIMD<double> x) { return x * x; }
+INLINE double jacobiAbs2 (Complex x) { return std::norm (x); }
+INLINE double jacobiConj (double x) { return x; }
+INLINE SIMD<double> jacobiConj (SIMD<double> x) { return x; }
+INLINE Complex jacobiConj (Complex x) { return std::conj (x); }
+template <typename T> INLINE T jacobiSelect (bool cond, T a, T b)
+{
+  return cond ? a : b;
+}
+INLINE SIMD<double>
+jacobiSelect (SIMD<mask64> cond, SIMD<double> a, SIMD<double> b)
+{
+  return If (cond, a, b);
+}
+INLINE double jacobiMaxLane (double x) { return x; }
+INLINE double jacobiMaxLane (SIMD<double> x)
+{
+  double m = x[0];
+  for (size_t lane = 1; lane < SIMD<double>::Size (); lane++)
+    m = max (m, x[lane]);
+  return m;
+}
+
+/// One-sided (Hestenes) Jacobi iteration on the columns of B: pairs of
+/// columns are rotated until all columns are mutually orthogonal. The same
+/// rotations are accumulated in V, s.t. `A V = B` holds throughout, if B
+/// starts as A. With `T = SIMD<double>`, every lane holds another matrix.
+/// @tparam T scalar type of B, V
+/// @tparam R corresponding real type
+template <typename T, typename R>
+void jacobiOrthogonalizeColumns (FlatMatrix<T> B, FlatMatrix<T> V)
+{
+  constexpr double tol = 1e-15;
+  constexpr int max_sweeps = 40;
+  const size_t height = B.Height (), width = B.Width ();
+  V = T (0.0);
+  for (size_t i = 0; i < width; i++)
+    V (i, i) = T (1.0);
+
+  for (int sweep = 0; sweep < max_sweeps; sweep++)
+    {
+      R off (0.0);
+      for (size_t p = 0; p + 1 < width; p++)
+        for (size_t q = p + 1; q < width; q++)
+          {
+            R alpha (0.0), beta (0.0);
+            T gamma (0.0);
+            for (size_t i = 0; i < height; i++)
+              {
+                alpha += jacobiAbs2 (B (i, p));
+                beta += jacobiAbs2 (B (i, q));
+                gamma += jacobiConj (B (i, p)) * B (i, q);
+              }
+            const R g = sqrt (jacobiAbs2 (gamma));
+            const R norm_pq = sqrt (alpha * beta);
+            const auto rotate = g > R (tol) * norm_pq;
+            off = max (off, jacobiSelect (rotate, g / norm_pq, R (0.0)));
+
+            // rotate (B_p, conj(phase) B_q), s.t. both are orthogonal,
+            // where phase = gamma / |gamma|
+            const R g_safe = jacobiSelect (rotate, g, R (1.0));
+            const R zeta = (beta - alpha) / (R (2.0) * g_safe);
+            const R t = jacobiSelect (zeta >= R (0.0), R (1.0), R (-1.0))
+                        / (sqrt (zeta * zeta) + sqrt (R (1.0) + zeta * zeta));
+            const R c = jacobiSelect (
+                rotate, R (1.0) / sqrt (R (1.0) + t * t), R (1.0));
+            const R s = jacobiSelect (rotate, c * t, R (0.0));
+            const T phase_conj = jacobiConj (gamma / g_safe);
+            const auto rotate_columns = [&] (FlatMatrix<T> M) {
+              for (size_t i = 0; i < M.Height (); i++)
+                {
+                  const T mp = M (i, p);
+                  const T mq = jacobiSelect (rotate, phase_conj, T (1.0))
+                               * M (i, q);
+                  M (i, p) = c * mp - s * mq;
+                  M (i, q) = s * mp + c * mq;
+                }
+            };
+            rotate_columns (B);
+            rotate_columns (V);
+          }
+      if (jacobiMaxLane (off) <= tol)
+        break;
+    }
+}
+
+/// extracts `A = U Sigma V` (same convention as `getSVD`) from the
+/// orthogonalized columns `B = A W`: Sigma are the column norms of B in
+/// descending order, V the correspondingly sorted columns of W, U the
+/// normalized columns of B, completed to an orthonormal basis.
+template <typename SCAL>
+void finishJacobiSVD (FlatMatrix<SCAL> B, FlatMatrix<SCAL> W,
+                      FlatMatrix<SCAL> A, FlatMatrix<SCAL, ColMajor> U,
+                      FlatMatrix<SCAL, ColMajor> V, LocalHeap &lh)
+{
+  const HeapReset hr (lh);
+  const size_t height = B.Height (), width = B.Width ();
+  FlatArray<double> norms (width, lh);
+  FlatArray<int> order (width, lh);
+  for (size_t j = 0; j < width; j++)
+    {
+      norms[j] = L2Norm (B.Col (j));
+      order[j] = j;
+    }
+  QuickSortI (norms, order, [] (double a, double b) { return a > b; });
+
+  const double small = 1e-14 * max (norms[order[0]], 1e-300);
+  A = static_cast<SCAL> (0.0);
+  U = static_cast<SCAL> (0.0);
+  size_t rank = 0;
+  for (size_t k = 0; k < width; k++)
+    {
+      const int j = order[k];
+      if (k < height)
+        A (k, k) = norms[j];
+      for (size_t i = 0; i < width; i++)
+        V (k, i) = jacobiConj (W (i, j));
+      if (k < height && norms[j] > small)
+        {
+          U.Col (k) = (1.0 / norms[j]) * B.Col (j);
+          rank = k + 1;
+        }
+    }
+
+  // complete U with orthogonalized unit vectors
+  FlatVector<SCAL> u (height, lh);
+  for (size_t k = rank, e = 0; k < height && e < height; e++)
+    {
+      u = static_cast<SCAL> (0.0);
+      u[e] = 1.0;
+      for (int pass = 0; pass < 2; pass++)
+        for (size_t l = 0; l < k; l++)
+          {
+            SCAL dot = 0.0;
+            for (size_t i = 0; i < height; i++)
+              dot += jacobiConj (U (i, l)) * u[i];
+            u -= dot * U.Col (l);
+          }
+      const double norm = L2Norm (u);
+      if (norm > 0.5)
+        U.Col (k++) = (1.0 / norm) * u;
+    }
+}
+
+/// Singular value decompositions of a batch of matrices of equal shape with
+/// the one-sided Jacobi method, `As[i] = Us[i] Sigma_i Vs[i]` with the same
+/// convention as `getSVD`, `As[i]` gets overwritten with `Sigma_i`.
+/// Real matrices are processed `SIMD<double>::Size ()` at a time, one per
+/// SIMD lane.
+template <typename SCAL>
+void batchedJacobiSVD (FlatArray<FlatMatrix<SCAL>> As,
+                       FlatArray<FlatMatrix<SCAL, ColMajor>> Us,
+                       FlatArray<FlatMatrix<SCAL, ColMajor>> Vs,
+                       LocalHeap &lh)
+{
+  static Timer timer ("EmbTrefftz: batched Jacobi SVD");
+  RegionTimer reg (timer);
+  if (As.Size () == 0)
+    return;
+  const size_t height = As[0].Height (), width = As[0].Width ();
+
+  if constexpr (std::is_same_v<SCAL, double>)
+    {
+      constexpr size_t lanes = SIMD<double>::Size ();
+      for (size_t first = 0; first < As.Size (); first += lanes)
+        {
+          const HeapReset hr (lh);
+          const size_t num = min (lanes, As.Size () - first);
+          FlatMatrix<SIMD<double>> B (height, width, lh), W (width, width, lh);
+          // unused lanes hold zero matrices
+          for (size_t i = 0; i < height; i++)
+            for (size_t j = 0; j < width; j++)
+              B (i, j) = SIMD<double> ([&] (int lane) {
+                return (size_t (lane) < num) ? As[first + lane](i, j) : 0.0;
+              });
+          jacobiOrthogonalizeColumns<SIMD<double>, SIMD<double>> (B, W);
+
+          FlatMatrix<double> Bl (height, width, lh), Wl (width, width, lh);
+          for (size_t lane = 0; lane < num; lane++)
+            {
+              for (size_t i = 0; i < height; i++)
+                for (size_t j = 0; j < width; j++)
+                  Bl (i, j) = B (i, j)[lane];
+              for (size_t i = 0; i < width; i++)
+                for (size_t j = 0; j < width; j++)
+                  Wl (i, j) = W (i, j)[lane];
+              finishJacobiSVD<double> (Bl, Wl, As[first + lane],
+                                       Us[first + lane], Vs[first + lane],
+                                       lh);
+            }
+        }
+    }
+  else
+    for (size_t k = 0; k < As.Size (); k++)
+      {
+        const HeapReset hr (lh);
+        FlatMatrix<SCAL> B (height, width, lh), W (width, width, lh);
+        B = As[k];
+        jacobiOrthogonalizeColumns<SCAL, double> (B, W);
+        finishJacobiSVD<SCAL> (B, W, As[k], Us[k], Vs[k], lh);
+      }
+}
+
+/// @return pseudoinverse of A (as some `ngbla::Expr` type to avoid
+/// allocations)
+template <typename SCAL, typename TDIST>
+auto invertSVD (const FlatMatrix<SCAL, ColMajor> &U,
+                const MatrixView<SCAL, RowMajor, size_t, size_t, TDIST> &Sigma,
+                const FlatMatrix<SCAL, ColMajor> &V, size_t nz, LocalHeap &lh)
+{
+  auto U_T = Trans (U);
+  auto V_T = Trans (V);
+  const auto [m, n] = Sigma.Shape ();
+  FlatMatrix<SCAL> Sigma_inv (n, m, lh);
+  Sigma_inv = 0.;
+  auto Sigma_el = Sigma.Diag ().begin ();
+  auto Sigma_inv_el = Sigma_inv.Diag ().begin ();
+
+  // Sigma_inv.Diag () = 1.0 / elmat_a.Diag ();
+  for (size_t i = 0; i < m; i++)
+    {
+      if (i < n - nz)
+        *(Sigma_inv_el++) = 1.0 / *(Sigma_el++);
+      else
+        *(Sigma_inv_el++) = 0.0;
+    }
+  return V_T * Sigma_inv * U_T;
+}
+
+/// linear form integrators of one linear form, for `VOL`, `BND`, `BBND`,
+/// `BBBND`
+using LinearFormIntegrators
+    = std::array<Array<shared_ptr<LinearFormIntegrator>>, 4>;
+
+/// calculates from the given space and linear form integrators the particular
+/// solutions of several linear forms at once, the element vectors of all
+/// linear forms are multiplied with `inverse_elmat` in one product.
+/// note: allocates the solutions on the given local heap.
+/// @param lfis linear form integrators of every linear form
+/// @return the element-local solutions, one column per linear form,
+/// allocated on the local heap `mlh`
+/// @tparam T type of matrix expression
+template <typename SCAL, typename T>
+FlatMatrix<SCAL, ColMajor> calculateParticularSolutions (
+    FlatArray<LinearFormIntegrators> lfis, const FESpace &test_fes,
+    const ElementId ei, const MeshAccess &ma, const Array<DofId> &dofs,
+    const size_t ndof_test, const Expr<T> &inverse_elmat, LocalHeap &mlh)
+{
+  if (inverse_elmat.Width () < ndof_test)
+    throw std::invalid_argument (
+        "The width of inverse_elmat must be at least as long as ndof_test");
+
+  // shall not be deallocated after function scope ends
+  FlatMatrix<SCAL, ColMajor> elsols (dofs.Size (), lfis.Size (), mlh);
+
+  const HeapReset hr (mlh);
+  const auto &test_fel = test_fes.GetFE (ei, mlh);
+  const auto &trafo = ma.GetTrafo (ei, mlh);
+  FlatMatrix<SCAL, ColMajor> elvecs (inverse_elmat.Width (), lfis.Size (),
+                                     mlh);
+  FlatVector<SCAL> elveci (ndof_test, mlh);
+  elvecs = static_cast<SCAL> (0.0);
+
+  for (size_t j = 0; j < lfis.Size (); j++)
+    {
+      // elvec: (... conformity part ... | ... Trefftz part ...)
+      // len:    --- ndof_conforming --- | --- ndof_test ------
+      auto elvec_trefftz = elvecs.Col (j).Range (
+          inverse_elmat.Width () - ndof_test, inverse_elmat.Width ());
+      // now write into the Trefftz part of the vector linear_form(*, v_h)
+      for (const auto vorb : { VOL, BND, BBND, BBBND })
+        {
+          for (const auto &lfi : lfis[j][vorb])
+            {
+              if (lfi->DefinedOnElement (ei.Nr ()))
+                {
+                  auto &mapped_trafo = trafo.AddDeformation (
+                      lfi->GetDeformation ().get (), mlh);
+                  lfi->CalcElementVector (test_fel, mapped_trafo, elveci, mlh);
+                  elvec_trefftz += elveci;
+                }
+            }
+        }
+    }
+  elsols = inverse_elmat * elvecs;
+  return elsols;
+}
+
+/// @returns a fingerprint of the geometry of the element `ei`: its element
+/// type and its vertex coordinates in local vertex order, relative to the
+/// first vertex and scaled by the distance to the farthest vertex.
+/// Elements with the same fingerprint are (up to rounding) translated and
+/// uniformly scaled copies of each other with the same local orientation.
+template <int D>
+size_t elementGeometryKey (const MeshAccess &ma, const ElementId ei)
+{
+  const auto vertices = ma.GetElVertices (ei);
+  const Vec<D> origin = ma.GetPoint<D> (vertices[0]);
+  double scale = 0.0;
+  for (auto v : vertices)
+    scale = max (scale, L2Norm (ma.GetPoint<D> (v) - origin));
+  if (scale == 0.0)
+    scale = 1.0;
+
+  string key;
+  const auto append = [&key] (auto value) {
+    key.append (reinterpret_cast<const char *> (&value), sizeof (value));
+  };
+  append (ma.GetElType (ei));
+  for (auto v : vertices)
+    {
+      const Vec<D> p = (1.0 / scale) * (ma.GetPoint<D> (v) - origin);
+      for (int d = 0; d < D; d++)
+        append (int64_t (round (p[d] * 1e8)));
+    }
+  return std::hash<string>{}(key);
+}
+
+size_t elementGeometryKey (const MeshAccess &ma, const ElementId ei)
+{
+  switch (ma.GetDimension ())
+    {
+    case 1:
+      return elementGeometryKey<1> (ma, ei);
+    case 2:
+      return elementGeometryKey<2> (ma, ei);
+    default:
+      return elementGeometryKey<3> (ma, ei);
+    }
+}
+
+/// @returns true, if `elmat` equals `c * ref` up to the relative tolerance
+/// `tol`.
+template <typename SCAL>
+bool isScalarMultipleOf (FlatMatrix<SCAL> elmat, FlatMatrix<SCAL> ref,
+                         const SCAL c, const double tol)
+{
+  if (elmat.Height () != ref.Height () || elmat.Width () != ref.Width ())
+    return false;
+
+  const auto elmat_vec = elmat.AsVector ();
+  const auto ref_vec = ref.AsVector ();
+  double diff_norm2 = 0.0, elmat_norm2 = 0.0;
+  for (size_t i = 0; i < ref_vec.Size (); i++)
+    {
+      diff_norm2 += L2Norm2 (elmat_vec[i] - c * ref_vec[i]);
+      elmat_norm2 += L2Norm2 (elmat_vec[i]);
+    }
+  return diff_norm2 <= tol * tol * elmat_norm2;
+}
+
+/// @returns `c`, s.t. `c * ref` is the best approximation of `elmat`,
+///   if the relative error of this approximation is below `tol`.
+template <typename SCAL>
+optional<SCAL> scalarMultipleOf (FlatMatrix<SCAL> elmat, FlatMatrix<SCAL> ref,
+                                 const double tol)
+{
+  if (elmat.Height () != ref.Height () || elmat.Width () != ref.Width ())
+    return nullopt;
+
+  const auto elmat_vec = elmat.AsVector ();
+  const auto ref_vec = ref.AsVector ();
+  double ref_norm2 = 0.0, elmat_norm2 = 0.0;
+  SCAL ref_dot_elmat = 0.0;
+  for (size_t i = 0; i < ref_vec.Size (); i++)
+    {
+      ref_norm2 += L2Norm2 (ref_vec[i]);
+      elmat_norm2 += L2Norm2 (elmat_vec[i]);
+      ref_dot_elmat += Conj (ref_vec[i]) * elmat_vec[i];
+    }
+  if (ref_norm2 == 0.0)
+    return (elmat_norm2 == 0.0) ? make_optional<SCAL> (1.0) : nullopt;
+
+  const SCAL c = ref_dot_elmat / ref_norm2;
+  if (c == 0.0 || !isScalarMultipleOf (elmat, ref, c, tol))
+    return nullopt;
+  return c;
+}
+
+/// A class of congruent elements, i.e. elements whose local Trefftz systems
+/// are scalar multiples of each other. The SVD is only computed for the
+/// representative of the class, all other elements reuse its embedding.
+template <typename SCAL> struct CongruentElementClass
+{
+  size_t representative;
+  /// local system and pseudoinverse of the representative
+  Matrix<SCAL> elmat_a, elmat_b, elmat_a_inv;
+  Vector<SCAL> singular_values;
+  /// true, once the embedding of the representative is computed
+  bool embedded = false;
+  /// false, if the subspace iteration computed the embedding, s.t.
+  /// singular_values are only column norms
+  bool has_singular_values = true;
+};
+
+/// singular value decomposition `A = U Sigma V` of a local system, computed
+/// ahead of its embedding by the batched Jacobi SVD
+template <typename SCAL> struct PrecomputedSVD
+{
+  FlatMatrix<SCAL, ColMajor> U, V;
+};
+
+/// relative tolerance, up to which the local systems of two congruent
+/// elements have to agree
+constexpr double congruence_tolerance = 1e-10;
+
+/// statistics of the local systems, accumulated by one thread and merged
+/// after the element loop, s.t. collecting them does not serialize it
+template <typename SCAL> struct EmbTrefftzStatistics
+{
+  /// the timed phases of the embedding of an element
+  enum Phase
+  {
+    INTEGRATION,
+    DECOMPOSITION,
+    INVERSION,
+    PARTICULAR_SOLUTION,
+    NUM_PHASES
+  };
+  /// condition numbers are counted per decade, the last bin collects all
+  /// from 1e16 on, including singular systems
+  static constexpr size_t num_condition_bins = 17;
+
+  Vector<SCAL> sing_val_sum;
+  Vector<double> sing_val_max;
+  Vector<double> sing_val_min;
+  size_t active_elements = 0;
+  std::array<size_t, num_condition_bins> condition_histogram{};
+  std::array<double, NUM_PHASES> phase_seconds{};
+
+  /// adds the time since `start` to `phase`
+  void AddTime (const Phase phase, const TTimePoint start)
+  {
+    phase_seconds[phase] += (GetTimeCounter () - start) * seconds_per_tick;
+  }
+
+  /// adds the singular values of an element with the given condition number
+  void Add (FlatVector<SCAL> singular_values, const double condition)
+  {
+    grow (singular_values.Size ());
+    active_elements += 1;
+    for (size_t i = 0; i < singular_values.Size (); i++)
+      {
+        sing_val_sum[i] += singular_values[i];
+        sing_val_max[i] = max (sing_val_max[i], abs (singular_values[i]));
+        sing_val_min[i] = min (sing_val_min[i], abs (singular_values[i]));
+      }
+    const size_t bin
+        = (condition < 1e16) ? size_t (std::log10 (max (condition, 1.0)))
+                             : num_condition_bins - 1;
+    condition_histogram[bin] += 1;
+  }
+
+  void Merge (const EmbTrefftzStatistics &other)
+  {
+    grow (other.sing_val_sum.Size ());
+    for (size_t i = 0; i < other.sing_val_sum.Size (); i++)
+      {
+        sing_val_sum[i] += other.sing_val_sum[i];
+        sing_val_max[i] = max (sing_val_max[i], other.sing_val_max[i]);
+        sing_val_min[i] = min (sing_val_min[i], other.sing_val_min[i]);
+      }
+    active_elements += other.active_elements;
+    for (size_t i = 0; i < num_condition_bins; i++)
+      condition_histogram[i] += other.condition_histogram[i];
+    for (size_t i = 0; i < NUM_PHASES; i++)
+      phase_seconds[i] += other.phase_seconds[i];
+  }
+
+private:
+  // elements of different type may have different numbers of singular
+  // values
+  void grow (const size_t size)
+  {
+    const size_t old_size = sing_val_sum.Size ();
+    if (size <= old_size)
+      return;
+    const Vector<SCAL> sum = sing_val_sum;
+    const Vector<double> max_values = sing_val_max;
+    const Vector<double> min_values = sing_val_min;
+    sing_val_sum.SetSize (size);
+    sing_val_max.SetSize (size);
+    sing_val_min.SetSize (size);
+    sing_val_sum = 0;
+    sing_val_max = 0;
+    sing_val_min = DBL_MAX;
+    sing_val_sum.Range (0, old_size) = sum;
+    sing_val_max.Range (0, old_size) = max_values;
+    sing_val_min.Range (0, old_size) = min_values;
+  }
+};
+
+/// @returns the ratio of the largest to the smallest of the `rank` largest
+/// singular values, i.e. the condition number of the part of the local
+/// system that is inverted, or infinity, if one of them vanishes.
+template <typename SCAL>
+double localConditionNumber (FlatVector<SCAL> singular_values, size_t rank,
+                             LocalHeap &local_heap)
+{
+  rank = min (rank, singular_values.Size ());
+  if (rank == 0)
+    return 1.0;
+  FlatArray<double> abs_values (singular_values.Size (), local_heap);
+  for (size_t i = 0; i < singular_values.Size (); i++)
+    abs_values[i] = abs (singular_values[i]);
+  QuickSort (abs_values);
+  const double smallest = abs_values[abs_values.Size () - rank];
+  return (smallest > 0) ? abs_values.Last () / smallest
+                        : std::numeric_limits<double>::infinity ();
+}
+
+namespace ngcomp
+{
+  EmbTrefftzMethod ParseEmbTrefftzMethod (const std::string &name)
+  {
+    if (name == "svd")
+      return EmbTrefftzMethod::SVD;
+    if (name == "qr")
+      return EmbTrefftzMethod::QR;
+    if (name == "eig")
+      return EmbTrefftzMethod::EIG;
+    if (name == "jacobi")
+      return EmbTrefftzMethod::JACOBI;
+    if (name == "subspace")
+      return EmbTrefftzMethod::SUBSPACE;
+    throw std::invalid_argument (
+        "unknown method " + name
+        + ", use 'svd', 'qr', 'eig', 'jacobi' or 'subspace'");
+  }
+
+  /// Assembles and embeds the local Trefftz systems of single elements. The
+  /// spaces have to outlive the object.
+  template <typename SCAL> class LocalTrefftzEmbedding
+  {
+    const std::optional<SumOfIntegrals> op, cop_lhs, cop_rhs;
+    const FESpace &fes;
+    const FESpace &fes_test;
+    const shared_ptr<const FESpace> fes_conformity;
+    const shared_ptr<MeshAccess> mesh_access;
+    const std::variant<size_t, double> ndof_trefftz;
+    const bool get_range;
+    const EmbTrefftzMethod method;
+    /// the SVD is the only backend providing the range
+    bool use_svd;
+    const bool fes_has_hidden_dofs;
+    // the integrators for the three bilinear forms,
+    // each for VOL, BND, BBND, BBBND, hence 4 arrays per bilnear form
+    Array<shared_ptr<BilinearFormIntegrator>> op_integrators[4],
+        cop_lhs_integrators[4], cop_rhs_integrators[4];
+
+  public:
+    LocalTrefftzEmbedding (const std::optional<SumOfIntegrals> &op,
+                           const FESpace &fes, const FESpace &fes_test,
+                           const std::optional<SumOfIntegrals> &cop_lhs,
+                           const std::optional<SumOfIntegrals> &cop_rhs,
+                           const shared_ptr<const FESpace> fes_conformity,
+                           const std::variant<size_t, double> ndof_trefftz,
+                           const bool get_range,
+                           const EmbTrefftzMethod method)
+        : op (op), cop_lhs (cop_lhs), cop_rhs (cop_rhs), fes (fes),
+          fes_test (fes_test), fes_conformity (fes_conformity),
+          mesh_access (fes.GetMeshAccess ()), ndof_trefftz (ndof_trefftz),
+          get_range (get_range), method (method),
+          fes_has_hidden_dofs (fesHasHiddenDofs (fes))
+    {
+#ifdef NGSTREFFTZ_USE_LAPACK
+      use_svd = method == EmbTrefftzMethod::SVD
+                || method == EmbTrefftzMethod::JACOBI
+                || method == EmbTrefftzMethod::SUBSPACE || get_range;
+#else
+      if (method == EmbTrefftzMethod::QR || method == EmbTrefftzMethod::EIG)
+        cout << "No Lapack, using the SVD instead of the chosen method"
+             << endl;
+      use_svd = true;
+#endif
+      if (op)
+        calculateBilinearFormIntegrators (*op, op_integrators);
+      if (cop_lhs && cop_rhs)
+        {
+          calculateBilinearFormIntegrators (*cop_lhs, cop_lhs_integrators);
+          calculateBilinearFormIntegrators (*cop_rhs, cop_rhs_integrators);
+        }
+      // const bool fes_conformity_has_hidden_dofs
+      //     = fesHasHiddenDofs (fes_conformity);
+    }
+
+    /// @returns true, if the bilinear forms are not defined on the element
+    bool IsSkipped (const Ngs_Element &mesh_element) const
+    {
+      return !(op && bfIsDefinedOnElement (*op, mesh_element))
+             && !(cop_lhs && bfIsDefinedOnElement (*cop_lhs, mesh_element))
+             && !(cop_rhs && bfIsDefinedOnElement (*cop_rhs, mesh_element));
+    }
 
     // solve the following linear system in an element-wise fashion:
     // L @ T1 = B for the unknown matrix T1,
@@ -602,86 +1777,169 @@ namespace ngcomp
     //  A= |B_1| B= |B_2|    //
     //     | L |    | 0 |    //
     //     \   /    \   /    //
-    mesh_access->IterateElements (
-        VOL, local_heap,
-        [&] (Ngs_Element mesh_element, LocalHeap &local_heap) {
-          const ElementId element_id = ElementId (mesh_element);
+    // The matrices A and B are allocated on the local heap, ndof_test is
+    // returned as third entry.
+    tuple<FlatMatrix<SCAL>, FlatMatrix<SCAL>, size_t>
+    Assemble (const ElementId element_id, Array<DofId> &dofs,
+              Array<DofId> &dofs_test, Array<DofId> &dofs_conforming,
+              LocalHeap &local_heap) const
+    {
+      fes.GetDofNrs (element_id, dofs);
+      fes_test.GetDofNrs (element_id, dofs_test);
+      if (fes_conformity)
+        fes_conformity->GetDofNrs (element_id, dofs_conforming);
+
+      // with B_1.shape == (ndof_conforming, ndof),
+      // L.shape == (ndof_test, ndof)
+      // thus A.shape == (ndof_test + ndof_conforming, ndof)
+      const size_t ndof = dofs.Size ();
+      const size_t ndof_test = dofs_test.Size ();
+      const size_t ndof_conforming = dofs_conforming.Size ();
+      auto elmat_a = FlatMatrix<SCAL> (ndof_test + ndof_conforming, ndof,
+                                       local_heap);
+      auto [elmat_b1, elmat_l] = elmat_a.SplitRows (ndof_conforming);
+
+      // with B_2.shape == (ndof_conforming, ndof_conforming),
+      // and B.shape == ( ndof_conforming + ndof, ndof_conforming)
+      auto elmat_b = FlatMatrix<SCAL> (ndof_test + ndof_conforming,
+                                       ndof_conforming, local_heap);
+      elmat_a = static_cast<SCAL> (0.);
+      elmat_b = static_cast<SCAL> (0.);
+
+      // elmat_b2 is a view into elamt_b
+      MatrixView<SCAL> elmat_b2 = elmat_b.Rows (ndof_conforming);
+
+      // the diff. operator L operates only on volume terms
+      addIntegrationToElementMatrix (elmat_l, op_integrators[VOL],
+                                     *mesh_access, element_id, fes, fes_test,
+                                     local_heap);
+      if (fes_conformity)
+        {
+          for (const auto vorb : { VOL, BND, BBND, BBBND })
+            {
+              addIntegrationToElementMatrix (
+                  elmat_b1, cop_lhs_integrators[vorb], *mesh_access,
+                  element_id, fes, *fes_conformity, local_heap);
+              addIntegrationToElementMatrix (
+                  elmat_b2, cop_rhs_integrators[vorb], *mesh_access,
+                  element_id, *fes_conformity, *fes_conformity, local_heap);
+            }
+        }
+      // if (fes_has_hidden_dofs)
+      //   throw std::invalid_argument (
+      //       "fes has hidden dofs, not supported at the moment");
+      if (fes_has_hidden_dofs)
+        extractVisibleDofs (elmat_a, element_id, fes, fes_test, dofs,
+                            dofs_test, local_heap);
+
+      // reorder elmat_b2
+      // #TODO is this really necessary?
+      reorderMatrixColumns (elmat_b2, dofs_conforming, local_heap);
+
+      return make_tuple (elmat_a, elmat_b, ndof_test);
+    }
 
-          // skip this element, if the bilinear forms are not defined
-          // on this element
-          if (!(op && bfIsDefinedOnElement (*op, mesh_element))
-              && !(cop_lhs && bfIsDefinedOnElement (*cop_lhs, mesh_element))
-              && !(cop_rhs && bfIsDefinedOnElement (*cop_rhs, mesh_element)))
-            return;
+    // computes the embedding P = (T1 | T2) from the local system and writes
+    // it to the matrix returned by `store (height, width, ndof_trefftz)`.
+    // elmat_a gets overwritten by its singular values (or their estimates
+    // |diag(R)| for the QR backend), the pseudoinverse of elmat_a is
+    // allocated on the local heap. If `precomputed_svd` is given, elmat_a
+    // holds its singular values already.
+    // If `statistics` is given, the decomposition and the inversion are
+    // timed there. If `subspace` is given, it is set to whether the kernel
+    // was computed by the subspace iteration, elmat_a holds only column
+    // norms then, no singular values.
+    // Returns the matrix P returned by `store`.
+    template <typename STORE>
+    FlatMatrix<SCAL>
+    Embed (FlatMatrix<SCAL> elmat_a, FlatMatrix<SCAL> elmat_b,
+           const size_t ndof_test, FlatMatrix<SCAL> &elmat_a_inv,
+           const PrecomputedSVD<SCAL> *precomputed_svd, STORE &&store,
+           LocalHeap &local_heap,
+           EmbTrefftzStatistics<SCAL> *statistics = nullptr,
+           bool *subspace = nullptr) const
+    {
+      using Phase = typename EmbTrefftzStatistics<SCAL>::Phase;
+      TTimePoint start = GetTimeCounter ();
+      // adds the time since the last call to `phase`
+      const auto time_phase = [&] (const Phase phase) {
+        if (statistics)
+          statistics->AddTime (phase, start);
+        start = GetTimeCounter ();
+      };
+
+      const size_t ndof = elmat_a.Width ();
+      const size_t ndof_conforming = elmat_b.Width ();
+      if (subspace)
+        *subspace = false;
+
+      // writes P = (T1 | T2), with T1 = A^{-1} B and T2 given
+      const auto store_embedding = [&] (const size_t ndof_trefftz_i,
+                                        const auto &elmat_t2_expr) {
+        // P = (T1 | T2)
+        FlatMatrix<SCAL> elmat_p
+            = store (ndof, ndof_trefftz_i + ndof_conforming, ndof_trefftz_i);
+        // T1 has dimension (ndof, ndof_conforming)
+        // T2 has dimension (ndof, ndof_trefftz_i)
+        auto [elmat_t1, elmat_t2] = elmat_p.SplitCols (ndof_conforming);
+
+        // T1 solves A @ T1 = B,
+        // i.e. T1 = A^{-1} @ B.
+        // A has dimension (ndof + ndof_conforming, ndof),
+        // B has dimension (ndof + ndof_conforming, ndof_conforming),
+        // so T1 has dimension (ndof, ndof_conforming)
+        elmat_t1 = elmat_a_inv * elmat_b;
+        elmat_t2 = elmat_t2_expr;
+        return elmat_p;
+      };
+
+      // the subspace iteration needs the number of Trefftz dofs, without it
+      // or if the iteration does not converge, the SVD below is used
+      if (method == EmbTrefftzMethod::SUBSPACE && op && !get_range
+          && !precomputed_svd && holds_alternative<size_t> (ndof_trefftz)
+          && std::get<size_t> (ndof_trefftz) <= ndof)
+        {
+          const size_t ndof_trefftz_i = std::get<size_t> (ndof_trefftz);
+          FlatMatrix<SCAL, ColMajor> kernel (ndof, ndof_trefftz_i,
+                                             local_heap);
+          elmat_a_inv.AssignMemory (ndof, elmat_a.Height (), local_heap);
+          if (subspaceKernel<SCAL> (elmat_a, kernel, elmat_a_inv,
+                                    local_heap))
+            {
+              time_phase (Phase::DECOMPOSITION);
+              const auto elmat_p = store_embedding (ndof_trefftz_i, kernel);
+              time_phase (Phase::INVERSION);
+              if (subspace)
+                *subspace = true;
+              return elmat_p;
+            }
+        }
 
-          Array<DofId> dofs, dofs_test, dofs_conforming;
-          fes.GetDofNrs (element_id, dofs);
-          fes_test.GetDofNrs (element_id, dofs_test);
-          if (fes_conformity)
-            fes_conformity->GetDofNrs (element_id, dofs_conforming);
-
-          //     /   \    /   \    //
-          //  A= |B_1| B= |B_2|    //
-          //     | L |    | 0 |    //
-          //     \   /    \   /    //
-          // with B_1.shape == (ndof_conforming, ndof),
-          // L.shape == (ndof_test, ndof)
-          // thus A.shape == (ndof_test + ndof_conforming, ndof)
-          size_t ndof = dofs.Size ();
-          const size_t ndof_test = dofs_test.Size ();
-          const size_t ndof_conforming = dofs_conforming.Size ();
-          auto elmat_a = FlatMatrix<SCAL> (ndof_test + ndof_conforming, ndof,
-                                           local_heap);
-          auto [elmat_b1, elmat_l] = elmat_a.SplitRows (ndof_conforming);
-
-          //     /   \    /   \    //
-          //  A= |B_1| B= |B_2|    //
-          //     | L |    | 0 |    //
-          //     \   /    \   /    //
-          // with B_2.shape == (ndof_conforming, ndof_conforming),
-          // and B.shape == ( ndof_conforming + ndof, ndof_conforming)
-          auto elmat_b = FlatMatrix<SCAL> (ndof_test + ndof_conforming,
-                                           ndof_conforming, local_heap);
-          elmat_a = static_cast<SCAL> (0.);
-          elmat_b = static_cast<SCAL> (0.);
-
-          // elmat_b2 is a view into elamt_b
-          MatrixView<SCAL> elmat_b2 = elmat_b.Rows (ndof_conforming);
-
-          // the diff. operator L operates only on volume terms
-          addIntegrationToElementMatrix (elmat_l, op_integrators[VOL],
-                                         *mesh_access, element_id, fes,
-                                         fes_test, local_heap);
-          if (fes_conformity)
+      if (use_svd)
+        {
+          FlatMatrix<SCAL, ColMajor> U, V;
+          if (precomputed_svd)
             {
-              for (const auto vorb : { VOL, BND, BBND, BBBND })
-                {
-                  addIntegrationToElementMatrix (
-                      elmat_b1, cop_lhs_integrators[vorb], *mesh_access,
-                      element_id, fes, *fes_conformity, local_heap);
-                  addIntegrationToElementMatrix (
-                      elmat_b2, cop_rhs_integrators[vorb], *mesh_access,
-                      element_id, *fes_conformity, *fes_conformity,
-                      local_heap);
-                }
+              U.AssignMemory (elmat_a.Height (), elmat_a.Height (),
+                              precomputed_svd->U.Data ());
+              V.AssignMemory (ndof, ndof, precomputed_svd->V.Data ());
             }
-          // if (fes_has_hidden_dofs)
-          //   throw std::invalid_argument (
-          //       "fes has hidden dofs, not supported at the moment");
-          if (fes_has_hidden_dofs)
+          else
             {
-              extractVisibleDofs (elmat_a, element_id, fes, fes_test, dofs,
-                                  dofs_test, local_heap);
-              ndof = dofs.Size ();
+              U.AssignMemory (elmat_a.Height (), elmat_a.Height (),
+                              local_heap);
+              V.AssignMemory (ndof, ndof, local_heap);
+              if (method == EmbTrefftzMethod::JACOBI)
+                batchedJacobiSVD<SCAL> (
+                    FlatArray<FlatMatrix<SCAL>> (1, &elmat_a),
+                    FlatArray<FlatMatrix<SCAL, ColMajor>> (1, &U),
+                    FlatArray<FlatMatrix<SCAL, ColMajor>> (1, &V),
+                    local_heap);
+              else
+                getSVD<SCAL> (elmat_a, U, V);
             }
 
-          // reorder elmat_b2
-          // #TODO is this really necessary?
-          reorderMatrixColumns (elmat_b2, dofs_conforming, local_heap);
-
-          FlatMatrix<SCAL, ColMajor> U (elmat_a.Height (), local_heap),
-              V (elmat_a.Width (), local_heap);
-          getSVD<SCAL> (elmat_a, U, V);
+          time_phase (Phase::DECOMPOSITION);
 
           // # TODO: incorporate the double variant
           const size_t ndof_trefftz_i
@@ -690,162 +1948,1343 @@ namespace ngcomp
 
           const auto elmat_a_inv_expr
               = invertSVD (U, elmat_a, V, ndof_trefftz_i, local_heap);
-          FlatMatrix<SCAL> elmat_a_inv (ndof, ndof_conforming + ndof_test,
-                                        local_heap);
+          elmat_a_inv.AssignMemory (ndof, elmat_a.Height (), local_heap);
           // Calculate the matrix entries and write them to memory.
           elmat_a_inv = elmat_a_inv_expr;
 
-          // P = (T1 | T2)
-          Matrix<SCAL> elmat_p (ndof, ndof_trefftz_i + ndof_conforming);
-          // T1 has dimension (ndof, ndof_conforming)
-          // T2 has dimension (ndof, ndof_trefftz_i)
-          auto [elmat_t1, elmat_t2] = elmat_p.SplitCols (ndof_conforming);
+          // standard embedded Trefftz behaviour is get_range==false
+          const auto elmat_p
+              = (get_range)
+                    ? store_embedding (ndof_trefftz_i,
+                                       U.Cols (0, ndof - ndof_trefftz_i))
+                    : store_embedding (
+                        ndof_trefftz_i,
+                        Trans (V.Rows (ndof - ndof_trefftz_i, ndof)));
+          time_phase (Phase::INVERSION);
+          return elmat_p;
+        }
+
+      // W is an orthonormal basis, whose first columns span the range
+      // of A^H and whose last columns span the kernel of A
+      FlatMatrix<SCAL> elmat_a_copy (elmat_a.Height (), ndof, local_heap);
+      elmat_a_copy = elmat_a;
+      FlatMatrix<SCAL, ColMajor> W (ndof, local_heap);
+#ifdef NGSTREFFTZ_USE_LAPACK
+      if (method == EmbTrefftzMethod::QR)
+        LapackPivotedQR (elmat_a, W);
+      else
+        getEigenBasis<SCAL> (elmat_a, W, local_heap);
+#endif
+      time_phase (Phase::DECOMPOSITION);
+      const size_t ndof_trefftz_i
+          = calcNdofTrefftz (ndof, ndof_test, ndof_conforming, ndof_trefftz,
+                             !op, elmat_a.Diag ());
+      const size_t rank
+          = min (ndof - ndof_trefftz_i, size_t (elmat_a.Height ()));
+      elmat_a_inv.AssignMemory (ndof, elmat_a.Height (), local_heap);
+      invertWithBasis<SCAL> (elmat_a_copy, W.Cols (0, rank), elmat_a_inv,
+                             local_heap);
+      const auto elmat_p = store_embedding (
+          ndof_trefftz_i, W.Cols (ndof - ndof_trefftz_i, ndof));
+      time_phase (Phase::INVERSION);
+      return elmat_p;
+    }
+  };
+
+  template <typename SCAL>
+  pair<ElmatArena<SCAL>, Array<shared_ptr<ngla::BaseVector>>>
+  EmbTrefftzMultiRhs (
+      const std::optional<SumOfIntegrals> &op, const FESpace &fes,
+      const FESpace &fes_test,
+      const std::optional<ngfem::SumOfIntegrals> &cop_lhs,
+      const std::optional<ngfem::SumOfIntegrals> &cop_rhs,
+      const shared_ptr<const FESpace> fes_conformity,
+      FlatArray<shared_ptr<const ngfem::SumOfIntegrals>> linear_forms,
+      const std::variant<size_t, double> ndof_trefftz,
+      shared_ptr<std::map<std::string, Vector<SCAL>>> stats,
+      const bool get_range, const bool dedup, const std::string &cache_dir,
+      const EmbTrefftzMethod method, shared_ptr<const BitArray> elements)
+  {
+    // a partial embedding is never cached
+    std::optional<size_t> cache_key;
+    if (!cache_dir.empty () && !elements)
+      cache_key = EmbTrefftzCacheKey (
+          op, fes, fes_test, cop_lhs, cop_rhs, fes_conformity, linear_forms,
+          ndof_trefftz, get_range, std::is_same_v<SCAL, Complex>, method);
+    const bool use_cache = cache_key.has_value ();
+    std::string cache_file;
+    if (use_cache)
+      {
+        cache_file = EmbTrefftzCacheFile (cache_dir, *cache_key);
+        // the statistics are not part of the cache
+        if (!stats)
+          if (auto cached = LoadEmbTrefftzCache<SCAL> (
+                  cache_file, *cache_key, fes.GetMeshAccess ()->GetNE (VOL)))
+            {
+              // the cache holds the local values of the solutions
+              if (fes.GetParallelDofs ())
+                for (auto &solution : cached->second)
+                  {
+                    auto parallel_solution = createSolutionVector<SCAL> (fes);
+                    parallel_solution->FV<SCAL> () = solution->FV<SCAL> ();
+                    solution = parallel_solution;
+                  }
+              return std::move (*cached);
+            }
+      }
+
+    // statistics stuff, one accumulator per thread
+    using Phase = typename EmbTrefftzStatistics<SCAL>::Phase;
+    Array<EmbTrefftzStatistics<SCAL>> thread_statistics (
+        (stats) ? TaskManager::GetMaxThreads () : 0);
+    const auto get_statistics = [&] () -> EmbTrefftzStatistics<SCAL> * {
+      return (stats) ? &thread_statistics[TaskManager::GetThreadId ()]
+                     : nullptr;
+    };
+    // adds the time since `start` to `phase` of the calling thread
+    const auto time_phase = [&] (const Phase phase, const TTimePoint start) {
+      if (stats)
+        get_statistics ()->AddTime (phase, start);
+    };
+
+    auto mesh_access = fes.GetMeshAccess ();
+    const size_t num_elements = mesh_access->GetNE (VOL);
+    // #TODO what is a good size for the local heap?
+    // For the moment: large enough constant size.
+    LocalHeap local_heap
+        = LocalHeap (getNumberOfThreads () * 10 * 1000 * 1000);
+
+    const LocalTrefftzEmbedding<SCAL> local_embedding (
+        op, fes, fes_test, cop_lhs, cop_rhs, fes_conformity, ndof_trefftz,
+        get_range, method);
+    EmbTrefftzTrace &trace = EmbTrefftzTrace::Get ();
+
+    Array<shared_ptr<BaseVector>> particular_solutions (linear_forms.Size ());
+    Array<LinearFormIntegrators> lfis (linear_forms.Size ());
+    for (size_t j = 0; j < linear_forms.Size (); j++)
+      {
+        particular_solutions[j] = createSolutionVector<SCAL> (fes);
+        *particular_solutions[j] = 0.0;
+        calculateLinearFormIntegrators (*linear_forms[j], lfis[j].data ());
+      }
+    // writes the element-local particular solutions to the global vectors
+    const auto set_particular_solutions
+        = [&] (const Array<DofId> &dofs, FlatMatrix<SCAL, ColMajor> elsols) {
+            for (size_t j = 0; j < particular_solutions.Size (); j++)
+              particular_solutions[j]->SetIndirect (dofs, elsols.Col (j));
+          };
+
+    // skip an element, if it is not selected or the bilinear forms are not
+    // defined on it
+    const auto is_skipped = [&] (const Ngs_Element &mesh_element) {
+      return (elements && !elements->Test (mesh_element.Nr ()))
+             || local_embedding.IsSkipped (mesh_element);
+    };
+
+    // Reserve space for the embedding of every element. The exact number of
+    // Trefftz dofs is only known after the SVD, so in general we reserve for
+    // the largest possible one and compact the arena afterwards.
+    ElmatArena<SCAL> element_matrices;
+    {
+      Array<size_t> capacities (num_elements);
+      ParallelFor (Range (num_elements), [&] (size_t elnr) {
+        const ElementId element_id (VOL, elnr);
+        capacities[elnr] = 0;
+        if (is_skipped (mesh_access->GetElement (element_id)))
+          return;
+        Array<DofId> dofs, dofs_conforming;
+        fes.GetDofNrs (element_id, dofs);
+        if (fes_conformity)
+          fes_conformity->GetDofNrs (element_id, dofs_conforming);
+        const size_t max_ndof_trefftz
+            = (op && holds_alternative<size_t> (ndof_trefftz))
+                  ? std::get<size_t> (ndof_trefftz)
+                  : dofs.Size ();
+        capacities[elnr]
+            = dofs.Size () * (max_ndof_trefftz + dofs_conforming.Size ());
+      });
+      element_matrices.Reserve (capacities);
+    }
+
+    // the condition numbers are written per element, every element is
+    // embedded by one thread only
+    Array<double> element_conditions ((stats) ? num_elements : 0);
+    element_conditions = 0.0;
+    const auto add_stats
+        = [&] (const ElementId element_id, FlatVector<SCAL> singular_values,
+               const size_t ndof, const size_t ndof_trefftz_i,
+               LocalHeap &local_heap) {
+            const double condition = localConditionNumber<SCAL> (
+                singular_values, ndof - ndof_trefftz_i, local_heap);
+            element_conditions[element_id.Nr ()] = condition;
+            get_statistics ()->Add (singular_values, condition);
+          };
+
+    // Sort the elements into classes of geometrically congruent elements.
+    // Only the representative of a class is embedded in the first pass,
+    // the other elements try to reuse its embedding in the second pass.
+    Array<int> element_class (dedup ? num_elements : 0);
+    Array<CongruentElementClass<SCAL>> classes;
+    if (dedup)
+      {
+        static Timer timer ("EmbTrefftz: classify elements");
+        RegionTimer reg (timer);
+
+        Array<size_t> keys (num_elements);
+        ParallelFor (Range (num_elements), [&] (size_t elnr) {
+          const ElementId element_id (VOL, elnr);
+          element_class[elnr] = is_skipped (mesh_access->GetElement (element_id))
+                                    ? -1
+                                    : 0;
+          keys[elnr] = elementGeometryKey (*mesh_access, element_id);
+        });
+
+        std::unordered_map<size_t, int> key_to_class;
+        for (size_t elnr = 0; elnr < num_elements; elnr++)
+          {
+            if (element_class[elnr] < 0)
+              continue;
+            const auto [it, inserted]
+                = key_to_class.emplace (keys[elnr], classes.Size ());
+            if (inserted)
+              {
+                classes.Append (CongruentElementClass<SCAL>{});
+                classes.Last ().representative = elnr;
+              }
+            element_class[elnr] = it->second;
+          }
+      }
+
+    // embeds the element from its assembled local system
+    const auto finish_element = [&] (const ElementId element_id,
+                                     const Array<DofId> &dofs,
+                                     FlatMatrix<SCAL> elmat_a,
+                                     FlatMatrix<SCAL> elmat_b,
+                                     const size_t ndof_test,
+                                     const PrecomputedSVD<SCAL> *precomputed_svd,
+                                     LocalHeap &local_heap) {
+      CongruentElementClass<SCAL> *congruent_class
+          = (dedup) ? &classes[element_class[element_id.Nr ()]] : nullptr;
+      const bool is_representative
+          = congruent_class
+            && congruent_class->representative == element_id.Nr ();
+
+      // try to reuse the embedding of the representative of the class
+      if (congruent_class && !is_representative && congruent_class->embedded)
+        {
+          const auto c = scalarMultipleOf<SCAL> (
+              elmat_a, congruent_class->elmat_a, congruence_tolerance);
+          if (c
+              && isScalarMultipleOf<SCAL> (elmat_b, congruent_class->elmat_b,
+                                           *c, congruence_tolerance))
+            {
+              // singular values of c * A are |c| times the ones of A
+              FlatVector<SCAL> singular_values (
+                  congruent_class->singular_values.Size (), local_heap);
+              singular_values = abs (*c) * congruent_class->singular_values;
+              const size_t ndof_trefftz_i = calcNdofTrefftz (
+                  elmat_a.Width (), ndof_test, elmat_b.Width (), ndof_trefftz,
+                  !op, singular_values);
+              if (ndof_trefftz_i
+                  == element_matrices.GetNdofTrefftz (
+                      congruent_class->representative))
+                {
+                  // (c A)^{-1} (c B) = A^{-1} B, so the embedding is the same
+                  element_matrices.Alias (element_id.Nr (),
+                                          congruent_class->representative);
+                  const TTimePoint start = GetTimeCounter ();
+                  if (linear_forms.Size ())
+                    set_particular_solutions (
+                        dofs,
+                        calculateParticularSolutions<SCAL> (
+                            lfis, fes_test, element_id, *mesh_access, dofs,
+                            ndof_test,
+                            (SCAL (1.0) / *c) * congruent_class->elmat_a_inv,
+                            local_heap));
+                  time_phase (Phase::PARTICULAR_SOLUTION, start);
+                  if (trace.Level () != EMBT_TRACE_OFF)
+                    trace.Add<SCAL> (element_id, ndof_test, elmat_b.Width (),
+                                     ndof_trefftz_i,
+                                     element_matrices.GetElmat (
+                                         congruent_class->representative));
+                  if (stats && congruent_class->has_singular_values)
+                    add_stats (element_id, singular_values, elmat_a.Width (),
+                               ndof_trefftz_i, local_heap);
+                  return;
+                }
+            }
+        }
+
+      if (is_representative)
+        {
+          congruent_class->elmat_a.SetSize (elmat_a.Height (),
+                                            elmat_a.Width ());
+          congruent_class->elmat_a = elmat_a;
+          congruent_class->elmat_b.SetSize (elmat_b.Height (),
+                                            elmat_b.Width ());
+          congruent_class->elmat_b = elmat_b;
+        }
+
+      FlatMatrix<SCAL> elmat_a_inv;
+      bool subspace = false;
+      const auto elmat_p = local_embedding.Embed (
+          elmat_a, elmat_b, ndof_test, elmat_a_inv, precomputed_svd,
+          [&] (const size_t height, const size_t width,
+               const size_t ndof_trefftz_i) {
+            return element_matrices.SetElmat (element_id.Nr (), height, width,
+                                              ndof_trefftz_i);
+          },
+          local_heap, get_statistics (), &subspace);
+
+      if (is_representative)
+        {
+          congruent_class->elmat_a_inv.SetSize (elmat_a_inv.Height (),
+                                                elmat_a_inv.Width ());
+          congruent_class->elmat_a_inv = elmat_a_inv;
+          congruent_class->singular_values.SetSize (
+              min (elmat_a.Height (), elmat_a.Width ()));
+          congruent_class->singular_values = elmat_a.Diag ();
+          congruent_class->has_singular_values = !subspace;
+          congruent_class->embedded = true;
+        }
+
+      const TTimePoint start = GetTimeCounter ();
+      if (linear_forms.Size ())
+        set_particular_solutions (
+            dofs, calculateParticularSolutions<SCAL> (
+                      lfis, fes_test, element_id, *mesh_access, dofs,
+                      ndof_test, elmat_a_inv, local_heap));
+      time_phase (Phase::PARTICULAR_SOLUTION, start);
+      // the column norms of the subspace iteration are no singular values
+      if (stats && !subspace)
+        {
+          FlatVector<SCAL> singular_values (
+              min (elmat_a.Height (), elmat_a.Width ()), local_heap);
+          singular_values = elmat_a.Diag ();
+          add_stats (element_id, singular_values, elmat_a.Width (),
+                     element_matrices.GetNdofTrefftz (element_id.Nr ()),
+                     local_heap);
+        }
+
+      if (trace.Level () != EMBT_TRACE_OFF)
+        trace.Add<SCAL> (element_id, ndof_test, elmat_b.Width (),
+                         element_matrices.GetNdofTrefftz (element_id.Nr ()),
+                         elmat_p);
+    };
+
+    const auto process_element = [&] (const ElementId element_id,
+                                      LocalHeap &local_heap) {
+      Array<DofId> dofs, dofs_test, dofs_conforming;
+      const TTimePoint start = GetTimeCounter ();
+      auto [elmat_a, elmat_b, ndof_test] = local_embedding.Assemble (
+          element_id, dofs, dofs_test, dofs_conforming, local_heap);
+      time_phase (Phase::INTEGRATION, start);
+      finish_element (element_id, dofs, elmat_a, elmat_b, ndof_test, nullptr,
+                      local_heap);
+    };
+
+    // assembles the local systems of a batch of elements, decomposes the
+    // ones of equal shape together with the batched Jacobi SVD, and embeds
+    // the elements
+    const auto process_batch = [&] (FlatArray<size_t> elnrs,
+                                    LocalHeap &local_heap) {
+      const size_t num = elnrs.Size ();
+      Array<Array<DofId>> dofs (num);
+      Array<FlatMatrix<SCAL>> elmats_a (num), elmats_b (num);
+      Array<size_t> ndofs_test (num);
+      Array<DofId> dofs_test, dofs_conforming;
+      TTimePoint start = GetTimeCounter ();
+      for (size_t i = 0; i < num; i++)
+        {
+          auto [elmat_a, elmat_b, ndof_test] = local_embedding.Assemble (
+              ElementId (VOL, elnrs[i]), dofs[i], dofs_test, dofs_conforming,
+              local_heap);
+          elmats_a[i].AssignMemory (elmat_a.Height (), elmat_a.Width (),
+                                    elmat_a.Data ());
+          elmats_b[i].AssignMemory (elmat_b.Height (), elmat_b.Width (),
+                                    elmat_b.Data ());
+          ndofs_test[i] = ndof_test;
+        }
+      time_phase (Phase::INTEGRATION, start);
+      start = GetTimeCounter ();
+
+      Array<PrecomputedSVD<SCAL>> svds (num);
+      Array<bool> decomposed (num);
+      decomposed = false;
+      Array<FlatMatrix<SCAL>> batch_a (num);
+      Array<FlatMatrix<SCAL, ColMajor>> batch_u (num), batch_v (num);
+      for (size_t i = 0; i < num; i++)
+        {
+          if (decomposed[i])
+            continue;
+          size_t batch_size = 0;
+          for (size_t j = i; j < num; j++)
+            if (!decomposed[j]
+                && elmats_a[j].Height () == elmats_a[i].Height ()
+                && elmats_a[j].Width () == elmats_a[i].Width ())
+              {
+                const size_t height = elmats_a[j].Height ();
+                const size_t width = elmats_a[j].Width ();
+                svds[j].U.AssignMemory (height, height, local_heap);
+                svds[j].V.AssignMemory (width, width, local_heap);
+                batch_a[batch_size].AssignMemory (height, width,
+                                                  elmats_a[j].Data ());
+                batch_u[batch_size].AssignMemory (height, height,
+                                                  svds[j].U.Data ());
+                batch_v[batch_size].AssignMemory (width, width,
+                                                  svds[j].V.Data ());
+                batch_size++;
+                decomposed[j] = true;
+              }
+          batchedJacobiSVD<SCAL> (batch_a.Range (0, batch_size),
+                                  batch_u.Range (0, batch_size),
+                                  batch_v.Range (0, batch_size), local_heap);
+        }
+      time_phase (Phase::DECOMPOSITION, start);
+
+      for (size_t i = 0; i < num; i++)
+        finish_element (ElementId (VOL, elnrs[i]), dofs[i], elmats_a[i],
+                        elmats_b[i], ndofs_test[i], &svds[i], local_heap);
+    };
+
+    if (method == EmbTrefftzMethod::JACOBI && !dedup)
+      {
+        Array<size_t> active_elnrs;
+        for (size_t elnr = 0; elnr < num_elements; elnr++)
+          if (!is_skipped (mesh_access->GetElement (ElementId (VOL, elnr))))
+            active_elnrs.Append (elnr);
+
+        // two SIMD widths per batch, to keep the local systems of a batch in
+        // cache
+        constexpr size_t batch_size = 2 * SIMD<double>::Size ();
+        const size_t num_batches
+            = (active_elnrs.Size () + batch_size - 1) / batch_size;
+        ParallelForRange (num_batches, [&] (IntRange batches) {
+          LocalHeap thread_heap = local_heap.Split ();
+          for (size_t batch : batches)
+            {
+              const HeapReset hr (thread_heap);
+              process_batch (
+                  active_elnrs.Range (
+                      batch * batch_size,
+                      min ((batch + 1) * batch_size, active_elnrs.Size ())),
+                  thread_heap);
+            }
+        });
+      }
+    else
+      {
+        // with dedup, the first pass only embeds the representatives
+        mesh_access->IterateElements (
+            VOL, local_heap,
+            [&] (Ngs_Element mesh_element, LocalHeap &local_heap) {
+              const ElementId element_id = ElementId (mesh_element);
+              if (is_skipped (mesh_element))
+                return;
+              if (dedup
+                  && classes[element_class[element_id.Nr ()]].representative
+                         != element_id.Nr ())
+                return;
+              process_element (element_id, local_heap);
+            });
+        if (dedup)
+          mesh_access->IterateElements (
+              VOL, local_heap,
+              [&] (Ngs_Element mesh_element, LocalHeap &local_heap) {
+                const ElementId element_id = ElementId (mesh_element);
+                if (is_skipped (mesh_element)
+                    || classes[element_class[element_id.Nr ()]].representative
+                           == element_id.Nr ())
+                  return;
+                process_element (element_id, local_heap);
+              });
+      }
+
+    if (stats)
+      {
+        EmbTrefftzStatistics<SCAL> statistics;
+        for (const auto &thread_stats : thread_statistics)
+          statistics.Merge (thread_stats);
+        Vector<SCAL> sing_val_avg = statistics.sing_val_sum;
+        if (statistics.active_elements)
+          sing_val_avg /= statistics.active_elements;
+        (*stats)["singavg"] = std::move (sing_val_avg);
+        (*stats)["singmax"] = Vector<double> (statistics.sing_val_max);
+        (*stats)["singmin"] = Vector<double> (statistics.sing_val_min);
+
+        Vector<SCAL> ndofs_trefftz (num_elements), conditions (num_elements);
+        for (size_t elnr = 0; elnr < num_elements; elnr++)
+          {
+            ndofs_trefftz[elnr] = (element_matrices.IsDefined (elnr))
+                                      ? element_matrices.GetNdofTrefftz (elnr)
+                                      : 0;
+            conditions[elnr] = element_conditions[elnr];
+          }
+        (*stats)["ndoftrefftz"] = std::move (ndofs_trefftz);
+        (*stats)["cond"] = std::move (conditions);
+
+        Vector<SCAL> histogram (statistics.num_condition_bins);
+        for (size_t i = 0; i < statistics.num_condition_bins; i++)
+          histogram[i] = statistics.condition_histogram[i];
+        (*stats)["condhist"] = std::move (histogram);
+
+        Vector<SCAL> timings (Phase::NUM_PHASES);
+        for (size_t i = 0; i < Phase::NUM_PHASES; i++)
+          timings[i] = statistics.phase_seconds[i];
+        (*stats)["timings"] = std::move (timings);
+      }
+
+    {
+      static Timer timer ("EmbTrefftz: compact");
+      RegionTimer reg (timer);
+      element_matrices.Compact ();
+    }
+
+    if (use_cache)
+      StoreEmbTrefftzCache<SCAL> (cache_file, *cache_key, element_matrices,
+                                  particular_solutions);
+
+    return make_pair (std::move (element_matrices),
+                      std::move (particular_solutions));
+  }
+
+  template <typename SCAL>
+  pair<ElmatArena<SCAL>, shared_ptr<ngla::BaseVector>>
+  EmbTrefftz (const std::optional<SumOfIntegrals> &op, const FESpace &fes,
+              const FESpace &fes_test,
+              const std::optional<ngfem::SumOfIntegrals> &cop_lhs,
+              const std::optional<ngfem::SumOfIntegrals> &cop_rhs,
+              const shared_ptr<const FESpace> fes_conformity,
+              shared_ptr<const ngfem::SumOfIntegrals> linear_form,
+              const std::variant<size_t, double> ndof_trefftz,
+              shared_ptr<std::map<std::string, Vector<SCAL>>> stats,
+              const bool get_range, const bool dedup,
+              const std::string &cache_dir, const EmbTrefftzMethod method,
+              shared_ptr<const BitArray> elements)
+  {
+    Array<shared_ptr<const SumOfIntegrals>> linear_forms;
+    if (linear_form)
+      linear_forms.Append (linear_form);
+    auto [element_matrices, particular_solutions] = EmbTrefftzMultiRhs<SCAL> (
+        op, fes, fes_test, cop_lhs, cop_rhs, fes_conformity, linear_forms,
+        ndof_trefftz, stats, get_range, dedup, cache_dir, method, elements);
+
+    if (particular_solutions.Size ())
+      return make_pair (std::move (element_matrices), particular_solutions[0]);
+    shared_ptr<BaseVector> particular_solution
+        = createSolutionVector<SCAL> (fes);
+    *particular_solution = 0.0;
+    return make_pair (std::move (element_matrices), particular_solution);
+  }
+
+  ////////////////////////// EmbTrefftzOperator ///////////////////////////
+
+  /// number of vectors, from which the multi-vector product of
+  /// EmbTrefftzOperator forms the element matrices once instead of applying
+  /// the integrators to every vector
+  constexpr size_t element_matrix_min_vectors = 4;
+
+  template <typename SCAL>
+  EmbTrefftzOperator<SCAL>::EmbTrefftzOperator (
+      shared_ptr<const ElmatArena<SCAL>> ETmats, shared_ptr<BilinearForm> bf,
+      Table<DofId> dofs, Table<DofId> trefftz_dofs, size_t ndof_trefftz)
+      : ETmats (ETmats), bf (bf), dofs (std::move (dofs)),
+        trefftz_dofs (std::move (trefftz_dofs)), ndof_trefftz (ndof_trefftz)
+  {
+    // the element matrix of A needs all dofs of the element, so hidden dofs,
+    // which are not part of the embedding, rule out the element-wise path
+    const auto fes = bf->GetTrialSpace ();
+    bool element_wise = !fesHasHiddenDofs (*fes);
+    // P x restricted to an element is P_T x_T only if the elements do not
+    // share dofs, as for L2 spaces
+    Array<int> dof_elements (fes->GetNDof ());
+    dof_elements = 0;
+    for (size_t elnr = 0; elnr < this->dofs.Size (); elnr++)
+      for (const DofId d : this->dofs[elnr])
+        if (IsRegularDof (d) && ++dof_elements[d] > 1)
+          element_wise = false;
+    for (const auto &bfi : bf->Integrators ())
+      element_wise = element_wise && bfi->VB () == VOL && !bfi->SkeletonForm ();
+    if (element_wise)
+      element_integrators = bf->Integrators ();
+    if (!element_integrators.Size ())
+      {
+        work_u = make_shared<VVector<SCAL>> (fes->GetNDof ());
+        work_au = make_shared<VVector<SCAL>> (fes->GetNDof ());
+      }
+  }
+
+  template <typename SCAL>
+  LocalHeap &EmbTrefftzOperator<SCAL>::getHeap () const
+  {
+    if (!heap)
+      heap = make_unique<LocalHeap> (
+          getNumberOfThreads () * 10 * 1000 * 1000, "EmbTrefftzOperator");
+    return *heap;
+  }
+
+  template <typename SCAL>
+  void
+  EmbTrefftzOperator<SCAL>::Mult (const BaseVector &x, BaseVector &y) const
+  {
+    y = 0.0;
+    multAdd<double> (1.0, x, y);
+  }
+
+  template <typename SCAL>
+  void EmbTrefftzOperator<SCAL>::MultAdd (double s, const BaseVector &x,
+                                          BaseVector &y) const
+  {
+    multAdd<double> (s, x, y);
+  }
+
+  template <typename SCAL>
+  void EmbTrefftzOperator<SCAL>::MultAdd (Complex s, const BaseVector &x,
+                                          BaseVector &y) const
+  {
+    if constexpr (std::is_same_v<SCAL, Complex>)
+      multAdd<Complex> (s, x, y);
+    else
+      BaseMatrix::MultAdd (s, x, y);
+  }
+
+  template <typename SCAL>
+  template <typename TSCAL>
+  void EmbTrefftzOperator<SCAL>::multAdd (TSCAL s, const BaseVector &x,
+                                          BaseVector &y) const
+  {
+    static Timer timer ("EmbTrefftzOperator: MultAdd");
+    RegionTimer reg (timer);
+
+    const auto fes = bf->GetTrialSpace ();
+    const auto ma = fes->GetMeshAccess ();
+    LocalHeap &local_heap = getHeap ();
+    const HeapReset hr (local_heap);
+
+    if (element_integrators.Size ())
+      {
+        // y_T += s P_T^T A_T P_T x_T
+        ma->IterateElements (VOL, local_heap, [&] (auto ei, LocalHeap &lh) {
+          if (!ETmats->IsDefined (ei.Nr ()))
+            return;
+          const auto P = ETmats->GetElmat (ei.Nr ());
+          const auto tdofs = trefftz_dofs[ei.Nr ()];
+
+          FlatVector<SCAL> elx (tdofs.Size (), lh);
+          x.GetIndirect (tdofs, elx);
+          FlatVector<SCAL> elu (P.Height (), lh), elau (P.Height (), lh),
+              elai (P.Height (), lh);
+          elu = P * elx;
+          elau = static_cast<SCAL> (0.0);
+
+          const auto &fel = fes->GetFE (ei, lh);
+          const auto &trafo = ma->GetTrafo (ei, lh);
+          for (const auto &bfi : element_integrators)
+            if (bfi->DefinedOnElement (ei.Nr ()))
+              {
+                auto &mapped_trafo = trafo.AddDeformation (
+                    bfi->GetDeformation ().get (), lh);
+                bfi->ApplyElementMatrix (fel, mapped_trafo, elu, elai,
+                                         nullptr, lh);
+                elau += elai;
+              }
+          elx = s * Trans (P) * elau;
+          y.AddIndirect (tdofs, elx, true);
+        });
+        return;
+      }
+
+    // u = P x, au = A u, y += s P^T au
+    auto &u = work_u;
+    auto &au = work_au;
+    *u = 0.0;
+    ParallelForRange (ma->GetNE (VOL), [&] (IntRange r) {
+      for (size_t elnr : r)
+        if (ETmats->IsDefined (elnr))
+          {
+            const auto P = ETmats->GetElmat (elnr);
+            Vector<SCAL> elx (trefftz_dofs[elnr].Size ()), elu (P.Height ());
+            x.GetIndirect (trefftz_dofs[elnr], elx);
+            elu = P * elx;
+            // the elements may share dofs, where P sums their embeddings
+            u->AddIndirect (dofs[elnr], elu, true);
+          }
+    });
+    bf->ApplyMatrix (*u, *au, local_heap);
+    ParallelForRange (ma->GetNE (VOL), [&] (IntRange r) {
+      for (size_t elnr : r)
+        if (ETmats->IsDefined (elnr))
+          {
+            const auto P = ETmats->GetElmat (elnr);
+            Vector<SCAL> elau (P.Height ()), ely (P.Width ());
+            au->GetIndirect (dofs[elnr], elau);
+            ely = s * Trans (P) * elau;
+            y.AddIndirect (trefftz_dofs[elnr], ely, true);
+          }
+    });
+  }
+
+  template <typename SCAL>
+  void EmbTrefftzOperator<SCAL>::Mult (const MultiVector &x,
+                                       MultiVector &y) const
+  {
+    static Timer timer ("EmbTrefftzOperator: Mult MultiVector");
+    RegionTimer reg (timer);
+
+    const size_t num_vectors = x.Size ();
+    const auto fes = bf->GetTrialSpace ();
+    const auto ma = fes->GetMeshAccess ();
+    LocalHeap &local_heap = getHeap ();
+    const HeapReset hr (local_heap);
+    for (size_t j = 0; j < num_vectors; j++)
+      *y[j] = 0.0;
+
+    // the element vectors of all vectors are stored as rows of one matrix,
+    // s.t. the embedding is applied to all of them by one product
+    const auto gather = [num_vectors] (const MultiVector &vecs,
+                                       FlatArray<DofId> dnums,
+                                       FlatMatrix<SCAL> elvecs) {
+      for (size_t j = 0; j < num_vectors; j++)
+        {
+          FlatVector<SCAL> row = elvecs.Row (j);
+          vecs[j]->GetIndirect (dnums, row);
+        }
+    };
+    const auto scatter_add = [num_vectors] (MultiVector &vecs,
+                                            FlatArray<DofId> dnums,
+                                            FlatMatrix<SCAL> elvecs) {
+      for (size_t j = 0; j < num_vectors; j++)
+        vecs[j]->AddIndirect (dnums, elvecs.Row (j), true);
+    };
+
+    if (element_integrators.Size ())
+      {
+        ma->IterateElements (VOL, local_heap, [&] (auto ei, LocalHeap &lh) {
+          if (!ETmats->IsDefined (ei.Nr ()))
+            return;
+          const auto P = ETmats->GetElmat (ei.Nr ());
+          const auto tdofs = trefftz_dofs[ei.Nr ()];
+
+          FlatMatrix<SCAL> elx (num_vectors, P.Width (), lh);
+          gather (x, tdofs, elx);
+          const auto &fel = fes->GetFE (ei, lh);
+          const auto &trafo = ma->GetTrafo (ei, lh);
+
+          if (num_vectors >= element_matrix_min_vectors)
+            {
+              // P_T^T A_T P_T is formed once and applied to all vectors by
+              // one matrix-matrix product
+              FlatMatrix<SCAL> elmat (P.Height (), P.Height (), lh),
+                  elmat_i (P.Height (), P.Height (), lh);
+              elmat = static_cast<SCAL> (0.0);
+              for (const auto &bfi : element_integrators)
+                if (bfi->DefinedOnElement (ei.Nr ()))
+                  {
+                    auto &mapped_trafo = trafo.AddDeformation (
+                        bfi->GetDeformation ().get (), lh);
+                    bfi->CalcElementMatrix (fel, mapped_trafo, elmat_i, lh);
+                    elmat += elmat_i;
+                  }
+              FlatMatrix<SCAL> elmat_ap (P.Height (), P.Width (), lh);
+              FlatMatrix<SCAL> elmat_ptap (P.Width (), P.Width (), lh);
+              elmat_ap = elmat * P;
+              elmat_ptap = Trans (P) * elmat_ap;
+              FlatMatrix<SCAL> ely (num_vectors, P.Width (), lh);
+              ely = elx * Trans (elmat_ptap);
+              scatter_add (y, tdofs, ely);
+              return;
+            }
+
+          FlatMatrix<SCAL> elu (num_vectors, P.Height (), lh),
+              elau (num_vectors, P.Height (), lh);
+          FlatVector<SCAL> elai (P.Height (), lh);
+          elu = elx * Trans (P);
+          elau = static_cast<SCAL> (0.0);
+          for (const auto &bfi : element_integrators)
+            if (bfi->DefinedOnElement (ei.Nr ()))
+              {
+                auto &mapped_trafo = trafo.AddDeformation (
+                    bfi->GetDeformation ().get (), lh);
+                for (size_t j = 0; j < num_vectors; j++)
+                  {
+                    bfi->ApplyElementMatrix (fel, mapped_trafo, elu.Row (j),
+                                             elai, nullptr, lh);
+                    elau.Row (j) += elai;
+                  }
+              }
+          elx = elau * P;
+          scatter_add (y, tdofs, elx);
+        });
+        return;
+      }
+
+    if (!work_us || work_us->Size () != num_vectors)
+      {
+        work_us = make_unique<MultiVector> (work_u, num_vectors);
+        work_aus = make_unique<MultiVector> (work_u, num_vectors);
+      }
+    MultiVector &us = *work_us;
+    MultiVector &aus = *work_aus;
+    for (size_t j = 0; j < num_vectors; j++)
+      *us[j] = 0.0;
+    ma->IterateElements (VOL, local_heap, [&] (auto ei, LocalHeap &lh) {
+      if (!ETmats->IsDefined (ei.Nr ()))
+        return;
+      const auto P = ETmats->GetElmat (ei.Nr ());
+      FlatMatrix<SCAL> elx (num_vectors, P.Width (), lh);
+      FlatMatrix<SCAL> elu (num_vectors, P.Height (), lh);
+      gather (x, trefftz_dofs[ei.Nr ()], elx);
+      elu = elx * Trans (P);
+      scatter_add (us, dofs[ei.Nr ()], elu);
+    });
+    for (size_t j = 0; j < num_vectors; j++)
+      bf->ApplyMatrix (*us[j], *aus[j], local_heap);
+    ma->IterateElements (VOL, local_heap, [&] (auto ei, LocalHeap &lh) {
+      if (!ETmats->IsDefined (ei.Nr ()))
+        return;
+      const auto P = ETmats->GetElmat (ei.Nr ());
+      FlatMatrix<SCAL> elau (num_vectors, P.Height (), lh);
+      FlatMatrix<SCAL> ely (num_vectors, P.Width (), lh);
+      gather (aus, dofs[ei.Nr ()], elau);
+      ely = elau * P;
+      scatter_add (y, trefftz_dofs[ei.Nr ()], ely);
+    });
+  }
+
+  template class EmbTrefftzOperator<double>;
+  template class EmbTrefftzOperator<Complex>;
+
+  ////////////////////////// EmbTrefftzFESpace ///////////////////////////
+
+  template <typename T>
+  shared_ptr<BaseVector>
+  EmbTrefftzFESpace<T>::SetOp (shared_ptr<SumOfIntegrals> bf,
+                               shared_ptr<SumOfIntegrals> lf, double eps,
+                               shared_ptr<FESpace> test_fes, int tndof,
+                               bool dedup, const std::string &cache_dir)
+  {
+    static Timer timer ("EmbTrefftz: SetOp");
+
+    // shared_ptr<FESpace> use_as_l2 =
+    // dynamic_pointer_cast<FESpace>(const_cast<EmbTrefftzFESpace*>(this)->shared_from_this());
+
+    setop_args.op = *bf;
+    setop_args.cop_lhs = nullopt;
+    setop_args.cop_rhs = nullopt;
+    setop_args.linear_form = lf;
+    setop_args.fes_test = test_fes;
+    setop_args.ndof_trefftz = (tndof != 0) ? tndof : eps;
+    setop_args.dedup = dedup;
+    this->fes_conformity = nullptr;
+
+    if (recompute)
+      {
+        if (!this->IsComplex ())
+          setupRecompute<double> (nullptr);
+        else
+          setupRecompute<Complex> (nullptr);
+      }
+    else if (!this->IsComplex ())
+      storeEmbedding<double> (computeEmbedding<double> (nullptr, cache_dir));
+    else
+      storeEmbedding<Complex> (computeEmbedding<Complex> (nullptr, cache_dir));
+    storeSinglePrecision ();
+
+    adjustDofsAfterSetOp ();
+    return particular_solution;
+  }
+
+  template <typename T>
+  shared_ptr<BaseVector>
+  EmbTrefftzFESpace<T>::SetOp (shared_ptr<const SumOfIntegrals> op,
+                               shared_ptr<const SumOfIntegrals> cop_lhs,
+                               shared_ptr<const SumOfIntegrals> cop_rhs,
+                               shared_ptr<const FESpace> fes_conformity,
+                               shared_ptr<const FESpace> fes_test,
+                               shared_ptr<const SumOfIntegrals> linear_form,
+                               size_t ndof_trefftz,
+                               const std::string &cache_dir)
+  {
+    static Timer timer ("EmbTrefftz: SetOp");
+
+    if (!fes || !cop_lhs || !cop_rhs || !fes_conformity)
+      throw std::invalid_argument ("All pointers except for op, fes_test and "
+                                   "linear_form may not be null.");
+
+    // if op is null, set op to be an empty sum.
+    if (!op)
+      ndof_trefftz = 0;
+
+    setop_args.op = (op) ? *op : SumOfIntegrals{};
+    setop_args.cop_lhs = *cop_lhs;
+    setop_args.cop_rhs = *cop_rhs;
+    setop_args.linear_form = linear_form;
+    setop_args.fes_test = fes_test;
+    setop_args.ndof_trefftz = ndof_trefftz;
+    setop_args.dedup = false;
+    this->fes_conformity = fes_conformity;
+
+    if (recompute)
+      {
+        if (!this->IsComplex ())
+          setupRecompute<double> (nullptr);
+        else
+          setupRecompute<Complex> (nullptr);
+      }
+    else if (!this->IsComplex ())
+      storeEmbedding<double> (computeEmbedding<double> (nullptr, cache_dir));
+    else
+      storeEmbedding<Complex> (computeEmbedding<Complex> (nullptr, cache_dir));
+    storeSinglePrecision ();
+
+    adjustDofsAfterSetOp ();
 
-          // T1 solves A @ T1 = B,
-          // i.e. T1 = A^{-1} @ B.
-          // A has dimension (ndof + ndof_conforming, ndof),
-          // B has dimension (ndof + ndof_conforming, ndof_conforming),
-          // so T1 has dimension (ndof, ndof_conforming)
-          elmat_t1 = elmat_a_inv * elmat_b;
+    return particular_solution;
+  }
+
+  template <typename T>
+  pair<shared_ptr<BaseMatrix>, shared_ptr<BaseVector>>
+  EmbTrefftzFESpace<T>::SetOpAssemble (shared_ptr<SumOfIntegrals> op,
+                                       shared_ptr<SumOfIntegrals> bf,
+                                       shared_ptr<SumOfIntegrals> lf,
+                                       double eps,
+                                       shared_ptr<FESpace> test_fes,
+                                       int tndof)
+  {
+    static Timer timer ("EmbTrefftz: SetOpAssemble");
+    RegionTimer reg (timer);
+
+    if (recompute)
+      throw std::invalid_argument (
+          "SetOpAssemble stores the embedding, it is not available in "
+          "recompute mode");
+    if (fesHasHiddenDofs (*fes))
+      throw std::invalid_argument (
+          "SetOpAssemble does not support spaces with hidden dofs");
+    for (const auto &icf : bf->icfs)
+      if (icf->dx.vb != VOL || icf->dx.skeleton)
+        throw std::invalid_argument (
+            "SetOpAssemble only fuses volume terms, assemble the skeleton "
+            "and boundary terms on the Trefftz space");
+
+    setop_args.op = *op;
+    setop_args.cop_lhs = nullopt;
+    setop_args.cop_rhs = nullopt;
+    setop_args.linear_form = lf;
+    setop_args.fes_test = test_fes;
+    setop_args.ndof_trefftz = (tndof != 0) ? tndof : eps;
+    setop_args.dedup = false;
+    this->fes_conformity = nullptr;
+
+    const size_t ne = this->ma->GetNE (VOL);
+    ElmatArena<double> projected;
+    ElmatArena<Complex> projectedC;
+    if (!this->IsComplex ())
+      projected = embedAndProject<double> (*bf);
+    else
+      projectedC = embedAndProject<Complex> (*bf);
+    storeSinglePrecision ();
+    adjustDofsAfterSetOp ();
+
+    // the Trefftz dofs of an element are its first dofs, see
+    // adjustDofsAfterSetOp
+    TableCreator<int> creator (ne);
+    Array<DofId> dofs;
+    for (; !creator.Done (); creator++)
+      for (size_t elnr = 0; elnr < ne; elnr++)
+        {
+          this->GetDofNrs (ElementId (VOL, elnr), dofs);
+          for (size_t j = 0; j < getElementWidth (elnr); j++)
+            creator.Add (elnr, dofs[j]);
+        }
+    Table<int> table = creator.MoveTable ();
+
+    shared_ptr<BaseMatrix> mat
+        = (this->IsComplex ())
+              ? blocks2Sparse (projectedC, table, this->GetNDof ())
+              : blocks2Sparse (projected, table, this->GetNDof ());
+    return make_pair (mat, particular_solution);
+  }
+
+  template <typename T>
+  template <typename SCAL>
+  ElmatArena<SCAL>
+  EmbTrefftzFESpace<T>::embedAndProject (const SumOfIntegrals &bf)
+  {
+    const size_t ne = this->ma->GetNE (VOL);
+    const FESpace &fes_test_ref
+        = (setop_args.fes_test) ? *setop_args.fes_test : *fes;
+    const LocalTrefftzEmbedding<SCAL> local (
+        setop_args.op, *fes, fes_test_ref, nullopt, nullopt, nullptr,
+        setop_args.ndof_trefftz, false, EmbTrefftzMethod::SVD);
+
+    Array<shared_ptr<BilinearFormIntegrator>> bfis[4];
+    calculateBilinearFormIntegrators (bf, bfis);
+    LinearFormIntegrators lfis;
+    if (setop_args.linear_form)
+      calculateLinearFormIntegrators (*setop_args.linear_form, lfis.data ());
+
+    // the number of Trefftz dofs is only known after the SVD, reserve for
+    // the largest one and compact afterwards
+    ElmatArena<SCAL> embedding, projected;
+    {
+      Array<size_t> capacities (ne), projected_capacities (ne);
+      ParallelFor (ne, [&] (size_t elnr) {
+        Array<DofId> dofs;
+        fes->GetDofNrs (ElementId (VOL, elnr), dofs);
+        const size_t max_ndof_trefftz
+            = holds_alternative<size_t> (setop_args.ndof_trefftz)
+                  ? min (std::get<size_t> (setop_args.ndof_trefftz),
+                         dofs.Size ())
+                  : dofs.Size ();
+        capacities[elnr] = dofs.Size () * max_ndof_trefftz;
+        projected_capacities[elnr] = max_ndof_trefftz * max_ndof_trefftz;
+      });
+      embedding.Reserve (capacities);
+      projected.Reserve (projected_capacities);
+    }
+    auto solution = createSolutionVector<SCAL> (*fes);
+    *solution = 0.0;
+
+    LocalHeap local_heap (getNumberOfThreads () * 10 * 1000 * 1000);
+    this->ma->IterateElements (
+        VOL, local_heap, [&] (Ngs_Element mesh_element, LocalHeap &lh) {
+          const ElementId element_id = ElementId (mesh_element);
+          if (local.IsSkipped (mesh_element))
+            return;
+
+          Array<DofId> dofs, dofs_test, dofs_conforming;
+          auto [elmat_a, elmat_b, ndof_test] = local.Assemble (
+              element_id, dofs, dofs_test, dofs_conforming, lh);
+          FlatMatrix<SCAL> elmat_a_inv;
+          const auto elmat_p = local.Embed (
+              elmat_a, elmat_b, ndof_test, elmat_a_inv, nullptr,
+              [&] (const size_t height, const size_t width,
+                   const size_t ndof_trefftz_i) {
+                return embedding.SetElmat (element_id.Nr (), height, width,
+                                           ndof_trefftz_i);
+              },
+              lh);
+          const size_t ndof = dofs.Size ();
+          const size_t ndof_trefftz_i = elmat_p.Width ();
+
+          // element matrix of bf, kept only as P^T A P
+          FlatMatrix<SCAL> elmat (ndof, ndof, lh);
+          elmat = static_cast<SCAL> (0.0);
+          addIntegrationToElementMatrix (elmat, bfis[VOL], *this->ma,
+                                         element_id, *fes, *fes, lh);
+          FlatMatrix<SCAL> elmat_ap (ndof, ndof_trefftz_i, lh);
+          elmat_ap = elmat * elmat_p;
+          FlatMatrix<SCAL> elmat_ptap
+              = projected.SetElmat (element_id.Nr (), ndof_trefftz_i,
+                                    ndof_trefftz_i, ndof_trefftz_i);
+          elmat_ptap = Trans (elmat_p) * elmat_ap;
+
+          if (setop_args.linear_form)
+            solution->SetIndirect (
+                dofs, calculateParticularSolutions<SCAL> (
+                          FlatArray<LinearFormIntegrators> (1, &lfis),
+                          fes_test_ref, element_id, *this->ma, dofs,
+                          ndof_test, elmat_a_inv, lh)
+                          .Col (0));
+        });
+
+    embedding.Compact ();
+    projected.Compact ();
+    storeEmbedding<SCAL> (make_pair (std::move (embedding), solution));
+    return projected;
+  }
+
+  template <typename T>
+  void EmbTrefftzFESpace<T>::SetSinglePrecision (const bool single_precision)
+  {
+    this->single_precision = single_precision;
+  }
+
+  template <typename T>
+  template <typename SCAL>
+  void EmbTrefftzFESpace<T>::storeEmbedding (
+      pair<ElmatArena<SCAL>, shared_ptr<BaseVector>> result)
+  {
+    auto arena = make_shared<ElmatArena<SCAL>> (std::move (result.first));
+    if constexpr (std::is_same_v<SCAL, double>)
+      ETmats = arena;
+    else
+      ETmatsC = arena;
+    particular_solution = result.second;
+  }
+
+  template <typename T> void EmbTrefftzFESpace<T>::storeSinglePrecision ()
+  {
+    ETmatsF = ElmatArena<float> ();
+    stores_single_precision
+        = single_precision && !recompute && !this->IsComplex ();
+    if (!stores_single_precision)
+      return;
+    ETmatsF = ElmatArena<float> (*ETmats);
+    ETmats = make_shared<ElmatArena<double>> ();
+  }
+
+
+  template <typename T>
+  template <typename SCAL>
+  pair<ElmatArena<SCAL>, shared_ptr<BaseVector>>
+  EmbTrefftzFESpace<T>::computeEmbedding (shared_ptr<const BitArray> elements,
+                                          const std::string &cache_dir) const
+  {
+    // fes_test may be null. If it is null, then choose the trial space as the
+    // test space as well.
+    const FESpace &fes_test_ref
+        = (setop_args.fes_test) ? *setop_args.fes_test : *fes;
+    return EmbTrefftz<SCAL> (
+        setop_args.op, *fes, fes_test_ref, setop_args.cop_lhs,
+        setop_args.cop_rhs, fes_conformity, setop_args.linear_form,
+        setop_args.ndof_trefftz, nullptr, false, setop_args.dedup, cache_dir,
+        EmbTrefftzMethod::SVD, elements);
+  }
+
+  template <typename T>
+  void EmbTrefftzFESpace<T>::SetRecompute (const bool recompute,
+                                           const size_t cache_size)
+  {
+    this->recompute = recompute;
+    recompute_cache_size = cache_size;
+  }
+
+  template <typename T>
+  template <typename SCAL>
+  void
+  EmbTrefftzFESpace<T>::setupRecompute (shared_ptr<const BitArray> elements)
+  {
+    static Timer timer ("EmbTrefftz: setup recompute");
+    RegionTimer reg (timer);
 
-          // standard embedded Trefftz behaviour is get_range==false
-          if (get_range)
-            elmat_t2 = U.Cols (0, dofs.Size () - ndof_trefftz_i);
-          else
-            elmat_t2 = Trans (V.Rows (ndof - ndof_trefftz_i, ndof));
+    const size_t ne = this->ma->GetNE (VOL);
+    const FESpace &fes_test_ref
+        = (setop_args.fes_test) ? *setop_args.fes_test : *fes;
+    if (!elements)
+      {
+        ETmats = make_shared<ElmatArena<double>> ();
+        ETmatsC = make_shared<ElmatArena<Complex>> ();
+        auto local = make_shared<LocalTrefftzEmbedding<SCAL>> (
+            setop_args.op, *fes, fes_test_ref, setop_args.cop_lhs,
+            setop_args.cop_rhs, fes_conformity, setop_args.ndof_trefftz,
+            false, EmbTrefftzMethod::SVD);
+        const size_t num_caches
+            = (recompute_cache_size > 0) ? TaskManager::GetMaxThreads () : 0;
+        if constexpr (std::is_same_v<SCAL, double>)
+          {
+            local_embedding = local;
+            lru_caches.SetSize (num_caches);
+          }
+        else
+          {
+            local_embeddingC = local;
+            lru_cachesC.SetSize (num_caches);
+          }
+        element_widths.SetSize (ne);
+        element_widths = 0;
+        particular_solution = createSolutionVector<SCAL> (*fes);
+        *particular_solution = 0.0;
+      }
+    for (auto &cache : lru_caches)
+      cache.SetCapacity (recompute_cache_size);
+    for (auto &cache : lru_cachesC)
+      cache.SetCapacity (recompute_cache_size);
+
+    const LocalTrefftzEmbedding<SCAL> *local;
+    if constexpr (std::is_same_v<SCAL, double>)
+      local = local_embedding.get ();
+    else
+      local = local_embeddingC.get ();
 
-          element_matrices[element_id.Nr ()]
-              = make_optional<ElmatWithTrefftzInfo<SCAL>> (
-                  { elmat_p, ndof_trefftz_i });
+    LinearFormIntegrators lfis;
+    if (setop_args.linear_form)
+      calculateLinearFormIntegrators (*setop_args.linear_form, lfis.data ());
 
-          if (linear_form)
-            {
-              const auto part_sol = calculateParticularSolution<SCAL> (
-                  lfis, fes_test, element_id, *mesh_access, dofs, ndof_test,
-                  elmat_a_inv, local_heap);
-              particular_solution_vec->SetIndirect (dofs, part_sol);
-            }
-          if (stats)
-            {
-              const lock_guard<mutex> lock (stats_mutex);
-              if (sing_val_avg.Size () == 0)
-                {
-                  sing_val_avg.SetSize (elmat_a.Height ());
-                  sing_val_max.SetSize (elmat_a.Height ());
-                  sing_val_min.SetSize (elmat_a.Height ());
-                  sing_val_avg = 0;
-                  sing_val_max = 0;
-                  sing_val_min = DBL_MAX;
-                }
-              active_elements += 1;
-              for (size_t i = 0; i < elmat_a.Height (); i++)
-                {
-                  sing_val_avg[i] += elmat_a (i, i);
-                  sing_val_max[i]
-                      = max (sing_val_max[i], abs (elmat_a (i, i)));
-                  sing_val_min[i]
-                      = min (sing_val_min[i], abs (elmat_a (i, i)));
-                }
-            }
+    // the embeddings are only computed for their number of Trefftz dofs and
+    // the particular solution, then dropped
+    LocalHeap local_heap (getNumberOfThreads () * 10 * 1000 * 1000);
+    this->ma->IterateElements (
+        VOL, local_heap, [&] (Ngs_Element mesh_element, LocalHeap &lh) {
+          const ElementId element_id = ElementId (mesh_element);
+          if (elements && !elements->Test (element_id.Nr ()))
+            return;
+          element_widths[element_id.Nr ()] = 0;
+          if (local->IsSkipped (mesh_element))
+            return;
 
-          (*testout) << "element " << element_id << endl
-                     << "fes has ndof:" << ndof
-                     << "fes_test has ndof:" << ndof_test
-                     << "fes_conformity has ndof:" << ndof_conforming << endl
-                     << "elmat_t1" << endl
-                     << elmat_t1 << endl
-                     << "elmat_t2" << endl
-                     << elmat_t2 << endl;
+          Array<DofId> dofs, dofs_test, dofs_conforming;
+          auto [elmat_a, elmat_b, ndof_test] = local->Assemble (
+              element_id, dofs, dofs_test, dofs_conforming, lh);
+          FlatMatrix<SCAL> elmat_a_inv;
+          local->Embed (
+              elmat_a, elmat_b, ndof_test, elmat_a_inv, nullptr,
+              [&] (const size_t height, const size_t width, const size_t) {
+                element_widths[element_id.Nr ()] = width;
+                return FlatMatrix<SCAL> (height, width, lh);
+              },
+              lh);
+          if (setop_args.linear_form)
+            particular_solution->SetIndirect (
+                dofs, calculateParticularSolutions<SCAL> (
+                          FlatArray<LinearFormIntegrators> (1, &lfis),
+                          fes_test_ref, element_id, *this->ma, dofs,
+                          ndof_test, elmat_a_inv, lh)
+                          .Col (0));
         });
-    if (stats)
-      {
-        sing_val_avg /= active_elements.load ();
-        (*stats)["singavg"] = Vector<SCAL> (sing_val_avg);
-        (*stats)["singmax"] = Vector<double> (sing_val_max);
-        (*stats)["singmin"] = Vector<double> (sing_val_min);
-      }
-
-    return make_pair (element_matrices, particular_solution_vec);
   }
 
-  ////////////////////////// EmbTrefftzFESpace ///////////////////////////
-
   template <typename T>
-  shared_ptr<BaseVector>
-  EmbTrefftzFESpace<T>::SetOp (shared_ptr<SumOfIntegrals> bf,
-                               shared_ptr<SumOfIntegrals> lf, double eps,
-                               shared_ptr<FESpace> test_fes, int tndof)
+  template <typename SCAL>
+  FlatMatrix<SCAL> EmbTrefftzFESpace<T>::getElmat (ElementId ei,
+                                                   LocalHeap &lh) const
   {
-    static Timer timer ("EmbTrefftz: SetOp");
-
-    // shared_ptr<FESpace> use_as_l2 =
-    // dynamic_pointer_cast<FESpace>(const_cast<EmbTrefftzFESpace*>(this)->shared_from_this());
-
-    shared_ptr<BaseVector> lfvec;
-    if (!this->IsComplex ())
+    const LocalTrefftzEmbedding<SCAL> *local;
+    Array<ElmatLRUCache<SCAL>> *caches;
+    if constexpr (std::is_same_v<SCAL, double>)
       {
-        auto embtr = EmbTrefftz<double> (
-            make_optional (*bf), *fes, (test_fes) ? *test_fes : *fes, nullopt,
-            nullopt, nullptr, lf, (tndof != 0) ? tndof : eps, nullptr, false);
-        this->ETmats = std::get<0> (embtr);
-        lfvec = std::get<1> (embtr);
+        if (stores_single_precision)
+          {
+            // widen the stored embedding to double
+            const auto elmat_f = ETmatsF.GetElmat (ei.Nr ());
+            FlatMatrix<double> elmat (elmat_f.Height (), elmat_f.Width (), lh);
+            const auto values_f = elmat_f.AsVector ();
+            auto values = elmat.AsVector ();
+            for (size_t i = 0; i < values.Size (); i++)
+              values[i] = values_f[i];
+            return elmat;
+          }
+        if (!recompute)
+          return ETmats->GetElmat (ei.Nr ());
+        local = local_embedding.get ();
+        caches = &lru_caches;
       }
     else
       {
-        auto embtr = EmbTrefftz<Complex> (
-            make_optional (*bf), *fes, (test_fes) ? *test_fes : *fes, nullopt,
-            nullopt, nullptr, lf, (tndof != 0) ? tndof : eps, nullptr, false);
-        this->ETmatsC = std::get<0> (embtr);
-        lfvec = std::get<1> (embtr);
+        if (!recompute)
+          return ETmatsC->GetElmat (ei.Nr ());
+        local = local_embeddingC.get ();
+        caches = &lru_cachesC;
       }
 
-    adjustDofsAfterSetOp ();
-    return lfvec;
+    if (element_widths[ei.Nr ()] == 0
+        && local->IsSkipped (this->ma->GetElement (ei)))
+      return FlatMatrix<SCAL> (0, 0, lh);
+
+    const size_t thread = TaskManager::GetThreadId ();
+    ElmatLRUCache<SCAL> *cache
+        = (thread < caches->Size ()) ? &(*caches)[thread] : nullptr;
+    if (cache)
+      if (auto elmat = cache->Find (ei.Nr ()))
+        return *elmat;
+
+    Array<DofId> dofs, dofs_test, dofs_conforming;
+    auto [elmat_a, elmat_b, ndof_test]
+        = local->Assemble (ei, dofs, dofs_test, dofs_conforming, lh);
+    FlatMatrix<SCAL> elmat_a_inv;
+    return local->Embed (
+        elmat_a, elmat_b, ndof_test, elmat_a_inv, nullptr,
+        [&] (const size_t height, const size_t width, const size_t) {
+          if (width != element_widths[ei.Nr ()])
+            throw Exception ("EmbTrefftz: the number of Trefftz dofs of "
+                             "element "
+                             + std::to_string (ei.Nr ())
+                             + " changed, call UpdateOp");
+          return (cache) ? cache->Insert (ei.Nr (), height, width)
+                         : FlatMatrix<SCAL> (height, width, lh);
+        },
+        lh);
   }
 
   template <typename T>
-  shared_ptr<BaseVector>
-  EmbTrefftzFESpace<T>::SetOp (shared_ptr<const SumOfIntegrals> op,
-                               shared_ptr<const SumOfIntegrals> cop_lhs,
-                               shared_ptr<const SumOfIntegrals> cop_rhs,
-                               shared_ptr<const FESpace> fes_conformity,
-                               shared_ptr<const FESpace> fes_test,
-                               shared_ptr<const SumOfIntegrals> linear_form,
-                               size_t ndof_trefftz)
+  size_t EmbTrefftzFESpace<T>::getElementWidth (size_t elnr) const
   {
-    static Timer timer ("EmbTrefftz: SetOp");
-
-    shared_ptr<BaseVector> particular_solution = nullptr;
+    if (recompute)
+      return element_widths[elnr];
+    if (stores_single_precision)
+      return ETmatsF.GetElmat (elnr).Width ();
+    return this->IsComplex () ? ETmatsC->GetElmat (elnr).Width ()
+                              : ETmats->GetElmat (elnr).Width ();
+  }
 
-    if (!fes || !cop_lhs || !cop_rhs || !fes_conformity)
-      throw std::invalid_argument ("All pointers except for op, fes_test and "
-                                   "linear_form may not be null.");
+  template <typename T>
+  template <typename SCAL, typename STORE_SCAL>
+  bool
+  EmbTrefftzFESpace<T>::updateEmbedding (ElmatArena<STORE_SCAL> &ETm,
+                                         shared_ptr<const BitArray> elements)
+  {
+    auto [update, update_solution] = computeEmbedding<SCAL> (elements);
+
+    Array<size_t> elnrs;
+    for (size_t elnr = 0; elnr < elements->Size (); elnr++)
+      if (elements->Test (elnr))
+        elnrs.Append (elnr);
+
+    bool ndof_changed = false;
+    for (size_t elnr : elnrs)
+      if (ETm.GetElmat (elnr).Width () != update.GetElmat (elnr).Width ())
+        ndof_changed = true;
+    if constexpr (std::is_same_v<SCAL, STORE_SCAL>)
+      ETm.Patch (update, elnrs);
+    else
+      ETm.Patch (ElmatArena<STORE_SCAL> (update), elnrs);
 
-    // fes_test may be null. If it is null, then choose the trial space as the
-    // test space as well.
-    const FESpace &fes_test_ref = (fes_test) ? *fes_test : *fes;
+    // the particular solution only changes on the dofs of the elements
+    ParallelForRange (elnrs.Size (), [&] (IntRange range) {
+      Array<DofId> dofs;
+      Vector<SCAL> values;
+      for (size_t i : range)
+        {
+          fes->GetDofNrs (ElementId (VOL, elnrs[i]), dofs);
+          values.SetSize (dofs.Size ());
+          update_solution->GetIndirect (dofs, values);
+          particular_solution->SetIndirect (dofs, values);
+        }
+    });
+    return ndof_changed;
+  }
 
-    // if op is null, set op to be an empty sum.
-    const SumOfIntegrals op_default{};
-    if (!op)
-      ndof_trefftz = 0;
-    const SumOfIntegrals &op_ref = (op) ? *op : op_default;
+  template <typename T>
+  shared_ptr<BaseVector>
+  EmbTrefftzFESpace<T>::UpdateOp (shared_ptr<const BitArray> elements)
+  {
+    static Timer timer ("EmbTrefftz: UpdateOp");
+    RegionTimer reg (timer);
 
-    if (!this->IsComplex ())
+    const size_t ne = this->ma->GetNE (VOL);
+    const size_t num_embedded
+        = (recompute)                 ? element_widths.Size ()
+          : (stores_single_precision) ? ETmatsF.Size ()
+          : (this->IsComplex ())      ? ETmatsC->Size ()
+                                      : ETmats->Size ();
+    if (!particular_solution || num_embedded != ne)
+      throw Exception ("EmbTrefftz: call SetOp before UpdateOp");
+    if (!elements || elements->Size () != ne)
+      throw std::invalid_argument (
+          "elements must have one entry per volume element");
+
+    bool ndof_changed = false;
+    if (recompute)
       {
-        std::tie (this->ETmats, particular_solution) = EmbTrefftz<double> (
-            op_ref, *fes, fes_test_ref, *cop_lhs, *cop_rhs, fes_conformity,
-            linear_form, ndof_trefftz, nullptr);
+        Array<size_t> old_widths (element_widths);
+        if (this->IsComplex ())
+          setupRecompute<Complex> (elements);
+        else
+          setupRecompute<double> (elements);
+        for (size_t elnr = 0; elnr < ne; elnr++)
+          if (old_widths[elnr] != element_widths[elnr])
+            ndof_changed = true;
       }
+    else if (stores_single_precision)
+      ndof_changed = updateEmbedding<double> (ETmatsF, elements);
     else
-      {
-        std::tie (this->ETmatsC, particular_solution) = EmbTrefftz<Complex> (
-            *op, *fes, fes_test_ref, *cop_lhs, *cop_rhs, fes_conformity,
-            linear_form, ndof_trefftz, nullptr);
-      }
-
-    adjustDofsAfterSetOp ();
-
+      ndof_changed
+          = (this->IsComplex ())
+                ? updateEmbedding<Complex> (unshare (ETmatsC), elements)
+                : updateEmbedding<double> (unshare (ETmats), elements);
+    if (ndof_changed)
+      adjustDofsAfterSetOp ();
     return particular_solution;
   }
 
@@ -858,8 +3297,7 @@ namespace ngcomp
 
     for (auto ei : this->ma->Elements (VOL))
       {
-        int nz = this->IsComplex () ? (ETmatsC[ei.Nr ()])->elmat.Width ()
-                                    : (ETmats[ei.Nr ()])->elmat.Width ();
+        int nz = getElementWidth (ei.Nr ());
         Array<DofId> dofs;
         T::GetDofNrs (ei, dofs);
         for (size_t i = nz; i < dofs.Size (); i++)
@@ -888,6 +3326,12 @@ namespace ngcomp
     // this->ctofdof[all2comp[i]] = T::GetDofCouplingType (i);
 
     T::FinalizeUpdate ();
+
+    // T numbers its parallel dofs like `fes`, on a distributed mesh every
+    // Trefftz dof is shared with the same ranks as the dof of `fes` it
+    // replaces
+    if (auto pardofs = fes->GetParallelDofs ())
+      this->paralleldofs = restrictParallelDofs (*pardofs, all2comp, newndof);
   }
 
   template <typename T>
@@ -901,61 +3345,186 @@ namespace ngcomp
   }
 
   template <typename T>
-  void
-  EmbTrefftzFESpace<T>::VTransformMR (ElementId ei, SliceMatrix<double> mat,
-                                      TRANSFORM_TYPE type) const
+  shared_ptr<Table<int>>
+  EmbTrefftzFESpace<T>::CreateSmoothingBlocks (const Flags &flags) const
   {
-    static Timer timer ("EmbTrefftz: MTransform");
+    static Timer timer ("EmbTrefftz: CreateSmoothingBlocks");
     RegionTimer reg (timer);
 
-    size_t nz = (ETmats[ei.Nr ()])->elmat.Width ();
-    Matrix<double> temp_mat (mat.Height (), mat.Width ());
+    const std::string blocktype
+        = flags.GetStringFlag ("blocktype", "element");
+    if (blocktype != "element" && blocktype != "facetpatch")
+      throw Exception ("unknown blocktype " + blocktype
+                       + ", use 'element' or 'facetpatch'");
+    const bool facet_patches = blocktype == "facetpatch";
+    const size_t num_blocks
+        = (facet_patches) ? this->ma->GetNFacets () : this->ma->GetNE (VOL);
+
+    // collects the Trefftz dofs of the elements of a block, each dof once
+    Array<int> elnrs;
+    Array<DofId> dofs, block_dofs;
+    const auto get_block = [&] (const size_t block) {
+      if (facet_patches)
+        this->ma->GetFacetElements (block, elnrs);
+      else
+        {
+          elnrs.SetSize (1);
+          elnrs[0] = block;
+        }
+      block_dofs.SetSize0 ();
+      for (const int elnr : elnrs)
+        {
+          GetDofNrs (ElementId (VOL, elnr), dofs);
+          for (const DofId d : dofs)
+            if (IsRegularDof (d) && !block_dofs.Contains (d))
+              block_dofs.Append (d);
+        }
+    };
+
+    TableCreator<int> creator (num_blocks);
+    for (; !creator.Done (); creator++)
+      for (size_t block = 0; block < num_blocks; block++)
+        {
+          get_block (block);
+          for (const DofId d : block_dofs)
+            creator.Add (block, d);
+        }
+    return make_shared<Table<int>> (creator.MoveTable ());
+  }
+
+  /// @returns a scratch buffer of at least `size` entries, owned by the
+  /// calling thread. It is reused by the next call from the same thread, so
+  /// the transformations below never allocate after warm-up.
+  template <typename SCAL> SCAL *transformScratch (const size_t size)
+  {
+    thread_local Array<SCAL> scratch;
+    if (scratch.Size () < size)
+      scratch.SetSize (size);
+    return scratch.Data ();
+  }
+
+  /// calls `func (lh)` with a local heap owned by the calling thread, for
+  /// the element embeddings recomputed in the transformations. If the heap
+  /// overflows, e.g. for the local systems of high order elements, its size
+  /// is doubled and `func` is called again, so `func` has to be repeatable.
+  /// The size is kept for the next calls of the thread.
+  template <typename FUNC> void withTransformHeap (FUNC &&func)
+  {
+    thread_local size_t size = 10 * 1000 * 1000;
+    thread_local unique_ptr<LocalHeap> lh;
+    if (!lh)
+      lh = make_unique<LocalHeap> (size, "EmbTrefftz transform");
+    while (true)
+      {
+        try
+          {
+            const HeapReset hr (*lh);
+            func (*lh);
+            return;
+          }
+        catch (const LocalHeapOverflow &)
+          {
+            size *= 2;
+            lh = make_unique<LocalHeap> (size, "EmbTrefftz transform");
+          }
+      }
+  }
+
+  /// transforms the element matrix `mat` with the element embedding `P`,
+  /// i.e. `mat <- P^T mat`, `mat <- mat P` or `mat <- P^T mat P`.
+  /// Entries outside of the transformed block are set to zero, for
+  /// `TRANSFORM_MAT_LEFT_RIGHT` they are left untouched.
+  template <typename SCAL>
+  void transformElementMatrix (FlatMatrix<SCAL> P, SliceMatrix<SCAL> mat,
+                               const TRANSFORM_TYPE type)
+  {
+    const size_t nz = P.Width ();
+    const auto [height, width] = mat.Shape ();
 
     if (type == TRANSFORM_MAT_LEFT)
       {
-        temp_mat.Rows (0, nz) = Trans ((ETmats[ei.Nr ()])->elmat) * mat;
-        mat = temp_mat;
+        FlatMatrix<SCAL> temp_mat (nz, width,
+                                   transformScratch<SCAL> (nz * width));
+        temp_mat = Trans (P) * mat;
+        mat.Rows (0, nz) = temp_mat;
+        mat.Rows (nz, height) = static_cast<SCAL> (0.0);
       }
     if (type == TRANSFORM_MAT_RIGHT)
       {
-        temp_mat.Cols (0, nz) = mat * ((ETmats[ei.Nr ()])->elmat);
-        mat = temp_mat;
+        FlatMatrix<SCAL> temp_mat (height, nz,
+                                   transformScratch<SCAL> (height * nz));
+        temp_mat = mat * P;
+        mat.Cols (0, nz) = temp_mat;
+        mat.Cols (nz, width) = static_cast<SCAL> (0.0);
       }
     if (type == TRANSFORM_MAT_LEFT_RIGHT)
       {
-        temp_mat.Cols (0, nz) = mat * ((ETmats[ei.Nr ()])->elmat);
-        mat.Cols (0, nz).Rows (0, nz)
-            = Trans ((ETmats[ei.Nr ()])->elmat) * temp_mat;
+        // P^T A P: only A P needs a buffer, P^T (A P) goes directly into
+        // the upper left block of mat, which is not read anymore
+        FlatMatrix<SCAL> temp_mat (height, nz,
+                                   transformScratch<SCAL> (height * nz));
+        temp_mat = mat * P;
+        mat.Rows (0, nz).Cols (0, nz) = Trans (P) * temp_mat;
+      }
+  }
+
+  /// transforms the element vector `vec` with the element embedding `P`,
+  /// i.e. `vec <- P^T vec` for the right hand side and `vec <- P vec` for
+  /// the solution.
+  template <typename SCAL>
+  void transformElementVector (FlatMatrix<SCAL> P, SliceVector<SCAL> vec,
+                               const TRANSFORM_TYPE type)
+  {
+    const size_t nz = P.Width ();
+
+    if (type == TRANSFORM_RHS)
+      {
+        FlatVector<SCAL> new_vec (nz, transformScratch<SCAL> (nz));
+        new_vec = Trans (P) * vec;
+        vec.Range (0, nz) = new_vec;
+        vec.Range (nz, vec.Size ()) = static_cast<SCAL> (0.0);
+      }
+    else if (type == TRANSFORM_SOL)
+      {
+        FlatVector<SCAL> new_vec (vec.Size (),
+                                  transformScratch<SCAL> (vec.Size ()));
+        new_vec = P * vec.Range (0, nz);
+        vec = new_vec;
       }
   }
 
   template <typename T>
   void
-  EmbTrefftzFESpace<T>::VTransformMC (ElementId ei, SliceMatrix<Complex> mat,
+  EmbTrefftzFESpace<T>::VTransformMR (ElementId ei, SliceMatrix<double> mat,
                                       TRANSFORM_TYPE type) const
   {
     static Timer timer ("EmbTrefftz: MTransform");
     RegionTimer reg (timer);
 
-    size_t nz = (ETmatsC[ei.Nr ()])->elmat.Width ();
-    Matrix<Complex> temp_mat (mat.Height (), mat.Width ());
+    if (!recompute && !stores_single_precision)
+      transformElementMatrix<double> (ETmats->GetElmat (ei.Nr ()), mat, type);
+    else
+      withTransformHeap ([&] (LocalHeap &lh) {
+        transformElementMatrix<double> (getElmat<double> (ei, lh), mat, type);
+      });
+  }
 
-    if (type == TRANSFORM_MAT_LEFT)
-      {
-        temp_mat.Rows (0, nz) = Trans ((ETmatsC[ei.Nr ()])->elmat) * mat;
-        mat = temp_mat;
-      }
-    if (type == TRANSFORM_MAT_RIGHT)
-      {
-        temp_mat.Cols (0, nz) = mat * ((ETmatsC[ei.Nr ()])->elmat);
-        mat = temp_mat;
-      }
-    if (type == TRANSFORM_MAT_LEFT_RIGHT)
-      {
-        temp_mat.Cols (0, nz) = mat * ((ETmatsC[ei.Nr ()])->elmat);
-        mat.Cols (0, nz).Rows (0, nz)
-            = Trans ((ETmatsC[ei.Nr ()])->elmat) * temp_mat;
-      }
+  template <typename T>
+  void
+  EmbTrefftzFESpace<T>::VTransformMC (ElementId ei, SliceMatrix<Complex> mat,
+                                      TRANSFORM_TYPE type) const
+  {
+    static Timer timer ("EmbTrefftz: MTransform");
+    RegionTimer reg (timer);
+
+    if (!recompute)
+      transformElementMatrix<Complex> (ETmatsC->GetElmat (ei.Nr ()), mat,
+                                       type);
+    else
+      withTransformHeap ([&] (LocalHeap &lh) {
+        transformElementMatrix<Complex> (getElmat<Complex> (ei, lh), mat,
+                                         type);
+      });
   }
 
   template <typename T>
@@ -966,20 +3535,12 @@ namespace ngcomp
     static Timer timer ("EmbTrefftz: VTransform");
     RegionTimer reg (timer);
 
-    size_t nz = (ETmats[ei.Nr ()])->elmat.Width ();
-
-    if (type == TRANSFORM_RHS)
-      {
-        Vector<double> new_vec (nz);
-        new_vec = Trans ((ETmats[ei.Nr ()])->elmat) * vec;
-        vec = new_vec;
-      }
-    else if (type == TRANSFORM_SOL)
-      {
-        Vector<double> new_vec (vec.Size ());
-        new_vec = ((ETmats[ei.Nr ()])->elmat) * vec.Range (0, nz);
-        vec = new_vec;
-      }
+    if (!recompute && !stores_single_precision)
+      transformElementVector<double> (ETmats->GetElmat (ei.Nr ()), vec, type);
+    else
+      withTransformHeap ([&] (LocalHeap &lh) {
+        transformElementVector<double> (getElmat<double> (ei, lh), vec, type);
+      });
   }
 
   template <typename T>
@@ -990,74 +3551,192 @@ namespace ngcomp
     static Timer timer ("EmbTrefftz: VTransform");
     RegionTimer reg (timer);
 
-    size_t nz = (ETmatsC[ei.Nr ()])->elmat.Width ();
-
-    if (type == TRANSFORM_RHS)
-      {
-        Vector<Complex> new_vec (nz);
-        new_vec = Trans ((ETmatsC[ei.Nr ()])->elmat) * vec;
-        vec = new_vec;
-      }
-    else if (type == TRANSFORM_SOL)
-      {
-        Vector<Complex> new_vec (vec.Size ());
-        new_vec = ((ETmatsC[ei.Nr ()])->elmat) * vec.Range (0, nz);
-        vec = new_vec;
-      }
+    if (!recompute)
+      transformElementVector<Complex> (ETmatsC->GetElmat (ei.Nr ()), vec,
+                                       type);
+    else
+      withTransformHeap ([&] (LocalHeap &lh) {
+        transformElementVector<Complex> (getElmat<Complex> (ei, lh), vec,
+                                         type);
+      });
   }
 
   template <typename T>
   shared_ptr<GridFunction>
   EmbTrefftzFESpace<T>::Embed (shared_ptr<GridFunction> tgfu)
   {
-    LocalHeap lh (1000 * 1000 * 1000);
     Flags flags;
 
-    auto tvec = tgfu->GetVectorPtr ();
-
     auto gfu = CreateGridFunction (this->fes, "pws", flags);
     gfu->Update ();
-    auto vec = gfu->GetVectorPtr ();
 
-    this->ma->IterateElements (VOL, lh, [&] (auto ei, LocalHeap &mlh) {
-      Array<DofId> dofs, tdofs;
-      this->fes->GetDofNrs (ei, dofs);
-      tdofs.SetSize (dofs.Size ());
-      tdofs.SetSize0 ();
+    Array<shared_ptr<BaseVector>> tvecs{ tgfu->GetVectorPtr () },
+        vecs{ gfu->GetVectorPtr () };
+    if (this->IsComplex ())
+      embedVectors<Complex> (tvecs, vecs);
+    else
+      embedVectors<double> (tvecs, vecs);
+    return gfu;
+  }
 
-      for (DofId d : dofs)
-        if (all2comp[d] >= 0)
-          tdofs.Append (all2comp[d]);
+  template <typename T>
+  shared_ptr<MultiVector>
+  EmbTrefftzFESpace<T>::EmbedMulti (const MultiVector &tvecs) const
+  {
+    const size_t num_vectors = tvecs.Size ();
+    shared_ptr<BaseVector> refvec;
+    if (this->IsComplex ())
+      refvec = createSolutionVector<Complex> (*this->fes);
+    else
+      refvec = createSolutionVector<double> (*this->fes);
+    auto vecs = make_shared<MultiVector> (refvec, num_vectors);
 
-      if (this->IsComplex ())
-        {
-          FlatVector<Complex> telvec (tdofs.Size (), mlh);
-          tvec->GetIndirect (tdofs, telvec);
-          FlatVector<Complex> elvec (dofs.Size (), mlh);
-          elvec = ((ETmatsC[ei.Nr ()])->elmat) * telvec;
-          vec->SetIndirect (dofs, elvec);
-        }
-      else
+    Array<shared_ptr<BaseVector>> tvec_array (num_vectors),
+        vec_array (num_vectors);
+    for (size_t j = 0; j < num_vectors; j++)
+      {
+        tvec_array[j] = tvecs[j];
+        vec_array[j] = (*vecs)[j];
+      }
+    if (this->IsComplex ())
+      embedVectors<Complex> (tvec_array, vec_array);
+    else
+      embedVectors<double> (tvec_array, vec_array);
+    return vecs;
+  }
+
+  template <typename T>
+  template <typename SCAL>
+  void EmbTrefftzFESpace<T>::embedVectors (
+      FlatArray<shared_ptr<BaseVector>> tvecs,
+      FlatArray<shared_ptr<BaseVector>> vecs) const
+  {
+    static Timer timer ("EmbTrefftz: Embed");
+    RegionTimer reg (timer);
+
+    const size_t num_vectors = tvecs.Size ();
+    for (const auto &vec : vecs)
+      *vec = 0.0;
+
+    // the vectors are embedded in blocks, s.t. the element vectors of a
+    // block fit into the heap of the thread
+    constexpr size_t block_size = 64;
+    ParallelForRange (this->ma->GetNE (VOL), [&] (IntRange r) {
+      Array<DofId> dofs, tdofs;
+      for (size_t elnr : r)
         {
-          FlatVector<> telvec (tdofs.Size (), mlh);
-          tvec->GetIndirect (tdofs, telvec);
-          FlatVector<> elvec (dofs.Size (), mlh);
-          elvec = ((ETmats[ei.Nr ()])->elmat) * telvec;
-          vec->SetIndirect (dofs, elvec);
+          const ElementId ei (VOL, elnr);
+          this->fes->GetDofNrs (ei, dofs);
+          tdofs.SetSize0 ();
+          for (DofId d : dofs)
+            if (all2comp[d] >= 0)
+              tdofs.Append (all2comp[d]);
+
+          // repeatable, the element vectors are set, not added
+          withTransformHeap ([&] (LocalHeap &lh) {
+            const auto P = getElmat<SCAL> (ei, lh);
+            if (P.Height () == 0)
+              return;
+            for (size_t first = 0; first < num_vectors; first += block_size)
+              {
+                const HeapReset hr_block (lh);
+                const size_t num = min (block_size, num_vectors - first);
+                // the element vectors are the rows
+                FlatMatrix<SCAL> telvecs (num, tdofs.Size (), lh);
+                FlatMatrix<SCAL> elvecs (num, dofs.Size (), lh);
+                for (size_t j = 0; j < num; j++)
+                  {
+                    FlatVector<SCAL> row = telvecs.Row (j);
+                    tvecs[first + j]->GetIndirect (tdofs, row);
+                  }
+                elvecs = telvecs * Trans (P);
+                for (size_t j = 0; j < num; j++)
+                  vecs[first + j]->SetIndirect (dofs, elvecs.Row (j));
+              }
+          });
         }
     });
-    return gfu;
   }
 
   template <typename T>
-  shared_ptr<BaseMatrix> EmbTrefftzFESpace<T>::GetEmbedding ()
+  template <typename SCAL>
+  shared_ptr<BaseMatrix>
+  EmbTrefftzFESpace<T>::getEmbedding (shared_ptr<const ElmatArena<SCAL>> ETm,
+                                      bool sparse) const
+  {
+    // without conformity, the columns of the embedding are the dofs of this
+    // space, which already has its parallel dofs from adjustDofsAfterSetOp.
+    // With conformity, the conforming dofs are shared between the elements
+    // and the columns get their own.
+    if (this->fes_conformity)
+      return Elmats2Sparse<SCAL> (*ETm, *(this->fes), this->fes_conformity);
+    if (!sparse)
+      return Elmats2Blocks<SCAL> (ETm, *(this->fes), this->GetParallelDofs ());
+    return Elmats2Sparse<SCAL> (*ETm, *(this->fes), nullptr,
+                                this->GetParallelDofs ());
+  }
+
+  template <typename T>
+  shared_ptr<BaseMatrix> EmbTrefftzFESpace<T>::GetEmbedding (bool sparse)
+  {
+    // in recompute mode, the embedding is computed for all elements. The
+    // stored embedding is shared, not copied.
+    if (this->IsComplex ())
+      return (recompute) ? getEmbedding<Complex> (
+                               make_shared<const ElmatArena<Complex>> (
+                                   computeEmbedding<Complex> (nullptr).first),
+                               sparse)
+                         : getEmbedding<Complex> (ETmatsC, sparse);
+    else if (recompute)
+      return getEmbedding<double> (
+          make_shared<const ElmatArena<double>> (
+              computeEmbedding<double> (nullptr).first),
+          sparse);
+    else if (stores_single_precision)
+      return getEmbedding<double> (
+          make_shared<const ElmatArena<double>> (ETmatsF), sparse);
+    else
+      return getEmbedding<double> (ETmats, sparse);
+  }
+
+  template <typename T>
+  shared_ptr<BaseMatrix>
+  EmbTrefftzFESpace<T>::GetOperator (shared_ptr<BilinearForm> bf)
   {
+    static Timer timer ("EmbTrefftz: GetOperator");
+    RegionTimer reg (timer);
+
+    if (recompute || stores_single_precision)
+      throw Exception ("EmbTrefftz: GetOperator needs the embedding stored "
+                       "in double precision, it is not available in "
+                       "recompute or single precision mode");
+
+    const size_t ne = this->ma->GetNE (VOL);
+    TableCreator<DofId> creator_dofs (ne), creator_tdofs (ne);
+    Array<DofId> dofs;
+    for (; !creator_dofs.Done (); creator_dofs++, creator_tdofs++)
+      for (size_t elnr = 0; elnr < ne; elnr++)
+        {
+          this->fes->GetDofNrs (ElementId (VOL, elnr), dofs);
+          for (DofId d : dofs)
+            {
+              creator_dofs.Add (elnr, d);
+              if (all2comp[d] >= 0)
+                creator_tdofs.Add (elnr, all2comp[d]);
+            }
+        }
+
+    // the operator shares the embedding, later calls to SetOp or UpdateOp
+    // replace or copy it, s.t. they do not change the operator
     if (this->IsComplex ())
-      return Elmats2Sparse<Complex> (ETmatsC, *(this->fes),
-                                     this->fes_conformity);
+      return make_shared<EmbTrefftzOperator<Complex>> (
+          ETmatsC, bf, creator_dofs.MoveTable (), creator_tdofs.MoveTable (),
+          this->GetNDof ());
     else
-      return Elmats2Sparse<double> (ETmats, *(this->fes),
-                                    this->fes_conformity);
+      return make_shared<EmbTrefftzOperator<double>> (
+          ETmats, bf,
+          creator_dofs.MoveTable (), creator_tdofs.MoveTable (),
+          this->GetNDof ());
   }
 
   // template class EmbTrefftzFESpace<L2HighOrderFESpace,
@@ -1096,18 +3775,20 @@ template <typename T> void ExportETSpace (py::module m, string label)
       .def ("SetOp",
             static_cast<shared_ptr<BaseVector> (EmbTrefftzFESpace<T>::*) (
                 shared_ptr<SumOfIntegrals>, shared_ptr<SumOfIntegrals>, double,
-                shared_ptr<FESpace>, int)> (
+                shared_ptr<FESpace>, int, bool, const std::string &)> (
                 &ngcomp::EmbTrefftzFESpace<T>::SetOp),
             "Sets the operators for the embedded Trefftz method.",
             py::arg ("bf"), py::arg ("lf") = nullptr, py::arg ("eps") = 0,
-            py::arg ("test_fes") = nullptr, py::arg ("tndof") = 0)
+            py::arg ("test_fes") = nullptr, py::arg ("tndof") = 0,
+            py::arg ("dedup") = false, py::arg ("cache_dir") = "")
       .def ("SetOp",
             static_cast<shared_ptr<BaseVector> (EmbTrefftzFESpace<T>::*) (
                 shared_ptr<const SumOfIntegrals>,
                 shared_ptr<const SumOfIntegrals>,
                 shared_ptr<const SumOfIntegrals>, shared_ptr<const FESpace>,
                 shared_ptr<const FESpace>, shared_ptr<const SumOfIntegrals>,
-                const size_t)> (&ngcomp::EmbTrefftzFESpace<T>::SetOp),
+                const size_t, const std::string &)> (
+                &ngcomp::EmbTrefftzFESpace<T>::SetOp),
             R"mydelimiter(
             Sets the operators for the conforming Trefftz method.
 
@@ -1120,15 +3801,110 @@ template <typename T> void ExportETSpace (py::module m, string label)
             :param ndof_trefftz: number of degrees of freedom per element
                 in the Trefftz finite element space on `fes`, generated by `op`
                 (i.e. the local dimension of the kernel of `op` on one element)
+            :param cache_dir: if given, the embedding is stored in and loaded from
+                a cache file in this directory. Forms with GridFunctions and
+                curved or deformed meshes are not cached.
 
             :return: the particular solution vector.)mydelimiter",
             py::arg ("op").none (true), py::arg ("cop_lhs").none (false),
             py::arg ("cop_rhs").none (false),
             py::arg ("fes_conformity").none (false),
             py::arg ("fes_test") = nullptr, py::arg ("linear_form") = nullptr,
-            py::arg ("ndof_trefftz") = 0)
+            py::arg ("ndof_trefftz") = 0, py::arg ("cache_dir") = "")
+      .def ("SetOpAssemble", &ngcomp::EmbTrefftzFESpace<T>::SetOpAssemble,
+            R"mydelimiter(
+            Sets the operators like SetOp and assembles the volume terms of
+            `a` on the Trefftz space in the same loop over the elements.
+            The element matrices of `a` are projected right after the
+            embedding is computed, instead of being integrated again during
+            the assembly on the Trefftz space. Skeleton and boundary terms
+            are not supported, assemble them on the Trefftz space and add
+            them to the returned matrix.
+
+            :param op: the differential operation
+            :param a: the volume terms of the bilinear form
+            :param lf: right hand side of the var. formulation. Can be None
+
+            :return: the matrix P^T A P on the Trefftz dofs and the
+                particular solution vector.)mydelimiter",
+            py::arg ("op"), py::arg ("a"), py::arg ("lf") = nullptr,
+            py::arg ("eps") = 0, py::arg ("test_fes") = nullptr,
+            py::arg ("tndof") = 0)
+      .def ("SetRecompute", &ngcomp::EmbTrefftzFESpace<T>::SetRecompute,
+            R"mydelimiter(
+            Switches the recompute mode on or off, takes effect at the next
+            call to SetOp. In recompute mode the element embeddings are not
+            stored but recomputed whenever they are needed, e.g. during the
+            assembly on the Trefftz space. This trades the memory of the
+            embedding for flops. The cache_dir of SetOp is ignored and
+            GetOperator is not available in this mode.
+
+            :param recompute: enable the recompute mode
+            :param cache_size: number of recently used element embeddings
+                kept by each thread)mydelimiter",
+            py::arg ("recompute") = true, py::arg ("cache_size") = 0)
+      .def ("SetSinglePrecision",
+            &ngcomp::EmbTrefftzFESpace<T>::SetSinglePrecision,
+            R"mydelimiter(
+            Stores the embedding of a real space in single precision, takes
+            effect at the next call to SetOp. The embedding is still computed
+            in double precision and widened to double when it is applied,
+            so only its entries are rounded to float (relative error about
+            1e-7). This halves the memory of the embedding. GetOperator is
+            not available in this mode.
+
+            :param single_precision: enable the single precision storage)mydelimiter",
+            py::arg ("single_precision") = true)
+      .def ("UpdateOp", &ngcomp::EmbTrefftzFESpace<T>::UpdateOp,
+            R"mydelimiter(
+            Recomputes the embedding on some elements with the operators of
+            the last call to SetOp, e.g. after a coefficient changed on them.
+            The dofs are only renumbered, if the local dimension of the
+            Trefftz space changed on one of the elements.
+
+            :param elements: BitArray with one entry per volume element,
+                marking the elements to update
+
+            :return: the particular solution vector, updated in place.)mydelimiter",
+            py::arg ("elements"))
       .def ("Embed", &ngcomp::EmbTrefftzFESpace<T>::Embed)
-      .def ("GetEmbedding", &ngcomp::EmbTrefftzFESpace<T>::GetEmbedding);
+      .def ("Embed", &ngcomp::EmbTrefftzFESpace<T>::EmbedMulti,
+            R"mydelimiter(
+            Embeds several vectors of the Trefftz space at once, e.g. the
+            snapshots of a time stepping. Each element embedding is applied
+            to all vectors by one matrix-matrix product.
+
+            :param tvecs: MultiVector on the Trefftz space
+
+            :return: MultiVector of the embedded vectors on the underlying
+                space)mydelimiter",
+            py::arg ("tvecs"))
+      .def ("GetEmbedding", &ngcomp::EmbTrefftzFESpace<T>::GetEmbedding,
+            R"mydelimiter(
+            Embedding of the Trefftz space into the underlying space.
+
+            :param sparse: return a SparseMatrix. Otherwise, if the space has
+                no conformity constraints, the embedding is returned as a
+                block matrix of the dense element embeddings, which is
+                cheaper to apply.
+
+            :return: the embedding P, a ParallelMatrix on distributed
+                meshes)mydelimiter",
+            py::arg ("sparse") = false)
+      .def ("GetOperator", &ngcomp::EmbTrefftzFESpace<T>::GetOperator,
+            R"mydelimiter(
+            Matrix-free operator of the bilinear form on the Trefftz space,
+            applying P^T A P element by element without assembling A or the
+            embedding P. The operator keeps the current embedding, later
+            calls to SetOp or UpdateOp do not change it. Applied to a
+            MultiVector, forms with volume terms only are applied by the
+            element matrices P_T^T A_T P_T, which are formed once.
+
+            :param bf: BilinearForm on the underlying space, use
+                nonassemble=True to apply it matrix-free
+
+            :return: BaseMatrix acting on vectors of the Trefftz space)mydelimiter",
+            py::arg ("bf"));
 }
 
 /// call `EmbTrefftz` for the ConstrainedTrefftz procedure and pack the
@@ -1143,7 +3919,8 @@ pythonConstrTrefftzWithLf (optional<const SumOfIntegrals> op,
                            shared_ptr<const FESpace> fes_conformity,
                            shared_ptr<const SumOfIntegrals> linear_form,
                            std::variant<size_t, double> ndof_trefftz,
-                           shared_ptr<const FESpace> fes_test_ptr)
+                           shared_ptr<const FESpace> fes_test_ptr,
+                           const std::string &cache_dir)
 {
   // guard against unwanted segfaults by checking that the pointers are not
   // null.
@@ -1165,7 +3942,8 @@ pythonConstrTrefftzWithLf (optional<const SumOfIntegrals> op,
 
   auto [P, u_lf] = EmbTrefftz<double> (op, *fes, fes_test, cop_lhs_v,
                                        cop_rhs_v, fes_conformity, linear_form,
-                                       ndof_trefftz, nullptr);
+                                       ndof_trefftz, nullptr, false, false,
+                                       cache_dir);
   return std::make_tuple (
       ngcomp::Elmats2Sparse<double> (P, *fes, fes_conformity), u_lf);
 }
@@ -1179,11 +3957,12 @@ pythonConstrTrefftz (optional<const SumOfIntegrals> op,
                      shared_ptr<const SumOfIntegrals> cop_rhs,
                      shared_ptr<const FESpace> fes_conformity,
                      std::variant<size_t, double> ndof_trefftz,
-                     shared_ptr<const FESpace> fes_test)
+                     shared_ptr<const FESpace> fes_test,
+                     const std::string &cache_dir)
 {
-  return std::get<0> (pythonConstrTrefftzWithLf (op, fes, cop_lhs, cop_rhs,
-                                                 fes_conformity, nullptr,
-                                                 ndof_trefftz, fes_test));
+  return std::get<0> (pythonConstrTrefftzWithLf (
+      op, fes, cop_lhs, cop_rhs, fes_conformity, nullptr, ndof_trefftz,
+      fes_test, cache_dir));
 }
 
 /// call `EmbTrefftz` for the plain embedded Trefftz procedure and pack the
@@ -1193,7 +3972,9 @@ pythonEmbTrefftzWithLf (shared_ptr<ngfem::SumOfIntegrals> bf,
                         shared_ptr<ngcomp::FESpace> fes,
                         shared_ptr<ngfem::SumOfIntegrals> lf, double eps,
                         shared_ptr<ngcomp::FESpace> test_fes, int tndof,
-                        bool getrange, optional<py::dict> stats_dict)
+                        bool getrange, optional<py::dict> stats_dict,
+                        bool dedup, const std::string &cache_dir,
+                        const std::string &method)
 {
   shared_ptr<py::dict> pystats = nullptr;
   if (stats_dict)
@@ -1218,7 +3999,9 @@ pythonEmbTrefftzWithLf (shared_ptr<ngfem::SumOfIntegrals> bf,
       //    nullopt, nullptr, lf, (tndof == 0) ? eps : tndof, stats);
       auto P = ngcomp::EmbTrefftz<Complex> (
           make_optional (*bf), *fes, (test_fes) ? *test_fes : *fes, nullopt,
-          nullopt, nullptr, lf, (tndof != 0) ? tndof : eps, nullptr, false);
+          nullopt, nullptr, lf, (tndof != 0) ? tndof : eps, nullptr, false,
+          dedup, cache_dir,
+          ngcomp::ParseEmbTrefftzMethod (method));
       if (pystats)
         for (auto const &x : *stats)
           (*pystats)[py::cast (x.first)] = py::cast (x.second);
@@ -1237,7 +4020,9 @@ pythonEmbTrefftzWithLf (shared_ptr<ngfem::SumOfIntegrals> bf,
       //     nullopt, nullptr, lf, (tndof == 0) ? eps : tndof, stats);
       auto P = ngcomp::EmbTrefftz<double> (
           make_optional (*bf), *fes, (test_fes) ? *test_fes : *fes, nullopt,
-          nullopt, nullptr, lf, (tndof != 0) ? tndof : eps, stats, false);
+          nullopt, nullptr, lf, (tndof != 0) ? tndof : eps, stats, false,
+          dedup, cache_dir,
+          ngcomp::ParseEmbTrefftzMethod (method));
       if (pystats)
         for (auto const &x : *stats)
           (*pystats)[py::cast (x.first)] = py::cast (x.second);
@@ -1247,13 +4032,80 @@ pythonEmbTrefftzWithLf (shared_ptr<ngfem::SumOfIntegrals> bf,
     }
 }
 
+/// call `EmbTrefftzMultiRhs` for the plain embedded Trefftz procedure and
+/// pack the resulting element matrices in a sparse matrix and the particular
+/// solutions in a MultiVector.
+template <typename SCAL>
+std::tuple<shared_ptr<ngcomp::BaseMatrix>, shared_ptr<ngla::MultiVector>>
+embTrefftzWithLfs (
+    const ngfem::SumOfIntegrals &bf, const ngcomp::FESpace &fes,
+    const ngcomp::FESpace &test_fes,
+    FlatArray<shared_ptr<const ngfem::SumOfIntegrals>> lfs,
+    const std::variant<size_t, double> ndof_trefftz,
+    shared_ptr<py::dict> pystats,
+    const bool dedup, const std::string &cache_dir,
+    const ngcomp::EmbTrefftzMethod method)
+{
+  shared_ptr<std::map<std::string, ngcomp::Vector<SCAL>>> stats = nullptr;
+  if (pystats)
+    stats = make_shared<std::map<std::string, ngcomp::Vector<SCAL>>> ();
+  auto [P, particular_solutions] = ngcomp::EmbTrefftzMultiRhs<SCAL> (
+      make_optional (bf), fes, test_fes, nullopt, nullopt, nullptr, lfs,
+      ndof_trefftz, stats, false, dedup, cache_dir, method);
+  if (pystats)
+    for (auto const &x : *stats)
+      (*pystats)[py::cast (x.first)] = py::cast (x.second);
+
+  auto solutions = make_shared<ngla::MultiVector> (
+      particular_solutions[0], particular_solutions.Size ());
+  for (size_t j = 0; j < particular_solutions.Size (); j++)
+    *(*solutions)[j] = *particular_solutions[j];
+  return std::make_tuple (ngcomp::Elmats2Sparse<SCAL> (P, fes, nullptr),
+                          solutions);
+}
+
+/// call `EmbTrefftz` for several right hand sides at once.
+std::tuple<shared_ptr<ngcomp::BaseMatrix>, shared_ptr<ngla::MultiVector>>
+pythonEmbTrefftzWithLfs (shared_ptr<ngfem::SumOfIntegrals> bf,
+                         shared_ptr<ngcomp::FESpace> fes, py::list lfs,
+                         double eps, shared_ptr<ngcomp::FESpace> test_fes,
+                         int tndof, bool getrange,
+                         optional<py::dict> stats_dict, bool dedup,
+                         const std::string &cache_dir,
+                         const std::string &method)
+{
+  shared_ptr<py::dict> pystats = nullptr;
+  if (stats_dict)
+    pystats = make_shared<py::dict> (*stats_dict);
+  if (getrange)
+    throw std::invalid_argument ("not supported at the moment!");
+  if (lfs.size () == 0)
+    throw std::invalid_argument ("lfs must contain at least one linear form");
+
+  Array<shared_ptr<const ngfem::SumOfIntegrals>> linear_forms;
+  for (auto lf : lfs)
+    linear_forms.Append (py::cast<shared_ptr<ngfem::SumOfIntegrals>> (lf));
+
+  if (fes->IsComplex ())
+    return embTrefftzWithLfs<Complex> (
+        *bf, *fes, (test_fes) ? *test_fes : *fes, linear_forms,
+        (tndof != 0) ? tndof : eps, pystats, dedup, cache_dir,
+        ngcomp::ParseEmbTrefftzMethod (method));
+  else
+    return embTrefftzWithLfs<double> (
+        *bf, *fes, (test_fes) ? *test_fes : *fes, linear_forms,
+        (tndof != 0) ? tndof : eps, pystats, dedup, cache_dir,
+        ngcomp::ParseEmbTrefftzMethod (method));
+}
+
 /// call `EmbTrefftz` for the plain embedded Trefftz procedure and pack the
 /// resulting element matrices in a sparse matrix.
 shared_ptr<ngcomp::BaseMatrix>
 pythonEmbTrefftz (shared_ptr<ngfem::SumOfIntegrals> bf,
                   shared_ptr<ngcomp::FESpace> fes, double eps,
                   shared_ptr<ngcomp::FESpace> test_fes, int tndof,
-                  bool getrange, optional<py::dict> stats_dict)
+                  bool getrange, optional<py::dict> stats_dict, bool dedup,
+                  const std::string &cache_dir, const std::string &method)
 {
   shared_ptr<py::dict> pystats = nullptr;
   if (stats_dict)
@@ -1268,7 +4120,8 @@ pythonEmbTrefftz (shared_ptr<ngfem::SumOfIntegrals> bf,
       auto P = std::get<0> (ngcomp::EmbTrefftz<Complex> (
           make_optional (*bf), *fes, (test_fes) ? *test_fes : *fes, nullopt,
           nullopt, nullptr, nullptr, (tndof != 0) ? tndof : eps, stats,
-          getrange));
+          getrange, dedup, cache_dir,
+          ngcomp::ParseEmbTrefftzMethod (method)));
       if (pystats)
         for (auto const &x : *stats)
           (*pystats)[py::cast (x.first)] = py::cast (x.second);
@@ -1283,7 +4136,8 @@ pythonEmbTrefftz (shared_ptr<ngfem::SumOfIntegrals> bf,
       auto P = std::get<0> (ngcomp::EmbTrefftz<double> (
           make_optional (*bf), *fes, (test_fes) ? *test_fes : *fes, nullopt,
           nullopt, nullptr, nullptr, (tndof != 0) ? tndof : eps, stats,
-          getrange));
+          getrange, dedup, cache_dir,
+          ngcomp::ParseEmbTrefftzMethod (method)));
       if (pystats)
         for (auto const &x : *stats)
           (*pystats)[py::cast (x.first)] = py::cast (x.second);
@@ -1332,6 +4186,23 @@ void ExportEmbTrefftz (py::module m)
                         )mydelimiter",
       py::arg ("fes"));
 
+  m.def (
+      "SetEmbTrefftzTrace",
+      [] (const std::string &filename, const uint32_t level) {
+        ngcomp::EmbTrefftzTrace::Get ().Open (filename, level);
+      },
+      R"mydelimiter(
+                Traces every element embedded by TrefftzEmbedding and
+                EmbeddedTrefftzFES.SetOp to a binary file. The records are
+                written by a separate thread, see embttrace.hpp for the
+                layout. A running trace is closed first.
+
+                :param filename: the trace file, it is overwritten
+                :param level: 0 closes the trace, 1 traces the local dimensions
+                    of every element, 2 additionally its embedding
+            )mydelimiter",
+      py::arg ("filename") = "", py::arg ("level") = 0);
+
   m.def ("TrefftzEmbedding", &pythonEmbTrefftzWithLf,
          R"mydelimiter(
                 Computes the Trefftz embedding and particular solution.
@@ -1343,13 +4214,34 @@ void ExportEmbTrefftz (py::module m)
                 :param test_fes: Used if test space differs from trial space, defaults to None
                 :param tndof: If known, local ndofs of the Trefftz space, else eps and/or test_fes are used to find the dimension
                 :param getrange: If True, extract the range instead of the kernel
-                :param stats_dict: Pass a dictionary to fill it with stats on the singular values.
+                :param stats_dict: Pass a dictionary to fill it with stats: the average, maximal and minimal singular values ('singavg', 'singmax', 'singmin'), the local Trefftz dimension and condition number of every element ('ndoftrefftz', 'cond'), a histogram of the condition numbers per decade, with the last bin for 1e16 and above ('condhist'), and the seconds spent in integration, decomposition, inversion and particular solutions, summed over all threads ('timings'). Elements embedded by the 'subspace' method have no singular values, they are left out of the singular values and the histogram and their 'cond' is 0.
+                :param dedup: If True, the SVD is computed only once per class of congruent elements and reused for the other elements of the class.
+                :param cache_dir: If given, the embedding is stored in a cache file in this directory, keyed by a hash of the mesh, spaces and forms. Later calls with the same setup load it from there instead of recomputing it. The values of Parameters are part of the key. Forms containing GridFunctions, whose values are not hashed, and curved or deformed meshes are never cached.
+                :param method: Decomposition of the local systems: 'svd' (default, robust), 'qr' (column pivoted QR), 'eig' (eigen decomposition of A^H A, for well-conditioned cases), 'jacobi' (one-sided Jacobi SVD, batched over elements with local systems of equal shape, for low to medium orders) or 'subspace' (inverse subspace iteration for the kernel only, for high orders, needs tndof and falls back to the SVD if it does not converge). The range is always computed with an SVD.
 
                 :return: [Trefftz embedding, particular solution]
             )mydelimiter",
          py::arg ("bf"), py::arg ("fes"), py::arg ("lf"), py::arg ("eps") = 0,
          py::arg ("test_fes") = nullptr, py::arg ("tndof") = 0,
-         py::arg ("getrange") = false, py::arg ("stats_dict") = nullopt);
+         py::arg ("getrange") = false, py::arg ("stats_dict") = nullopt,
+         py::arg ("dedup") = false, py::arg ("cache_dir") = "",
+         py::arg ("method") = "svd");
+
+  m.def ("TrefftzEmbedding", &pythonEmbTrefftzWithLfs,
+         R"mydelimiter(
+                Computes the Trefftz embedding and the particular solutions for a list of right hand sides. The local systems are decomposed only once for all of them.
+
+                :param lfs: list of rhs used to compute the particular solutions.
+
+                All other parameters are as above.
+
+                :return: [Trefftz embedding, MultiVector of the particular solutions]
+            )mydelimiter",
+         py::arg ("bf"), py::arg ("fes"), py::arg ("lfs"), py::arg ("eps") = 0,
+         py::arg ("test_fes") = nullptr, py::arg ("tndof") = 0,
+         py::arg ("getrange") = false, py::arg ("stats_dict") = nullopt,
+         py::arg ("dedup") = false, py::arg ("cache_dir") = "",
+         py::arg ("method") = "svd");
 
   m.def ("TrefftzEmbedding", &pythonEmbTrefftz,
          R"mydelimiter(
@@ -1359,7 +4251,9 @@ void ExportEmbTrefftz (py::module m)
             )mydelimiter",
          py::arg ("bf"), py::arg ("fes"), py::arg ("eps") = 0,
          py::arg ("test_fes") = nullptr, py::arg ("tndof") = 0,
-         py::arg ("getrange") = false, py::arg ("stats_dict") = py::none ());
+         py::arg ("getrange") = false, py::arg ("stats_dict") = py::none (),
+         py::arg ("dedup") = false, py::arg ("cache_dir") = "",
+         py::arg ("method") = "svd");
 
   m.def ("TrefftzEmbedding", &pythonConstrTrefftz,
          R"mydelimiter(
@@ -1382,7 +4276,7 @@ void ExportEmbTrefftz (py::module m)
          py::arg ("op"), py::arg ("fes"), py::arg ("cop_lhs"),
          py::arg ("cop_rhs"), py::arg ("fes_conformity"),
          py::arg ("ndof_trefftz") = py::none (),
-         py::arg ("fes_test") = py::none ());
+         py::arg ("fes_test") = py::none (), py::arg ("cache_dir") = "");
 
   m.def ("TrefftzEmbedding", &pythonConstrTrefftzWithLf,
          R"mydelimiter(
@@ -1407,7 +4301,7 @@ void ExportEmbTrefftz (py::module m)
          py::arg ("op"), py::arg ("fes"), py::arg ("cop_lhs"),
          py::arg ("cop_rhs"), py::arg ("fes_conformity"),
          py::arg ("linear_form"), py::arg ("ndof_trefftz") = py::none (),
-         py::arg ("fes_test") = py::none ());
+         py::arg ("fes_test") = py::none (), py::arg ("cache_dir") = "");
 }
 
 #endif // NGS_PYTHON
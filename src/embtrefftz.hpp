@@ -2,22 +2,326 @@
 #define FILE_SVDTREFFTZ_HPP
 #include <comp.hpp>
 #include <python_comp.hpp>
+#include <unordered_map>
 
 #ifndef FILE_INTEGRATORCFHPP
 #include <integratorcf.hpp>
 #define FILE_INTEGRATORCFHPP
 #endif
 
-/// For a mesh element, this struct holds the ndof for the Trefftz and
-/// conforming part of the conforming Trefftz space.
-template <typename SCAL> struct ElmatWithTrefftzInfo
+/// Holds the element matrices of the Trefftz embedding for all mesh
+/// elements, together with the ndof of the Trefftz part of each element.
+///
+/// All matrices live in one contiguous buffer, in element order, and are
+/// addressed by an offset table and the shape of each matrix. Elements
+/// without an embedding have no matrix, several elements may share the same
+/// matrix (see \ref Alias).
+///
+/// The arena is filled in three steps: \ref Reserve space for every element,
+/// then (possibly in parallel) write each element matrix into the view
+/// returned by \ref SetElmat, finally \ref Compact the buffer. Afterwards,
+/// the matrices of single elements can be replaced by \ref Patch.
+template <typename SCAL> class ElmatArena
 {
-  ngla::Matrix<SCAL> elmat;
-  size_t ndof_trefftz;
+  static constexpr size_t undefined = size_t (-1);
+
+  ngcore::Array<SCAL> data;
+  ngcore::Array<size_t> offsets;
+  ngcore::Array<uint32_t> heights;
+  ngcore::Array<uint32_t> widths;
+  ngcore::Array<uint32_t> ndofs_trefftz;
+  /// only needed while filling the arena: reserved space per element and
+  /// the element whose matrix is shared by an alias
+  ngcore::Array<size_t> capacities;
+  ngcore::Array<size_t> alias_of;
+  /// set for elements whose matrix is shared with other elements
+  ngcore::Array<bool> shares_block;
+
+  template <typename> friend class ElmatArena;
+
+public:
+  ElmatArena () = default;
+
+  /// copy of `other` with the entries converted to `SCAL`, e.g. to store the
+  /// embedding in single precision. Elements sharing a matrix in `other`
+  /// share it in the copy. `other` has to be compacted.
+  template <typename OTHER>
+  explicit ElmatArena (const ElmatArena<OTHER> &other)
+      : data (other.data.Size ()), offsets (other.offsets),
+        heights (other.heights), widths (other.widths),
+        ndofs_trefftz (other.ndofs_trefftz), shares_block (other.shares_block)
+  {
+    ngcore::ParallelForRange (data.Size (), [&] (ngcore::T_Range<size_t> r) {
+      for (size_t i : r)
+        data[i] = static_cast<SCAL> (other.data[i]);
+    });
+  }
+
+  /// reserves `capacities[elnr]` entries for the matrix of element `elnr`
+  void Reserve (ngcore::FlatArray<size_t> element_capacities)
+  {
+    const size_t num_elements = element_capacities.Size ();
+    offsets.SetSize (num_elements);
+    heights.SetSize (num_elements);
+    widths.SetSize (num_elements);
+    ndofs_trefftz.SetSize (num_elements);
+    alias_of.SetSize (num_elements);
+    capacities.SetSize (num_elements);
+    shares_block.SetSize (num_elements);
+    heights = 0;
+    widths = 0;
+    ndofs_trefftz = 0;
+    alias_of = undefined;
+    shares_block = false;
+
+    size_t total = 0;
+    for (size_t elnr = 0; elnr < num_elements; elnr++)
+      {
+        capacities[elnr] = element_capacities[elnr];
+        offsets[elnr] = total;
+        total += capacities[elnr];
+      }
+    data.SetSize (total);
+  }
+
+  /// defines the shape of the matrix of element `elnr`.
+  /// @returns the view into the arena, the matrix has to be written to.
+  ngbla::FlatMatrix<SCAL> SetElmat (const size_t elnr, const size_t height,
+                                    const size_t width,
+                                    const size_t ndof_trefftz)
+  {
+    if (height * width > capacities[elnr])
+      throw ngcore::Exception (
+          "ElmatArena: element matrix of size " + std::to_string (height)
+          + "x" + std::to_string (width) + " exceeds reserved space of "
+          + std::to_string (capacities[elnr]) + " entries");
+    heights[elnr] = height;
+    widths[elnr] = width;
+    ndofs_trefftz[elnr] = ndof_trefftz;
+    alias_of[elnr] = undefined;
+    return GetElmat (elnr);
+  }
+
+  /// element `elnr` shares the matrix of element `other`, which has to be
+  /// set with \ref SetElmat already.
+  void Alias (const size_t elnr, const size_t other)
+  {
+    heights[elnr] = heights[other];
+    widths[elnr] = widths[other];
+    ndofs_trefftz[elnr] = ndofs_trefftz[other];
+    alias_of[elnr] = other;
+  }
+
+  /// removes the unused reserved space and the storage of aliases. Blocks
+  /// which are no longer used after a \ref Patch are removed as well.
+  void Compact ()
+  {
+    const size_t num_elements = offsets.Size ();
+    // the element whose block each element uses: an alias uses the block of
+    // the aliased element, elements sharing a block since an earlier
+    // compaction use the one of the first element at its offset
+    ngcore::Array<size_t> owner (num_elements);
+    std::unordered_map<size_t, size_t> first_at_offset;
+    for (size_t elnr = 0; elnr < num_elements; elnr++)
+      if (alias_of.Size () && alias_of[elnr] != undefined)
+        owner[elnr] = alias_of[elnr];
+      else if (shares_block[elnr])
+        owner[elnr]
+            = first_at_offset.emplace (offsets[elnr], elnr).first->second;
+      else
+        owner[elnr] = elnr;
+
+    ngcore::Array<size_t> new_offsets (num_elements);
+    size_t total = 0;
+    bool moved = false;
+    for (size_t elnr = 0; elnr < num_elements; elnr++)
+      {
+        new_offsets[elnr] = total;
+        if (owner[elnr] == elnr)
+          {
+            total += size_t (heights[elnr]) * widths[elnr];
+            moved = moved || new_offsets[elnr] != offsets[elnr];
+          }
+      }
+
+    if (moved || total != data.Size ())
+      {
+        ngcore::Array<SCAL> new_data (total);
+        ngcore::ParallelFor (num_elements, [&] (size_t elnr) {
+          if (owner[elnr] != elnr)
+            return;
+          const size_t size = size_t (heights[elnr]) * widths[elnr];
+          for (size_t i = 0; i < size; i++)
+            new_data[new_offsets[elnr] + i] = data[offsets[elnr] + i];
+        });
+        data = std::move (new_data);
+      }
+    for (size_t elnr = 0; elnr < num_elements; elnr++)
+      {
+        offsets[elnr] = new_offsets[owner[elnr]];
+        if (owner[elnr] != elnr)
+          shares_block[elnr] = shares_block[owner[elnr]] = true;
+      }
+
+    capacities.SetSize0 ();
+    alias_of.SetSize0 ();
+  }
+
+  /// replaces the matrices of the elements `elnrs` by their matrices in
+  /// `update`. A matrix keeps its place in the buffer, if it has the same
+  /// size as before and is not shared with other elements, otherwise the new
+  /// matrix is appended to the buffer, which is compacted afterwards.
+  void Patch (const ElmatArena &update, ngcore::FlatArray<size_t> elnrs)
+  {
+    const size_t old_total = data.Size ();
+    size_t total = old_total;
+    ngcore::Array<size_t> new_offsets (elnrs.Size ());
+    for (size_t i = 0; i < elnrs.Size (); i++)
+      {
+        const size_t elnr = elnrs[i];
+        const size_t size
+            = size_t (update.heights[elnr]) * update.widths[elnr];
+        if (!shares_block[elnr]
+            && size == size_t (heights[elnr]) * widths[elnr])
+          new_offsets[i] = offsets[elnr];
+        else
+          {
+            new_offsets[i] = total;
+            total += size;
+          }
+      }
+    data.SetSize (total);
+
+    ngcore::ParallelFor (elnrs.Size (), [&] (size_t i) {
+      const size_t elnr = elnrs[i];
+      offsets[elnr] = new_offsets[i];
+      heights[elnr] = update.heights[elnr];
+      widths[elnr] = update.widths[elnr];
+      ndofs_trefftz[elnr] = update.ndofs_trefftz[elnr];
+      shares_block[elnr] = false;
+      GetElmat (elnr) = update.GetElmat (elnr);
+    });
+
+    // the old blocks of the moved matrices are dead space now
+    if (total != old_total)
+      Compact ();
+  }
+
+  size_t Size () const { return offsets.Size (); }
+
+  /// @returns true, if element `elnr` has an embedding matrix
+  bool IsDefined (const size_t elnr) const { return heights[elnr] > 0; }
+
+  ngbla::FlatMatrix<SCAL> GetElmat (const size_t elnr) const
+  {
+    const size_t offset = (alias_of.Size () && alias_of[elnr] != undefined)
+                              ? offsets[alias_of[elnr]]
+                              : offsets[elnr];
+    return ngbla::FlatMatrix<SCAL> (heights[elnr], widths[elnr],
+                                    data.Data () + offset);
+  }
+
+  size_t GetNdofTrefftz (const size_t elnr) const
+  {
+    return ndofs_trefftz[elnr];
+  }
+};
+
+/// Least recently used cache for the element matrices of a bounded number of
+/// elements. Lookups are linear in the capacity, it is meant for a few
+/// elements, e.g. the neighbours of the elements processed by one thread.
+template <typename SCAL> class ElmatLRUCache
+{
+  size_t capacity = 0;
+  size_t time = 0;
+  ngcore::Array<size_t> elnrs;
+  ngcore::Array<size_t> last_used;
+  ngcore::Array<ngbla::Matrix<SCAL>> elmats;
+
+public:
+  /// sets the maximal number of cached elements and clears the cache
+  void SetCapacity (const size_t acapacity)
+  {
+    capacity = acapacity;
+    elnrs.SetSize0 ();
+    last_used.SetSize0 ();
+    elmats.SetSize (0);
+  }
+
+  size_t Capacity () const { return capacity; }
+
+  /// @returns the cached matrix of element `elnr`, or `nullptr`
+  ngbla::Matrix<SCAL> *Find (const size_t elnr)
+  {
+    for (size_t i = 0; i < elnrs.Size (); i++)
+      if (elnrs[i] == elnr)
+        {
+          last_used[i] = ++time;
+          return &elmats[i];
+        }
+    return nullptr;
+  }
+
+  /// @returns the matrix for element `elnr` of the given shape, which has to
+  /// be filled by the caller. Replaces the least recently used element, if
+  /// the cache is full.
+  ngbla::FlatMatrix<SCAL>
+  Insert (const size_t elnr, const size_t height, const size_t width)
+  {
+    size_t slot = elnrs.Size ();
+    if (slot < capacity)
+      {
+        elnrs.Append (elnr);
+        last_used.Append (0);
+        elmats.Append (ngbla::Matrix<SCAL> ());
+      }
+    else
+      {
+        slot = 0;
+        for (size_t i = 1; i < elnrs.Size (); i++)
+          if (last_used[i] < last_used[slot])
+            slot = i;
+      }
+    elnrs[slot] = elnr;
+    last_used[slot] = ++time;
+    elmats[slot].SetSize (height, width);
+    return elmats[slot];
+  }
 };
 
 namespace ngcomp
 {
+  template <typename SCAL> class LocalTrefftzEmbedding;
+
+  /// Backend for the kernel and the pseudoinverse of the local systems in
+  /// \ref EmbTrefftz. QR and EIG need LAPACK, otherwise the SVD is used.
+  enum class EmbTrefftzMethod
+  {
+    /// singular value decomposition, robust
+    SVD,
+    /// column pivoted QR decomposition of `A^H`, the singular values are
+    /// estimated by the diagonal of `R`
+    QR,
+    /// eigen decomposition of `A^H A`, only for well-conditioned systems
+    /// since the condition number is squared
+    EIG,
+    /// one-sided Jacobi SVD, applied to batches of elements whose local
+    /// systems have the same shape (one element per SIMD lane for real
+    /// systems). Avoids the per call overhead of LAPACK for small systems.
+    /// With `dedup`, the elements are decomposed one at a time.
+    JACOBI,
+    /// block inverse subspace iteration for the kernel, for high orders.
+    /// Needs the number of Trefftz dofs `ndof_trefftz` and computes only
+    /// the kernel instead of a full SVD. Like EIG it works with `A^H A`, the
+    /// singular values are estimated by the column norms of `A`. Falls back
+    /// to the SVD, if the iteration does not converge.
+    SUBSPACE
+  };
+
+  /// @returns the method named "svd", "qr", "eig", "jacobi" or "subspace"
+  /// @throws std::invalid_argument for any other name
+  EmbTrefftzMethod ParseEmbTrefftzMethod (const std::string &name);
+
   /// creates an embedding marix P for the given operations `op`,
   /// `cop_lhs`, `cop_rhs`.
   ///
@@ -49,11 +353,45 @@ namespace ngcomp
   ///      ndof_conforming` for each element. Thus it is assumed, that the
   ///      kernel of `op` is sufficiently big.
   ///
+  ///  @param stats if given, it is filled with statistics of the local
+  ///      systems: the singular values ("singavg", "singmax", "singmin"),
+  ///      the local Trefftz dimension and condition number of each element
+  ///      ("ndoftrefftz", "cond"), a histogram of the condition numbers per
+  ///      decade ("condhist") and the time spent in the phases integration,
+  ///      decomposition, inversion and particular solution ("timings").
+  ///      They are collected per thread and merged at the end. Elements
+  ///      embedded by EmbTrefftzMethod::SUBSPACE compute no singular values,
+  ///      they are left out of the singular values and the histogram and
+  ///      their condition number is 0.
+  ///
+  ///  @param dedup if true, elements are grouped into classes of congruent
+  ///      elements (same element type and vertex coordinates up to
+  ///      translation and scaling). The SVD is only computed once per class,
+  ///      the other elements of the class reuse it, if their local system is
+  ///      a scalar multiple of the one of the representative.
+  ///
+  ///  @param cache_dir if not empty, the result is stored in a cache file in
+  ///      this directory, keyed by a hash of the mesh, the spaces and the
+  ///      forms (see \ref EmbTrefftzCacheKey). If such a file exists already,
+  ///      the embedding is loaded from it instead of recomputed. The
+  ///      statistics are not cached, so `stats` forces a recomputation.
+  ///      Forms with grid functions and curved or deformed meshes are never
+  ///      cached, the values of parameters are part of the key.
+  ///
+  ///  @param method backend for the kernels and pseudoinverses of the
+  ///      local systems, see \ref EmbTrefftzMethod. The range (`get_range`)
+  ///      is always computed with an SVD.
+  ///
+  ///  @param elements if given, only the elements set in it are embedded,
+  ///      all other elements are left without embedding and particular
+  ///      solution. The cache is not used in this case.
+  ///
   ///  @return (P, f), the embedding `P` and particlar solution `f`. `P` is
-  ///  represented as a vector of all element matrices.
+  ///  represented by the arena of all element matrices.
+  ///
+  ///  \see EmbTrefftzMultiRhs for several linear forms
   template <typename SCAL>
-  pair<vector<optional<ElmatWithTrefftzInfo<SCAL>>>,
-       shared_ptr<ngla::BaseVector>>
+  pair<ElmatArena<SCAL>, shared_ptr<ngla::BaseVector>>
   EmbTrefftz (const std::optional<SumOfIntegrals> &op, const FESpace &fes,
               const FESpace &fes_test,
               const std::optional<ngfem::SumOfIntegrals> &cop_lhs,
@@ -62,7 +400,188 @@ namespace ngcomp
               shared_ptr<const ngfem::SumOfIntegrals> linear_form,
               const std::variant<size_t, double> ndof_trefftz,
               shared_ptr<std::map<std::string, Vector<SCAL>>> stats = nullptr,
-              const bool get_range = false);
+              const bool get_range = false, const bool dedup = false,
+              const std::string &cache_dir = "",
+              const EmbTrefftzMethod method = EmbTrefftzMethod::SVD,
+              shared_ptr<const BitArray> elements = nullptr);
+
+  /// Same as \ref EmbTrefftz, but computes the particular solutions of
+  /// several linear forms in the same pass. The pseudoinverse of every local
+  /// system is applied to the element vectors of all linear forms at once.
+  ///
+  ///  @param linear_forms right hand sides to the Trefftz operation `op`.
+  ///  Linear forms on `fes_test`.
+  ///
+  ///  @return (P, fs), the embedding `P` and the particlar solution for each
+  ///  linear form.
+  template <typename SCAL>
+  pair<ElmatArena<SCAL>, Array<shared_ptr<ngla::BaseVector>>>
+  EmbTrefftzMultiRhs (
+      const std::optional<SumOfIntegrals> &op, const FESpace &fes,
+      const FESpace &fes_test,
+      const std::optional<ngfem::SumOfIntegrals> &cop_lhs,
+      const std::optional<ngfem::SumOfIntegrals> &cop_rhs,
+      const shared_ptr<const FESpace> fes_conformity,
+      FlatArray<shared_ptr<const ngfem::SumOfIntegrals>> linear_forms,
+      const std::variant<size_t, double> ndof_trefftz,
+      shared_ptr<std::map<std::string, Vector<SCAL>>> stats = nullptr,
+      const bool get_range = false, const bool dedup = false,
+      const std::string &cache_dir = "",
+      const EmbTrefftzMethod method = EmbTrefftzMethod::SVD,
+      shared_ptr<const BitArray> elements = nullptr);
+
+  /// Applies the embedded operator `P^T A P` without assembling `A` or `P`.
+  ///
+  /// `P` is applied element by element from the stored element embeddings.
+  /// If the bilinear form of `A` consists of volume integrators only and
+  /// the elements do not share dofs, `A` is applied element by element as
+  /// well, fused with the embedding:
+  /// `y_T += P_T^T A_T P_T x_T`, where `A_T` is applied on the fly by the
+  /// integrators. Otherwise (e.g. for skeleton terms of DG methods), `A` is
+  /// applied by the bilinear form between the element-wise applications of
+  /// `P` and `P^T`, which is matrix-free if the form is not assembled.
+  ///
+  /// The multi-vector product applies the element embeddings to all vectors
+  /// at once with dense matrix-matrix products. On the element-wise path
+  /// with several vectors, it forms `P_T^T A_T P_T` once per element and
+  /// applies it to all vectors by one matrix-matrix product.
+  ///
+  /// @tparam SCAL scalar type of the embedding
+  template <typename SCAL> class EmbTrefftzOperator : public BaseMatrix
+  {
+    /// a snapshot of the embedding, independent of later changes of the
+    /// space
+    shared_ptr<const ElmatArena<SCAL>> ETmats;
+    shared_ptr<BilinearForm> bf;
+    /// per element, the dofs of the underlying space and of the Trefftz space
+    Table<DofId> dofs;
+    Table<DofId> trefftz_dofs;
+    size_t ndof_trefftz;
+    /// the integrators of `bf`, if it can be applied element by element
+    Array<shared_ptr<BilinearFormIntegrator>> element_integrators;
+    /// scratch of the applications, kept s.t. the iterations of a solver do
+    /// not allocate. Hence, one operator must not be applied by two threads
+    /// at once.
+    mutable unique_ptr<LocalHeap> heap;
+    mutable shared_ptr<VVector<SCAL>> work_u, work_au;
+    mutable unique_ptr<MultiVector> work_us, work_aus;
+
+  public:
+    /// @param ETmats the element embeddings
+    /// @param bf bilinear form on the underlying (non-Trefftz) space
+    /// @param dofs for every element the dofs of the underlying space,
+    ///   corresponding to the rows of the element embedding
+    /// @param trefftz_dofs for every element the Trefftz dofs,
+    ///   corresponding to the columns of the element embedding
+    /// @param ndof_trefftz total number of Trefftz dofs
+    EmbTrefftzOperator (shared_ptr<const ElmatArena<SCAL>> ETmats,
+                        shared_ptr<BilinearForm> bf, Table<DofId> dofs,
+                        Table<DofId> trefftz_dofs, size_t ndof_trefftz);
+
+    bool IsComplex () const override
+    {
+      return std::is_same_v<SCAL, Complex>;
+    }
+    int VHeight () const override { return ndof_trefftz; }
+    int VWidth () const override { return ndof_trefftz; }
+    AutoVector CreateRowVector () const override
+    {
+      return make_unique<VVector<SCAL>> (ndof_trefftz);
+    }
+    AutoVector CreateColVector () const override
+    {
+      return make_unique<VVector<SCAL>> (ndof_trefftz);
+    }
+
+    void Mult (const BaseVector &x, BaseVector &y) const override;
+    void MultAdd (double s, const BaseVector &x,
+                  BaseVector &y) const override;
+    void MultAdd (Complex s, const BaseVector &x,
+                  BaseVector &y) const override;
+    void Mult (const MultiVector &x, MultiVector &y) const override;
+
+  private:
+    template <typename TSCAL>
+    void multAdd (TSCAL s, const BaseVector &x, BaseVector &y) const;
+    /// @returns the local heap of the element loops, split among the threads
+    LocalHeap &getHeap () const;
+  };
+
+  /// The embedding `P` without conformity constraints. Up to the numbering
+  /// of the dofs, `P` is block diagonal with the element embeddings as
+  /// blocks, so it is stored as the dense blocks together with the dofs of
+  /// their rows and columns, and applied with dense matrix-vector products.
+  ///
+  /// @tparam SCAL scalar type of the embedding
+  template <typename SCAL> class EmbeddingBlockMatrix : public BaseMatrix
+  {
+    shared_ptr<const ElmatArena<SCAL>> blocks;
+    /// per element, the dofs of the underlying space and the Trefftz dofs
+    Table<int> row_dofs;
+    Table<int> col_dofs;
+    /// hidden dofs are embedded by the identity
+    Array<int> hidden_row_dofs;
+    Array<int> hidden_col_dofs;
+    size_t height;
+    size_t width;
+    size_t max_block_height = 0;
+    size_t max_block_width = 0;
+    /// the matrix represents `P^T`, see \ref CreateTranspose
+    bool transposed = false;
+
+  public:
+    /// @param row_dofs for every block the dofs of the underlying space,
+    ///   followed by one entry per hidden dof
+    /// @param col_dofs same for the Trefftz dofs
+    EmbeddingBlockMatrix (shared_ptr<const ElmatArena<SCAL>> blocks,
+                          Table<int> row_dofs, Table<int> col_dofs,
+                          size_t height, size_t width);
+
+    bool IsComplex () const override
+    {
+      return std::is_same_v<SCAL, Complex>;
+    }
+    int VHeight () const override { return transposed ? width : height; }
+    int VWidth () const override { return transposed ? height : width; }
+    AutoVector CreateRowVector () const override
+    {
+      return make_unique<VVector<SCAL>> (VWidth ());
+    }
+    AutoVector CreateColVector () const override
+    {
+      return make_unique<VVector<SCAL>> (VHeight ());
+    }
+
+    /// @returns `P^T` as a view of the same blocks, e.g. for `PT @ A @ P`
+    shared_ptr<BaseMatrix> CreateTranspose () const override;
+
+    void Mult (const BaseVector &x, BaseVector &y) const override;
+    void MultAdd (double s, const BaseVector &x,
+                  BaseVector &y) const override;
+    void MultAdd (Complex s, const BaseVector &x,
+                  BaseVector &y) const override;
+    void MultTrans (const BaseVector &x, BaseVector &y) const override;
+    void MultTransAdd (double s, const BaseVector &x,
+                       BaseVector &y) const override;
+    void MultTransAdd (Complex s, const BaseVector &x,
+                       BaseVector &y) const override;
+    void Mult (const MultiVector &x, MultiVector &y) const override;
+
+  private:
+    /// y += s * P^T x if TRANSPOSE, else y += s * P x
+    template <bool TRANSPOSE, typename TSCAL>
+    void multAdd (TSCAL s, const BaseVector &x, BaseVector &y) const;
+    /// y += s * op(P) x, with op(P) = P^T if `transpose != transposed`
+    template <typename TSCAL>
+    void applyAdd (bool transpose, TSCAL s, const BaseVector &x,
+                   BaseVector &y) const
+    {
+      if (transpose != transposed)
+        multAdd<true> (s, x, y);
+      else
+        multAdd<false> (s, x, y);
+    }
+  };
 
   /// Represents the FESpace, that is generated by the embedded Trefftz method.
   /// Use the \ref EmbTrefftzFESpace(shared_ptr<T>) constructor to build the
@@ -75,12 +594,44 @@ namespace ngcomp
       : public T //, public std::enable_shared_from_this<EmbTrefftzFESpace>
   {
     static_assert (std::is_base_of_v<FESpace, T>, "T must be a FESpace");
-    vector<optional<ElmatWithTrefftzInfo<double>>> ETmats;
-    vector<optional<ElmatWithTrefftzInfo<Complex>>> ETmatsC;
+    /// the embedding, shared with the matrices returned by GetEmbedding and
+    /// GetOperator. SetOp replaces it, UpdateOp copies it before patching
+    /// it while they refer to it, see \ref unshare.
+    shared_ptr<ElmatArena<double>> ETmats = make_shared<ElmatArena<double>> ();
+    shared_ptr<ElmatArena<Complex>> ETmatsC
+        = make_shared<ElmatArena<Complex>> ();
+    /// the embedding of a real space in single precision, see
+    /// \ref SetSinglePrecision
+    ElmatArena<float> ETmatsF;
+    /// requested at the next SetOp, and in use since the last one
+    bool single_precision = false;
+    bool stores_single_precision = false;
     shared_ptr<T> fes;
-    shared_ptr<FESpace> fes_conformity;
+    shared_ptr<const FESpace> fes_conformity;
     Array<DofId> all2comp;
 
+    /// arguments of the last call to SetOp, used by \ref UpdateOp
+    struct
+    {
+      std::optional<SumOfIntegrals> op, cop_lhs, cop_rhs;
+      shared_ptr<const SumOfIntegrals> linear_form;
+      shared_ptr<const FESpace> fes_test;
+      std::variant<size_t, double> ndof_trefftz = size_t (0);
+      bool dedup = false;
+    } setop_args;
+    shared_ptr<BaseVector> particular_solution;
+
+    /// recompute mode, see \ref SetRecompute
+    bool recompute = false;
+    size_t recompute_cache_size = 0;
+    /// in recompute mode: the number of columns of the embedding of every
+    /// element, the local systems and the caches of each thread
+    Array<size_t> element_widths;
+    shared_ptr<const LocalTrefftzEmbedding<double>> local_embedding;
+    shared_ptr<const LocalTrefftzEmbedding<Complex>> local_embeddingC;
+    mutable Array<ElmatLRUCache<double>> lru_caches;
+    mutable Array<ElmatLRUCache<Complex>> lru_cachesC;
+
   public:
     EmbTrefftzFESpace (shared_ptr<MeshAccess> ama, const Flags &flags,
                        bool parseflags = false)
@@ -109,7 +660,28 @@ namespace ngcomp
 
     shared_ptr<BaseVector>
     SetOp (shared_ptr<SumOfIntegrals> bf, shared_ptr<SumOfIntegrals> lf,
-           double eps, shared_ptr<FESpace> test_fes, int tndof);
+           double eps, shared_ptr<FESpace> test_fes, int tndof,
+           bool dedup = false, const std::string &cache_dir = "");
+
+    /// sets up the space like SetOp and assembles the volume terms of `bf`
+    /// on the Trefftz space in the same element loop. For every element,
+    /// the local Trefftz system, the embedding `P` and the element matrix
+    /// `A` of `bf` are computed on the same local heap, and only the
+    /// projected block `P^T A P` is kept. This replaces the separate
+    /// assembly of `bf` on the Trefftz space and its transformations.
+    /// Terms of `bf` on the skeleton or the boundary couple elements, they
+    /// have to be assembled on the Trefftz space and added to the result.
+    ///
+    /// @returns the matrix `P^T A P` on the Trefftz dofs and the particular
+    /// solution
+    ///
+    /// @throws std::invalid_argument if `bf` has terms other than volume
+    /// terms, if the space has hidden dofs, or in recompute mode
+    pair<shared_ptr<BaseMatrix>, shared_ptr<BaseVector>>
+    SetOpAssemble (shared_ptr<SumOfIntegrals> op,
+                   shared_ptr<SumOfIntegrals> bf,
+                   shared_ptr<SumOfIntegrals> lf, double eps,
+                   shared_ptr<FESpace> test_fes, int tndof);
 
     /// sets up the space for the conforming Trefftz method.
     ///
@@ -133,6 +705,9 @@ namespace ngcomp
     ///      in the Trefftz finite element space on `fes`, generated by `op`
     ///      (i.e. the local dimension of the kernel of `op` on one element)
     ///
+    ///  @param cache_dir directory of the embedding cache, see \ref
+    ///  EmbTrefftz. Empty string disables the cache.
+    ///
     /// @returns the particular solution of the Trefftz setup.
     ///
     /// @throws std::invalid_argument if `op`, `cop_lhs`, or `cop_rhs` are
@@ -143,10 +718,53 @@ namespace ngcomp
            shared_ptr<const SumOfIntegrals> cop_rhs,
            shared_ptr<const FESpace> fes_conformity,
            shared_ptr<const FESpace> fes_test,
-           shared_ptr<const SumOfIntegrals> linear_form, size_t ndof_trefftz);
+           shared_ptr<const SumOfIntegrals> linear_form, size_t ndof_trefftz,
+           const std::string &cache_dir = "");
+
+    /// switches the recompute mode on or off, takes effect at the next call
+    /// to SetOp. In recompute mode, the embeddings of the elements are not
+    /// stored. Whenever an element embedding is needed, e.g. in the
+    /// transformations of element matrices and vectors, it is recomputed
+    /// from the operators of SetOp. This saves the memory of all element
+    /// matrices for the flops of the local SVDs. The `cache_dir` of SetOp is
+    /// ignored and \ref GetOperator is not available in recompute mode.
+    ///
+    /// @param cache_size number of recently used element embeddings kept by
+    /// each thread
+    void SetRecompute (const bool recompute, const size_t cache_size = 0);
+
+    /// switches the storage of the embedding to single precision, takes
+    /// effect at the next call to SetOp. The embedding is computed in double
+    /// precision, stored in float and widened to double in the
+    /// transformations. This halves the memory of the embedding and the
+    /// memory traffic of the transformations, at the cost of a relative
+    /// error of about 1e-7 in the embedding. Only real spaces are stored in
+    /// single precision, and \ref GetOperator is not available in this
+    /// mode. The recompute mode takes precedence.
+    void SetSinglePrecision (const bool single_precision);
+
+    /// recomputes the embedding on the elements set in `elements`, e.g.
+    /// after a coefficient of the operator changed on them. The operators
+    /// of the last call to SetOp are evaluated again. The dofs are only
+    /// renumbered, if the number of Trefftz dofs of an element changed.
+    ///
+    /// @returns the particular solution of the Trefftz setup, the vector
+    /// returned by SetOp is updated in place.
+    ///
+    /// @throws Exception if SetOp was not called before.
+    shared_ptr<BaseVector> UpdateOp (shared_ptr<const BitArray> elements);
 
     void GetDofNrs (ElementId ei, Array<int> &dnums) const override;
 
+    /// blocks of Trefftz dofs for block smoothers and block Jacobi
+    /// preconditioners, e.g. `Preconditioner (a, "local", block=True)`.
+    /// The flag `blocktype` chooses between one block per element
+    /// ("element", the default) and one block per facet, with the dofs of
+    /// the elements sharing the facet ("facetpatch").
+    /// @throws Exception for any other blocktype
+    shared_ptr<Table<int>>
+    CreateSmoothingBlocks (const Flags &flags) const override;
+
     virtual void VTransformMR (ElementId ei, const SliceMatrix<double> mat,
                                TRANSFORM_TYPE type) const override;
 
@@ -161,11 +779,98 @@ namespace ngcomp
 
     shared_ptr<GridFunction> Embed (shared_ptr<GridFunction> tgfu);
 
-    shared_ptr<BaseMatrix> GetEmbedding ();
+    /// embeds all vectors of `tvecs` from the Trefftz space into the
+    /// underlying space. Each element embedding is applied to the element
+    /// vectors of all of them by one matrix-matrix product.
+    shared_ptr<MultiVector> EmbedMulti (const MultiVector &tvecs) const;
+
+    /// @returns the embedding `P`. Without conformity constraints this is
+    /// an \ref EmbeddingBlockMatrix, unless `sparse` is set. On a
+    /// distributed mesh, it is wrapped in a ParallelMatrix, which maps
+    /// cumulated Trefftz vectors to distributed vectors on `fes`.
+    ///
+    /// @param sparse return the embedding as a SparseMatrix, e.g. to build
+    /// `P^T A P` as a sparse matrix
+    shared_ptr<BaseMatrix> GetEmbedding (bool sparse = false);
+
+    /// @returns the embedded operator `P^T A P` as a matrix-free operator
+    /// on the Trefftz space, see \ref EmbTrefftzOperator. It shares the
+    /// current embedding and keeps a copy of the dof numbering, later calls
+    /// to SetOp or UpdateOp do not change it.
+    ///
+    /// @param bf bilinear form on the underlying space, preferably not
+    /// assembled
+    shared_ptr<BaseMatrix> GetOperator (shared_ptr<BilinearForm> bf);
 
   private:
     /// adjusts the dofs of the space. Will be called by SetOp.
     void adjustDofsAfterSetOp ();
+
+    /// @returns the embedding of element `ei`, which is recomputed in
+    /// recompute mode. The matrix may live on `lh` or in a cache of the
+    /// calling thread, so it is only valid until the next call.
+    template <typename SCAL>
+    FlatMatrix<SCAL> getElmat (ElementId ei, LocalHeap &lh) const;
+
+    /// sets `vecs[j] = P tvecs[j]` element by element, with the element
+    /// vectors of all `tvecs` gathered into one matrix
+    template <typename SCAL>
+    void embedVectors (FlatArray<shared_ptr<BaseVector>> tvecs,
+                       FlatArray<shared_ptr<BaseVector>> vecs) const;
+
+    /// @returns the number of columns of the embedding of element `elnr`
+    size_t getElementWidth (size_t elnr) const;
+
+    /// in recompute mode: computes the number of Trefftz dofs and the
+    /// particular solution on the given elements, or all elements if
+    /// `elements` is null. The embeddings are dropped.
+    template <typename SCAL>
+    void setupRecompute (shared_ptr<const BitArray> elements);
+
+    /// @returns the embedding of all elements as a matrix, the block matrix
+    /// shares `ETm`
+    template <typename SCAL>
+    shared_ptr<BaseMatrix>
+    getEmbedding (shared_ptr<const ElmatArena<SCAL>> ETm, bool sparse) const;
+
+    /// computes the embedding with the arguments of the last call to SetOp
+    /// on the given elements, or on all elements if `elements` is null.
+    template <typename SCAL>
+    pair<ElmatArena<SCAL>, shared_ptr<BaseVector>>
+    computeEmbedding (shared_ptr<const BitArray> elements,
+                      const std::string &cache_dir = "") const;
+
+    /// patches the embedding `ETm` and the particular solution on the
+    /// elements `elements`.
+    /// @returns true, if the number of Trefftz dofs of an element changed
+    /// @tparam STORE_SCAL scalar type, in which the embedding is stored
+    template <typename SCAL, typename STORE_SCAL>
+    bool updateEmbedding (ElmatArena<STORE_SCAL> &ETm,
+                          shared_ptr<const BitArray> elements);
+
+    /// the fused element loop of \ref SetOpAssemble
+    /// @returns the projected element matrices `P^T A P`
+    template <typename SCAL>
+    ElmatArena<SCAL> embedAndProject (const SumOfIntegrals &bf);
+
+    /// stores the embedding and the particular solution computed by
+    /// \ref computeEmbedding
+    template <typename SCAL>
+    void
+    storeEmbedding (pair<ElmatArena<SCAL>, shared_ptr<BaseVector>> result);
+
+    /// @returns `*arena` to be modified in place. If a matrix returned by
+    /// GetEmbedding or GetOperator still shares it, it is copied first.
+    template <typename SCAL>
+    static ElmatArena<SCAL> &unshare (shared_ptr<ElmatArena<SCAL>> &arena)
+    {
+      if (arena.use_count () > 1)
+        arena = make_shared<ElmatArena<SCAL>> (*arena);
+      return *arena;
+    }
+
+    /// moves the real embedding to single precision storage, if requested
+    void storeSinglePrecision ();
   };
 }
 
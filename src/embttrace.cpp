@@ -0,0 +1,71 @@
+#include "embttrace.hpp"
+
+namespace ngcomp
+{
+  constexpr char EMBT_TRACE_MAGIC[8] = "EMBTTRC";
+  constexpr uint32_t EMBT_TRACE_VERSION = 1;
+
+  EmbTrefftzTrace &EmbTrefftzTrace::Get ()
+  {
+    static EmbTrefftzTrace trace;
+    return trace;
+  }
+
+  void EmbTrefftzTrace::Open (const std::string &filename,
+                              const uint32_t level)
+  {
+    Close ();
+    if (level == EMBT_TRACE_OFF)
+      return;
+
+    file.open (filename, std::ios::binary | std::ios::trunc);
+    if (!file)
+      throw Exception ("cannot open trace file " + filename);
+    EmbTrefftzTraceHeader header{};
+    memcpy (header.magic, EMBT_TRACE_MAGIC, sizeof (header.magic));
+    header.version = EMBT_TRACE_VERSION;
+    header.level = level;
+    file.write (reinterpret_cast<const char *> (&header), sizeof (header));
+
+    closing = false;
+    writer = std::thread ([this] () { writeRecords (); });
+    this->level.store (level);
+  }
+
+  void EmbTrefftzTrace::Close ()
+  {
+    if (!writer.joinable ())
+      return;
+    level.store (EMBT_TRACE_OFF);
+    {
+      const lock_guard<mutex> lock (queue_mutex);
+      closing = true;
+    }
+    queue_changed.notify_one ();
+    writer.join ();
+    file.close ();
+    // records of elements, that checked the level before it was switched off
+    queue.clear ();
+  }
+
+  void EmbTrefftzTrace::writeRecords ()
+  {
+    std::unique_lock<mutex> lock (queue_mutex);
+    while (true)
+      {
+        queue_changed.wait (lock, [this] () {
+          return closing || !queue.empty ();
+        });
+        if (queue.empty ())
+          return;
+        // write outside of the lock, s.t. the element loop is not blocked
+        // by the file
+        std::deque<Array<char>> records;
+        records.swap (queue);
+        lock.unlock ();
+        for (const auto &record : records)
+          file.write (record.Data (), record.Size ());
+        lock.lock ();
+      }
+  }
+}
@@ -0,0 +1,117 @@
+#ifndef FILE_EMBTTRACE_HPP
+#define FILE_EMBTTRACE_HPP
+#include <comp.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <thread>
+
+namespace ngcomp
+{
+  /// Trace file layout (native byte order):
+  ///
+  ///   EmbTrefftzTraceHeader
+  ///   records, each an EmbTrefftzTraceRecord followed by the embedding
+  ///   `P` (row major, `height * width` scalars of `scalar_size` bytes), if
+  ///   the trace level is at least `EMBT_TRACE_EMBEDDING`
+  struct EmbTrefftzTraceHeader
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t level;
+  };
+
+  /// the local dimensions of one embedded element
+  struct EmbTrefftzTraceRecord
+  {
+    uint64_t elnr;
+    uint32_t ndof;
+    uint32_t ndof_test;
+    uint32_t ndof_conforming;
+    uint32_t ndof_trefftz;
+    uint32_t height;
+    uint32_t width;
+    /// bytes per scalar of the embedding, 0 if it is not traced
+    uint32_t scalar_size;
+    uint32_t padding = 0;
+  };
+
+  /// trace levels, each one includes the lower ones
+  enum EmbTrefftzTraceLevel : uint32_t
+  {
+    EMBT_TRACE_OFF = 0,
+    /// the local dimensions of every element
+    EMBT_TRACE_DIMENSIONS = 1,
+    /// additionally the embedding of every element
+    EMBT_TRACE_EMBEDDING = 2
+  };
+
+  /// Writes per-element trace records of EmbTrefftz to a binary file.
+  /// The element loop only copies the raw record into a queue, a separate
+  /// writer thread writes them to the file. While the trace is off, the
+  /// only cost in the element loop is the check of \ref Level.
+  class EmbTrefftzTrace
+  {
+    std::atomic<uint32_t> level = EMBT_TRACE_OFF;
+    std::ofstream file;
+    std::thread writer;
+    std::mutex queue_mutex;
+    std::condition_variable queue_changed;
+    std::deque<Array<char>> queue;
+    bool closing = false;
+
+    EmbTrefftzTrace () = default;
+    void writeRecords ();
+
+  public:
+    ~EmbTrefftzTrace () { Close (); }
+
+    static EmbTrefftzTrace &Get ();
+
+    uint32_t Level () const { return level.load (std::memory_order_relaxed); }
+
+    /// starts tracing to `filename` at `level`, a running trace is closed
+    /// first
+    /// @throws Exception if the file cannot be opened
+    void Open (const std::string &filename, const uint32_t level);
+
+    /// writes the queued records and closes the file
+    void Close ();
+
+    /// queues the record of an element, together with its embedding, if
+    /// the level asks for it
+    template <typename SCAL>
+    void Add (const ElementId element_id, const size_t ndof_test,
+              const size_t ndof_conforming, const size_t ndof_trefftz,
+              FlatMatrix<SCAL> elmat_p)
+    {
+      EmbTrefftzTraceRecord record{};
+      record.elnr = element_id.Nr ();
+      record.ndof = elmat_p.Height ();
+      record.ndof_test = ndof_test;
+      record.ndof_conforming = ndof_conforming;
+      record.ndof_trefftz = ndof_trefftz;
+      record.height = elmat_p.Height ();
+      record.width = elmat_p.Width ();
+      const bool with_embedding = Level () >= EMBT_TRACE_EMBEDDING;
+      record.scalar_size = (with_embedding) ? sizeof (SCAL) : 0;
+
+      const size_t data_size
+          = (with_embedding) ? elmat_p.Height () * elmat_p.Width () : 0;
+      Array<char> bytes (sizeof (record) + data_size * sizeof (SCAL));
+      memcpy (bytes.Data (), &record, sizeof (record));
+      if (data_size)
+        memcpy (bytes.Data () + sizeof (record), elmat_p.Data (),
+                data_size * sizeof (SCAL));
+      {
+        const lock_guard<mutex> lock (queue_mutex);
+        queue.push_back (std::move (bytes));
+      }
+      queue_changed.notify_one ();
+    }
+  };
+}
+
+#endif
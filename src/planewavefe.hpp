@@ -20,8 +20,7 @@ namespace ngfem
     PlaneWaveElement (int andof, int aord, ELEMENT_TYPE aeltype,
                       Vec<D> ashift = 0, double aelsize = 1, double ac = 1.0,
                       int aconj = 1)
-        : ScalarMappedElement<D> (andof, aord, Matrix<> (), aeltype, ashift,
-                                  1.0),
+        : ScalarMappedElement<D> (andof, aord, CSR (), aeltype, ashift, 1.0),
           elsize (aelsize), c (ac), conj (aconj)
     {
       ;
@@ -29,6 +28,7 @@ namespace ngfem
 
     using ScalarMappedElement<D>::CalcMappedDShape;
     using ScalarMappedElement<D>::Evaluate;
+    using ScalarMappedElement<D>::AddTrans;
     using ScalarMappedElement<D>::EvaluateGrad;
     using ScalarMappedElement<D>::AddGradTrans;
 
@@ -74,6 +74,32 @@ namespace ngfem
     {
       throw ExceptionNOSIMD ("SIMD - CalcShape not overloaded");
     }
+    // the SIMD evaluations of the base multiply its basis matrix, which is
+    // empty for plane waves
+    void Evaluate (const SIMD_BaseMappedIntegrationRule &mir,
+                   BareSliceVector<> coefs,
+                   BareVector<SIMD<double>> values) const override
+    {
+      throw ExceptionNOSIMD ("SIMD - Evaluate not overloaded");
+    }
+    void AddTrans (const SIMD_BaseMappedIntegrationRule &mir,
+                   BareVector<SIMD<double>> values,
+                   BareSliceVector<> coefs) const override
+    {
+      throw ExceptionNOSIMD ("SIMD - AddTrans not overloaded");
+    }
+    void EvaluateGrad (const SIMD_BaseMappedIntegrationRule &ir,
+                       BareSliceVector<> coefs,
+                       BareSliceMatrix<SIMD<double>> values) const override
+    {
+      throw ExceptionNOSIMD ("SIMD - EvaluateGrad not overloaded");
+    }
+    void AddGradTrans (const SIMD_BaseMappedIntegrationRule &mir,
+                       BareSliceMatrix<SIMD<double>> values,
+                       BareSliceVector<> coefs) const override
+    {
+      throw ExceptionNOSIMD ("SIMD - AddGradTrans not overloaded");
+    }
 
     NGST_DLL virtual void
     Evaluate (const BaseMappedIntegrationRule &mir,
@@ -73,7 +73,22 @@ namespace ngfem
   void PUFElement<1>::CalcShape (const SIMD_BaseMappedIntegrationRule &smir,
                                  BareSliceMatrix<SIMD<double>> shape) const
   {
-    throw ExceptionNOSIMD ("nosimd");
+    const int nlbasis = localmat.Height ();
+    STACK_ARRAY (SIMD<double>, pol, order + 1);
+    for (size_t imip = 0; imip < smir.Size (); imip++)
+      {
+        const SIMD<double> x = smir[imip].IP () (0);
+        const SIMD<double> lam[2] = { x, 1.0 - x };
+        for (int v = 0; v < 2; v++)
+          {
+            SIMD<double> cpoint = smir[imip].GetPoint () (0);
+            cpoint = (cpoint - elvertices[v][0]) * (1.0 / elsizes[v]);
+            Monomial (order, cpoint, &pol[0]);
+            for (int i = 0; i < nlbasis; ++i)
+              shape (nlbasis * v + i, imip)
+                  = lam[v] * localmat.RowTimes (i, &pol[0], order + 1);
+          }
+      }
   }
 
   template <>
@@ -94,7 +109,33 @@ namespace ngfem
   void PUFElement<1>::CalcDShape (const SIMD_BaseMappedIntegrationRule &smir,
                                   BareSliceMatrix<SIMD<double>> dshape) const
   {
-    throw ExceptionNOSIMD ("nosimd");
+    const int nlbasis = localmat.Height ();
+    const double dlam[2] = { 1, -1 };
+    STACK_ARRAY (SIMD<double>, pol, order + 1);
+    STACK_ARRAY (SIMD<double>, dpol, order + 1);
+    for (size_t imip = 0; imip < smir.Size (); imip++)
+      {
+        auto &mip
+            = static_cast<const SIMD<MappedIntegrationPoint<1, 1>> &> (
+                smir[imip]);
+        const SIMD<double> jacinv = mip.GetJacobianInverse () (0, 0);
+        const SIMD<double> x = mip.IP () (0);
+        const SIMD<double> lam[2] = { x, 1.0 - x };
+        for (int v = 0; v < 2; v++)
+          {
+            SIMD<double> cpoint = mip.GetPoint () (0);
+            cpoint = (cpoint - elvertices[v][0]) * (1.0 / elsizes[v]);
+            Monomial (order, cpoint, &pol[0]);
+            dpol[0] = 0.0;
+            for (int e = 1; e <= order; e++)
+              dpol[e] = (e / elsizes[v]) * pol[e - 1];
+            for (int i = 0; i < nlbasis; ++i)
+              dshape (nlbasis * v + i, imip)
+                  = lam[v] * localmat.RowTimes (i, &dpol[0], order + 1)
+                    + dlam[v] * jacinv
+                          * localmat.RowTimes (i, &pol[0], order + 1);
+          }
+      }
   }
 
   template <>
@@ -131,14 +172,11 @@ namespace ngfem
         FlatVector<double> polxt (order + 1, &mem[0]);
         Monomial (order, cpoint[0], &mem[0]);
         // TB*monomials for trefftz shape fcts
-        int nlbasis = localmat[0].Size () - 1;
+        int nlbasis = localmat.Height ();
 
         for (int i = 0; i < nlbasis; ++i)
           {
-            shape (nlbasis * v + i) = 0.0;
-            for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-              shape (nlbasis * v + i)
-                  += (localmat)[2][j] * polxt[(localmat)[1][j]];
+            shape (nlbasis * v + i) = localmat.RowTimes (i, polxt);
             shape (nlbasis * v + i) *= lam[v];
           }
       }
@@ -171,7 +209,7 @@ namespace ngfem
           for (int j = 0; j <= order - i; j++)
             pol[ii++] = polxt[0][i] * polxt[1][j];
         // TB*monomials for trefftz shape fcts
-        int nlbasis = localmat[0].Size () - 1;
+        int nlbasis = localmat.Height ();
 
         // cout << "npoly: " << npoly << endl;
         // cout << "nlbasis: " << nlbasis << endl;
@@ -180,15 +218,12 @@ namespace ngfem
         //  cout << "ndof: " << this->ndof << endl;
         //  cout << nlbasis * 3 << endl;
         //  cout << "npoly: " << npoly << endl;
-        //  cout << "localmat[0].Size(): " << localmat[0].Size() << endl;
+        //  cout << "localmat.Height(): " << localmat.Height() << endl;
         //  cout << "elvertex: " << v << " : " << elvertices[v] << endl;
         //
         for (int i = 0; i < nlbasis; ++i)
           {
-            shape (nlbasis * v + i) = 0.0;
-            for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-              shape (nlbasis * v + i)
-                  += (localmat)[2][j] * pol[(localmat)[1][j]];
+            shape (nlbasis * v + i) = localmat.RowTimes (i, pol);
             shape (nlbasis * v + i) *= lam[v];
           }
       }
@@ -227,26 +262,23 @@ namespace ngfem
         FlatVector<double> polxt (order + 2, &mem[0]);
         Monomial (order, cpoint[0], &mem[1]);
 
-        int nlbasis = localmat[0].Size () - 1;
+        int nlbasis = localmat.Height ();
 
         Vector<double> shape (2 * nlbasis);
         // TB*monomials for trefftz shape fcts
         for (int i = 0; i < nlbasis; ++i)
           {
-            shape (nlbasis * v + i) = 0.0;
-            for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-              shape (nlbasis * v + i)
-                  += (localmat)[2][j] * polxt[(localmat)[1][j] + 1];
+            shape (nlbasis * v + i) = localmat.RowTimes (i, &mem[1]);
             // shape (nlbasis * v + i) *= lam[v];
           }
 
         for (int i = 0; i < nlbasis; ++i)
           {
             dshape (nlbasis * v + i, 0) = 0.0;
-            for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
+            localmat.IterateRow (i, [&] (int col, double val) {
               dshape (nlbasis * v + i, 0)
-                  += (localmat)[2][j] * polxt[(localmat)[1][j]]
-                     * (localmat)[1][j] * (1.0 / elsizes[v]);
+                  += val * polxt[col] * col * (1.0 / elsizes[v]);
+            });
             dshape (nlbasis * v + i, 0) *= lam[v];
 
             dshape (nlbasis * v + i, 0)
@@ -288,7 +320,7 @@ namespace ngfem
             Monomial (order, cpoint[d], polxt[d]);
           }
 
-        int nlbasis = localmat[0].Size () - 1;
+        int nlbasis = localmat.Height ();
 
         Vector<double> pol1 (npoly);
         Vector<double> shape (3 * nlbasis);
@@ -298,10 +330,7 @@ namespace ngfem
         // TB*monomials for trefftz shape fcts
         for (int i = 0; i < nlbasis; ++i)
           {
-            shape (nlbasis * v + i) = 0.0;
-            for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-              shape (nlbasis * v + i)
-                  += (localmat)[2][j] * pol1[(localmat)[1][j]];
+            shape (nlbasis * v + i) = localmat.RowTimes (i, pol1);
             // shape (nlbasis * v + i) *= lam[v];
           }
 
@@ -315,11 +344,8 @@ namespace ngfem
 
             for (int i = 0; i < nlbasis; ++i)
               {
-                dshape (nlbasis * v + i, d) = 0.0;
-                for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-                  dshape (nlbasis * v + i, d) += (localmat)[2][j]
-                                                 * pol[(localmat)[1][j]]
-                                                 * (1.0 / elsizes[v]);
+                dshape (nlbasis * v + i, d)
+                    = localmat.RowTimes (i, pol) * (1.0 / elsizes[v]);
                 dshape (nlbasis * v + i, d) *= lam[v];
 
                 dshape (nlbasis * v + i, d)
@@ -148,30 +148,284 @@ namespace ngfem
 
   //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-  void MatToCSR (Matrix<> mat, CSR &sparsemat)
+  CSR::CSR (SliceMatrix<> mat) : height (mat.Height ()), width (mat.Width ())
   {
-    int spsize = 0;
-    sparsemat[0].SetSize (0);
-    sparsemat[1].SetSize (0);
-    sparsemat[2].SetSize (0);
-    for (size_t i = 0; i < mat.Height (); i++)
+    for (size_t i = 0; i < height; i++)
+      for (size_t j = 0; j < width; j++)
+        if (mat (i, j) != 0.0)
+          nze++;
+    dense = nze > dense_fill * height * width;
+    if (dense)
+      nze = height * width;
+
+    // the row pointers always have size height + 1, also for empty rows,
+    // s.t. every row can be multiplied
+    const size_t nrowptr = (dense) ? 0 : height + 1;
+    const size_t ncolind = (dense) ? 0 : nze;
+    data = shared_ptr<char[]> (
+        new char[nze * sizeof (double) + (nrowptr + ncolind) * sizeof (int)]);
+    double *vals = reinterpret_cast<double *> (data.get ());
+    int *rows = reinterpret_cast<int *> (vals + nze);
+    int *cols = rows + nrowptr;
+
+    if (dense)
+      for (size_t i = 0; i < height; i++)
+        for (size_t j = 0; j < width; j++)
+          vals[i * width + j] = mat (i, j);
+    else
       {
-        // guarantee sparsemat[0].Size() to be nbasis + 1,
-        // could be shorter but easier for mat*vec
-        sparsemat[0].Append (spsize);
-        for (size_t j = 0; j < mat.Width (); j++)
+        int spsize = 0;
+        for (size_t i = 0; i < height; i++)
           {
-            if (mat (i, j))
+            rows[i] = spsize;
+            for (size_t j = 0; j < width; j++)
+              if (mat (i, j) != 0.0)
+                {
+                  cols[spsize] = j;
+                  vals[spsize++] = mat (i, j);
+                }
+          }
+        rows[height] = spsize;
+      }
+    values = vals;
+    rowptr = rows;
+    colind = cols;
+  }
+
+  void MatToCSR (SliceMatrix<> mat, CSR &sparsemat)
+  {
+    sparsemat = CSR (mat);
+  }
+
+  void CSR::Mult (SliceMatrix<> x, SliceMatrix<> y) const
+  {
+    if (dense)
+      {
+        y = FlatMatrix<> (height, width, const_cast<double *> (values)) * x;
+        return;
+      }
+    for (size_t i = 0; i < height; i++)
+      {
+        y.Row (i) = 0.0;
+        for (int j = rowptr[i]; j < rowptr[i + 1]; j++)
+          y.Row (i) += values[j] * x.Row (colind[j]);
+      }
+  }
+
+  void CSR::MultTrans (SliceVector<> x, SliceVector<> y) const
+  {
+    if (dense)
+      {
+        y = Trans (FlatMatrix<> (height, width, const_cast<double *> (values)))
+            * x;
+        return;
+      }
+    y = 0.0;
+    for (size_t i = 0; i < height; i++)
+      for (int j = rowptr[i]; j < rowptr[i + 1]; j++)
+        y (colind[j]) += values[j] * x (i);
+  }
+
+  void CSR::MultAdd (SliceVector<> x, SliceVector<> y) const
+  {
+    if (dense)
+      {
+        y += FlatMatrix<> (height, width, const_cast<double *> (values)) * x;
+        return;
+      }
+    for (size_t i = 0; i < height; i++)
+      for (int j = rowptr[i]; j < rowptr[i + 1]; j++)
+        y (i) += values[j] * x (colind[j]);
+  }
+
+  /// exponents of the monomials of degree <= order in D variables, in the
+  /// ordering of the basis matrices (the last variable runs fastest), the
+  /// exponents of monomial ii are exps[ii * D + d]
+  template <int D> constexpr void MonomialExponents (int order, int *exps)
+  {
+    int e[D]{};
+    int sum = 0;
+    const int npoly = BinCoeff (D + order, order);
+    for (int ii = 0; ii < npoly; ii++)
+      {
+        for (int d = 0; d < D; d++)
+          exps[ii * D + d] = e[d];
+        for (int p = D - 1; p >= 0; p--)
+          {
+            if (sum < order)
               {
-                spsize++;
-                sparsemat[1].Append (j);
-                sparsemat[2].Append (mat (i, j));
+                e[p]++;
+                sum++;
+                break;
               }
+            sum -= e[p];
+            e[p] = 0;
           }
       }
-    sparsemat[0].Append (spsize);
+  }
+
+  template <int D, int ORDER> struct MonomialTable
+  {
+    static constexpr int npoly = BinCoeff (D + ORDER, ORDER);
+    int exps[npoly * D] = {};
+    constexpr MonomialTable () { MonomialExponents<D> (ORDER, exps); }
   };
 
+  template <int D, int ORDER>
+  constexpr MonomialTable<D, ORDER> monomial_table{};
+
+  /// orders with a compile-time specialized shape kernel
+  constexpr int MAX_STATIC_ORDER = 10;
+
+  /// Calls func (order, npoly, exps) with the exponent table of `order`.
+  /// Up to MAX_STATIC_ORDER, order and npoly are passed as IC<> and the
+  /// table is constexpr, s.t. the kernels have constant bounds, higher
+  /// orders generate the table on the heap, as it outgrows small thread
+  /// stacks in 4D.
+  template <int D, typename FUNC>
+  INLINE void SwitchMonomialOrder (int order, FUNC &&func)
+  {
+    if (order <= MAX_STATIC_ORDER)
+      Switch<MAX_STATIC_ORDER + 1> (order, [&] (auto ORDER) {
+        constexpr int ord = decltype (ORDER)::value;
+        func (ORDER, IC<MonomialTable<D, ord>::npoly> (),
+              monomial_table<D, ord>.exps);
+      });
+    else
+      {
+        const int npoly = BinCoeff (D + order, order);
+        Array<int> exps (npoly * D);
+        MonomialExponents<D> (order, exps.Data ());
+        func (order, npoly, exps.Data ());
+      }
+  }
+
+  /// the 1D monomials x_d^e, e <= order, and their first and second
+  /// derivatives, at pol1d[(k * D + d) * (order + 1) + e] for the k-th
+  /// derivative
+  template <int D, typename T, typename TORD>
+  INLINE void CalcMonomials1D (TORD order, const Vec<D, T> &x, T *pol1d)
+  {
+    for (int d = 0; d < D; d++)
+      {
+        T *val = pol1d + d * (order + 1);
+        T *deriv = pol1d + (D + d) * (order + 1);
+        T *deriv2 = pol1d + (2 * D + d) * (order + 1);
+        val[0] = 1.0;
+        deriv[0] = 0.0;
+        deriv2[0] = 0.0;
+        for (int e = 1; e <= order; e++)
+          {
+            val[e] = val[e - 1] * x[d];
+            deriv[e] = double (e) * val[e - 1];
+            deriv2[e] = double (e) * deriv[e - 1];
+          }
+      }
+  }
+
+  /// pol[ii * dist] = alpha * prod_d (d/dx_d)^{deriv[d]} x_d^{exps[ii * D
+  /// + d]}, with derivative orders up to 2
+  template <int D, typename T, typename TORD, typename TN>
+  INLINE void CalcMonomials (TORD order, TN npoly, const int *exps,
+                             const T *pol1d, Vec<D, int> deriv, T *pol,
+                             size_t dist = 1, double alpha = 1.0)
+  {
+    const T *factor[D];
+    for (int d = 0; d < D; d++)
+      factor[d] = pol1d + (deriv[d] * D + d) * (order + 1);
+    for (int ii = 0; ii < npoly; ii++)
+      {
+        T val = alpha * factor[0][exps[ii * D]];
+        for (int d = 1; d < D; d++)
+          val *= factor[d][exps[ii * D + d]];
+        pol[ii * dist] = val;
+      }
+  }
+
+  /// the unit multi-index in direction d
+  template <int D> INLINE Vec<D, int> UnitDeriv (int d)
+  {
+    Vec<D, int> deriv = 0;
+    deriv[d] = 1;
+    return deriv;
+  }
+
+  /// bytes of the monomial matrix of a block of points, s.t. it stays in
+  /// the L2 cache during the products with the basis matrix
+  constexpr size_t MONOMIAL_BLOCK_BYTES = 256 * 1024;
+
+  /// the doubles of a SIMD matrix, the lanes of an entry are consecutive
+  /// columns
+  INLINE SliceMatrix<> SIMDAsDouble (SliceMatrix<SIMD<double>> mat)
+  {
+    constexpr size_t nsimd = SIMD<double>::Size ();
+    return SliceMatrix<> (mat.Height (), nsimd * mat.Width (),
+                          nsimd * mat.Dist (),
+                          reinterpret_cast<double *> (mat.Data ()));
+  }
+
+  /// the doubles of the SIMD entries vec[points]
+  INLINE FlatVector<> SIMDAsDouble (IntRange points, SIMD<double> *vec)
+  {
+    return FlatVector<> (SIMD<double>::Size () * points.Size (),
+                         reinterpret_cast<double *> (vec + points.First ()));
+  }
+
+  /// @returns a buffer of at least `size` SIMD entries for the monomial
+  /// blocks, owned by the calling thread. The blocks are too large for the
+  /// stacks of the worker threads, and it is reused by the next call from
+  /// the same thread.
+  INLINE SIMD<double> *monomialScratch (const size_t size)
+  {
+    thread_local Array<SIMD<double>> scratch;
+    if (scratch.Size () < size)
+      scratch.SetSize (size);
+    return scratch.Data ();
+  }
+
+  /// Calls func (points, pol) for blocks of the points of smir, with the
+  /// monomial matrix pol(ii, imip - points.First ()) of the block. With
+  /// `grad`, pol holds the derivatives instead, direction d in the rows
+  /// [d * npoly, (d + 1) * npoly), multiplied by scale[d].
+  template <int D, typename FUNC>
+  void IterateMonomialBlocks (int order, Vec<D> shift, Vec<D> scale,
+                              const SIMD_BaseMappedIntegrationRule &smir,
+                              bool grad, FUNC &&func)
+  {
+    SwitchMonomialOrder<D> (order, [&] (auto ord, auto npoly,
+                                         const int *exps) {
+      const size_t rows = (grad ? D : 1) * size_t (npoly);
+      const size_t block = min (
+          smir.Size (),
+          max (size_t (1), MONOMIAL_BLOCK_BYTES
+                               / (rows * sizeof (SIMD<double>))));
+      STACK_ARRAY (SIMD<double>, pol1d, 3 * D * (ord + 1));
+      SIMD<double> *mem = monomialScratch (rows * block);
+      for (size_t first = 0; first < smir.Size (); first += block)
+        {
+          IntRange points (first, min (first + block, smir.Size ()));
+          FlatMatrix<SIMD<double>> pol (rows, points.Size (), mem);
+          for (size_t imip : points)
+            {
+              Vec<D, SIMD<double>> cpoint = smir[imip].GetPoint ();
+              cpoint -= shift;
+              vtimes (cpoint, scale);
+              CalcMonomials1D<D> (ord, cpoint, pol1d);
+              const size_t col = imip - points.First ();
+              if (!grad)
+                CalcMonomials<D> (ord, npoly, exps, pol1d, Vec<D, int> (0),
+                                  &pol (0, col), pol.Width ());
+              else
+                for (int d = 0; d < D; d++)
+                  CalcMonomials<D> (ord, npoly, exps, pol1d, UnitDeriv<D> (d),
+                                    &pol (d * npoly, col), pol.Width (),
+                                    scale[d]);
+            }
+          func (points, pol);
+        }
+    });
+  }
+
   template <int D> string ScalarMappedElement<D>::ClassName () const
   {
     return "ScalarMappedElement";
@@ -311,593 +565,186 @@ namespace ngfem
   //}
   //}
 
-  template <>
-  void ScalarMappedElement<1>::CalcMappedDDShape (
-      const BaseMappedIntegrationPoint &bmip, BareSliceMatrix<> hddshape) const
-  {
-    ;
-  }
-
-  template <>
-  void ScalarMappedElement<2>::CalcMappedDDShape (
-      const BaseMappedIntegrationPoint &bmip, BareSliceMatrix<> hddshape) const
-  {
-    auto ddshape = hddshape.AddSize (this->ndof, 2 * 2);
-
-    // auto & mip = static_cast<const MappedIntegrationPoint<2,2> &> (bmip);
-    Vec<2> cpoint = bmip.GetPoint ();
-    cpoint -= shift;
-    vtimes (cpoint, scale);
-
-    // +1 size to avoid undefined behavior taking deriv, getting [-1] entry
-    STACK_ARRAY (double, mem2, 2 * (order + 1) + 1);
-    mem2[0] = 0;
-    double *polxt[2];
-    for (int d = 0; d < 2; d++)
-      {
-        polxt[d] = &mem2[d * (order + 1) + 1];
-        Monomial (order, cpoint[d], polxt[d]);
-      }
-
-    for (int d1 = 0; d1 < 2; d1++)
-      {
-        for (int d2 = 0; d2 < 2; d2++)
-          {
-            Vector<double> pol (npoly);
-            for (int i = 0, ii = 0; i <= order; i++)
-              for (int j = 0; j <= order - i; j++)
-                pol[ii++] = (d1 != d2 ? i * j
-                                      : (d1 == 0 ? i * (i - 1) : j * (j - 1)))
-                            * polxt[0][i - (d1 == 0) - (d2 == 0)]
-                            * polxt[1][j - (d1 == 1) - (d2 == 1)];
-
-            for (int i = 0; i < this->ndof; ++i)
-              {
-                ddshape (i, d2 * 2 + d1) = 0.0;
-                for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-                  ddshape (i, d2 * 2 + d1) += (localmat)[2][j]
-                                              * pol[(localmat)[1][j]]
-                                              * scale[d1] * scale[d2];
-              }
-          }
-      }
-  }
-
-  template <>
-  void ScalarMappedElement<3>::CalcMappedDDShape (
+  template <int D>
+  void ScalarMappedElement<D>::CalcMappedDDShape (
       const BaseMappedIntegrationPoint &bmip, BareSliceMatrix<> hddshape) const
   {
-    auto ddshape = hddshape.AddSize (this->ndof, 3 * 3);
-    // auto & mip = static_cast<const MappedIntegrationPoint<2,2> &> (bmip);
-    Vec<3> cpoint = bmip.GetPoint ();
+    auto ddshape = hddshape.AddSize (this->ndof, D * D);
+    Vec<D> cpoint = bmip.GetPoint ();
     cpoint -= shift;
     vtimes (cpoint, scale);
 
-    // +1 size to avoid undefined behavior taking deriv, getting [-1] entry
-    STACK_ARRAY (double, mem2, 3 * (order + 1) + 1);
-    mem2[0] = 0;
-    double *polxt[3];
-    for (int d = 0; d < 3; d++)
-      {
-        polxt[d] = &mem2[d * (order + 1) + 1];
-        Monomial (order, cpoint[d], polxt[d]);
-      }
-
-    for (int d1 = 0; d1 < 3; d1++)
-      {
-        for (int d2 = 0; d2 < 3; d2++)
+    SwitchMonomialOrder<D> (order, [&] (auto ord, auto npoly,
+                                         const int *exps) {
+      STACK_ARRAY (double, pol1d, 3 * D * (ord + 1));
+      STACK_ARRAY (double, pol, npoly);
+      CalcMonomials1D<D> (ord, cpoint, pol1d);
+      for (int d1 = 0; d1 < D; d1++)
+        for (int d2 = d1; d2 < D; d2++)
           {
-            Vector<double> pol (npoly);
-            for (int i = 0, ii = 0; i <= order; i++)
-              for (int j = 0; j <= order - i; j++)
-                for (int k = 0; k <= order - i - j; k++)
-                  {
-                    int ijkd1 = d1 == 0 ? i : (d1 == 1 ? j : k);
-                    int ijkd2 = d2 == 0 ? i : (d2 == 1 ? j : k);
-                    pol[ii++] = ijkd1 * (ijkd2 - (d1 == d2))
-                                * polxt[0][i - (d1 == 0) - (d2 == 0)]
-                                * polxt[1][j - (d1 == 1) - (d2 == 1)]
-                                * polxt[2][k - (d1 == 2) - (d2 == 2)];
-                  }
-
+            CalcMonomials<D> (ord, npoly, exps, pol1d,
+                              UnitDeriv<D> (d1) + UnitDeriv<D> (d2), pol);
             for (int i = 0; i < this->ndof; ++i)
               {
-                ddshape (i, d2 * 3 + d1) = 0.0;
-                for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-                  ddshape (i, d2 * 3 + d1) += (localmat)[2][j]
-                                              * pol[(localmat)[1][j]]
-                                              * scale[d1] * scale[d2];
+                ddshape (i, d2 * D + d1) = localmat.RowTimes (i, pol, npoly)
+                                           * scale[d1] * scale[d2];
+                ddshape (i, d1 * D + d2) = ddshape (i, d2 * D + d1);
               }
           }
-      }
-  }
-
-  template <>
-  void ScalarMappedElement<4>::CalcMappedDDShape (
-      const BaseMappedIntegrationPoint &bmip, BareSliceMatrix<> hddshape) const
-  {
-    ;
+    });
   }
 
   ////////////////////////////////////////////////////////
   /////////////// CalcShape implementation ///////////////
   ////////////////////////////////////////////////////////
 
-  template <>
-  void ScalarMappedElement<1>::CalcShape (
-      const SIMD_BaseMappedIntegrationRule &smir,
-      BareSliceMatrix<SIMD<double>> shape) const
-  {
-    cout << "dim not implemented" << endl;
-  }
-
-  template <>
-  void ScalarMappedElement<2>::CalcShape (
+  template <int D>
+  void ScalarMappedElement<D>::CalcShape (
       const SIMD_BaseMappedIntegrationRule &smir,
       BareSliceMatrix<SIMD<double>> shape) const
   {
-    for (size_t imip = 0; imip < smir.Size (); imip++)
-      {
-        Vec<2, SIMD<double>> cpoint = smir[imip].GetPoint ();
-        cpoint -= shift;
-        vtimes (cpoint, scale);
-        // calc 1 dimensional monomial basis
-        STACK_ARRAY (SIMD<double>, mem, 2 * (order + 1));
-        Vec<2, SIMD<double> *> polxt;
-        for (int d = 0; d < 2; d++)
-          {
-            polxt[d] = &mem[d * (order + 1)];
-            Monomial (order, cpoint[d], polxt[d]);
-          }
-        // calc D+1 dimenional monomial basis
-        Vector<SIMD<double>> pol (npoly);
-        for (int i = 0, ii = 0; i <= order; i++)
-          for (int j = 0; j <= order - i; j++)
-            pol[ii++] = polxt[0][i] * polxt[1][j];
-        // TB*monomials for trefftz shape fcts
-        for (int i = 0; i < this->ndof; ++i)
-          {
-            shape (i, imip) = 0.0;
-            for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-              shape (i, imip) += (localmat)[2][j] * pol[(localmat)[1][j]];
-          }
-      }
+    auto shapes = shape.AddSize (ndof, smir.Size ());
+    IterateMonomialBlocks<D> (
+        order, shift, scale, smir, false,
+        [&] (IntRange points, FlatMatrix<SIMD<double>> pol) {
+          localmat.Mult (SIMDAsDouble (pol),
+                         SIMDAsDouble (shapes.Cols (points)));
+        });
   }
 
-  template <>
-  void ScalarMappedElement<3>::CalcShape (
-      const SIMD_BaseMappedIntegrationRule &smir,
-      BareSliceMatrix<SIMD<double>> shape) const
-  {
-    for (size_t imip = 0; imip < smir.Size (); imip++)
-      {
-        Vec<3, SIMD<double>> cpoint = smir[imip].GetPoint ();
-        cpoint -= shift;
-        vtimes (cpoint, scale);
-        // calc 1 dimensional monomial basis
-        STACK_ARRAY (SIMD<double>, mem, 3 * (order + 1));
-        Vec<3, SIMD<double> *> polxt;
-        for (int d = 0; d < 3; d++)
-          {
-            polxt[d] = &mem[d * (order + 1)];
-            Monomial (order, cpoint[d], polxt[d]);
-          }
-        // calc D+1 dimenional monomial basis
-        Vector<SIMD<double>> pol (npoly);
-        for (int i = 0, ii = 0; i <= order; i++)
-          for (int j = 0; j <= order - i; j++)
-            for (int k = 0; k <= order - i - j; k++)
-              pol[ii++] = polxt[0][i] * polxt[1][j] * polxt[2][k];
-        // TB*monomials for trefftz shape fcts
-        for (int i = 0; i < this->ndof; ++i)
-          {
-            shape (i, imip) = 0.0;
-            for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-              shape (i, imip) += (localmat)[2][j] * pol[(localmat)[1][j]];
-          }
-      }
-  }
-
-  template <>
-  void ScalarMappedElement<4>::CalcShape (
+  template <int D>
+  void ScalarMappedElement<D>::CalcDShape (
       const SIMD_BaseMappedIntegrationRule &smir,
-      BareSliceMatrix<SIMD<double>> shape) const
+      BareSliceMatrix<SIMD<double>> dshape) const
   {
-    // auto & smir = static_cast<const SIMD_MappedIntegrationRule<D-1,D>&>
-    // (mir);
-    for (size_t imip = 0; imip < smir.Size (); imip++)
-      {
-        Vec<4, SIMD<double>> cpoint = smir[imip].GetPoint ();
-        cpoint -= shift;
-        vtimes (cpoint, scale);
-        // calc 1 dimensional monomial basis
-        STACK_ARRAY (SIMD<double>, mem, 4 * (order + 1));
-        Vec<4, SIMD<double> *> polxt;
-        for (int d = 0; d < 4; d++)
-          {
-            polxt[d] = &mem[d * (order + 1)];
-            Monomial (order, cpoint[d], polxt[d]);
-          }
-        // calc D+1 dimenional monomial basis
-        Vector<SIMD<double>> pol (npoly);
-        for (int i = 0, ii = 0; i <= order; i++)
-          for (int j = 0; j <= order - i; j++)
-            for (int k = 0; k <= order - i - j; k++)
-              for (int l = 0; l <= order - i - j - k; l++)
-                pol[ii++]
-                    = polxt[0][i] * polxt[1][j] * polxt[2][k] * polxt[3][l];
-        // TB*monomials for trefftz shape fcts
-        for (int i = 0; i < this->ndof; ++i)
-          {
-            shape (i, imip) = 0.0;
-            for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-              shape (i, imip) += (localmat)[2][j] * pol[(localmat)[1][j]];
-          }
-      }
+    IterateMonomialBlocks<D> (
+        order, shift, scale, smir, true,
+        [&] (IntRange points, FlatMatrix<SIMD<double>> pol) {
+          for (int d = 0; d < D; d++)
+            {
+              // the rows i * D + d of dshape
+              SliceMatrix<SIMD<double>> dshape_d (
+                  ndof, points.Size (), D * dshape.Dist (),
+                  &dshape (d, points.First ()));
+              localmat.Mult (SIMDAsDouble (pol.Rows (d * npoly,
+                                                     (d + 1) * npoly)),
+                             SIMDAsDouble (dshape_d));
+            }
+        });
   }
 
-  template <>
-  void ScalarMappedElement<1>::CalcDShape (
-      const SIMD_BaseMappedIntegrationRule &smir,
-      BareSliceMatrix<SIMD<double>> dshape) const
+  template <int D>
+  void ScalarMappedElement<D>::Evaluate (
+      const SIMD_BaseMappedIntegrationRule &smir, BareSliceVector<> coefs,
+      BareVector<SIMD<double>> values) const
   {
-    cout << "dim not implemented" << endl;
+    // the coefficients w.r.t. the monomials
+    STACK_ARRAY (double, mem, npoly);
+    FlatVector<> polcoefs (npoly, &mem[0]);
+    localmat.MultTrans (coefs.Range (0, ndof), polcoefs);
+    IterateMonomialBlocks<D> (
+        order, shift, scale, smir, false,
+        [&] (IntRange points, FlatMatrix<SIMD<double>> pol) {
+          SIMDAsDouble (points, &values (0))
+              = Trans (SIMDAsDouble (pol)) * polcoefs;
+        });
   }
 
-  template <>
-  void ScalarMappedElement<2>::CalcDShape (
+  template <int D>
+  void ScalarMappedElement<D>::AddTrans (
       const SIMD_BaseMappedIntegrationRule &smir,
-      BareSliceMatrix<SIMD<double>> dshape) const
+      BareVector<SIMD<double>> values, BareSliceVector<> coefs) const
   {
-    for (size_t imip = 0; imip < smir.Size (); imip++)
-      {
-        Vec<2, SIMD<double>> cpoint = smir[imip].GetPoint ();
-        cpoint -= shift;
-        vtimes (cpoint, scale);
-        // +1 size to avoid undefined behavior taking deriv, getting [-1] entry
-        STACK_ARRAY (SIMD<double>, mem, 2 * (order + 1) + 1);
-        mem[0] = 0;
-        Vec<2, SIMD<double> *> polxt;
-        for (int d = 0; d < 2; d++)
-          {
-            polxt[d] = &mem[d * (order + 1) + 1];
-            Monomial (order, cpoint[d], polxt[d]);
-          }
-
-        for (int d = 0; d < 2; d++)
-          {
-            Vector<SIMD<double>> pol (npoly);
-            for (int i = 0, ii = 0; i <= order; i++)
-              for (int j = 0; j <= order - i; j++)
-                pol[ii++] = (d == 0 ? i : (d == 1 ? j : 0))
-                            * polxt[0][i - (d == 0)] * polxt[1][j - (d == 1)];
-
-            for (int i = 0; i < this->ndof; ++i)
-              {
-                dshape (i * 2 + d, imip) = 0.0;
-                for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-                  dshape (i * 2 + d, imip)
-                      += (localmat)[2][j] * pol[(localmat)[1][j]] * scale[d];
-              }
-          }
-      }
+    STACK_ARRAY (double, mem, npoly);
+    FlatVector<> polvalues (npoly, &mem[0]);
+    polvalues = 0.0;
+    IterateMonomialBlocks<D> (
+        order, shift, scale, smir, false,
+        [&] (IntRange points, FlatMatrix<SIMD<double>> pol) {
+          polvalues
+              += SIMDAsDouble (pol) * SIMDAsDouble (points, &values (0));
+        });
+    localmat.MultAdd (polvalues, coefs.Range (0, ndof));
   }
 
-  template <>
-  void ScalarMappedElement<3>::CalcDShape (
-      const SIMD_BaseMappedIntegrationRule &smir,
-      BareSliceMatrix<SIMD<double>> dshape) const
+  template <int D>
+  void ScalarMappedElement<D>::EvaluateGrad (
+      const SIMD_BaseMappedIntegrationRule &smir, BareSliceVector<> coefs,
+      BareSliceMatrix<SIMD<double>> values) const
   {
-    for (size_t imip = 0; imip < smir.Size (); imip++)
-      {
-        Vec<3, SIMD<double>> cpoint = smir[imip].GetPoint ();
-        cpoint -= shift;
-        vtimes (cpoint, scale);
-
-        // +1 size to avoid undefined behavior taking deriv, getting [-1] entry
-        STACK_ARRAY (SIMD<double>, mem, 3 * (order + 1) + 1);
-        mem[0] = 0;
-        Vec<3, SIMD<double> *> polxt;
-        for (int d = 0; d < 3; d++)
-          {
-            polxt[d] = &mem[d * (order + 1) + 1];
-            Monomial (order, cpoint[d], polxt[d]);
-          }
-
-        for (int d = 0; d < 3; d++)
-          {
-            Vector<SIMD<double>> pol (npoly);
-            for (int i = 0, ii = 0; i <= order; i++)
-              for (int j = 0; j <= order - i; j++)
-                for (int k = 0; k <= order - i - j; k++)
-                  pol[ii++] = (d == 0 ? i : (d == 1 ? j : (d == 2 ? k : 0)))
-                              * polxt[0][i - (d == 0)] * polxt[1][j - (d == 1)]
-                              * polxt[2][k - (d == 2)];
-
-            for (int i = 0; i < this->ndof; ++i)
-              {
-                dshape (i * 3 + d, imip) = 0.0;
-                for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-                  dshape (i * 3 + d, imip)
-                      += (localmat)[2][j] * pol[(localmat)[1][j]] * scale[d];
-              }
-          }
-      }
+    STACK_ARRAY (double, mem, npoly);
+    FlatVector<> polcoefs (npoly, &mem[0]);
+    localmat.MultTrans (coefs.Range (0, ndof), polcoefs);
+    IterateMonomialBlocks<D> (
+        order, shift, scale, smir, true,
+        [&] (IntRange points, FlatMatrix<SIMD<double>> pol) {
+          for (int d = 0; d < D; d++)
+            SIMDAsDouble (points, &values (d, 0))
+                = Trans (SIMDAsDouble (pol.Rows (d * npoly, (d + 1) * npoly)))
+                  * polcoefs;
+        });
   }
 
-  template <>
-  void ScalarMappedElement<4>::CalcDShape (
+  template <int D>
+  void ScalarMappedElement<D>::AddGradTrans (
       const SIMD_BaseMappedIntegrationRule &smir,
-      BareSliceMatrix<SIMD<double>> dshape) const
+      BareSliceMatrix<SIMD<double>> values, BareSliceVector<> coefs) const
   {
-    for (size_t imip = 0; imip < smir.Size (); imip++)
-      {
-        Vec<4, SIMD<double>> cpoint = smir[imip].GetPoint ();
-        cpoint -= shift;
-        vtimes (cpoint, scale);
-        // +1 size to avoid undefined behavior taking deriv, getting [-1] entry
-        STACK_ARRAY (SIMD<double>, mem, 4 * (order + 1) + 1);
-        mem[0] = 0;
-        Vec<4, SIMD<double> *> polxt;
-        for (int d = 0; d < 4; d++)
-          {
-            polxt[d] = &mem[d * (order + 1) + 1];
-            Monomial (order, cpoint[d], polxt[d]);
-          }
-
-        for (int d = 0; d < 4; d++)
-          {
-            Vector<SIMD<double>> pol (npoly);
-            for (int i = 0, ii = 0; i <= order; i++)
-              for (int j = 0; j <= order - i; j++)
-                for (int k = 0; k <= order - i - j; k++)
-                  for (int l = 0; l <= order - i - j - k; l++)
-                    pol[ii++]
-                        = (d == 0 ? i
-                                  : (d == 1 ? j
-                                            : (d == 2 ? k : (d == 3 ? l : 0))))
-                          * polxt[0][i - (d == 0)] * polxt[1][j - (d == 1)]
-                          * polxt[2][k - (d == 2)] * polxt[3][l - (d == 3)];
-
-            for (int i = 0; i < this->ndof; ++i)
-              {
-                dshape (i * 4 + d, imip) = 0.0;
-                for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-                  dshape (i * 4 + d, imip)
-                      += (localmat)[2][j] * pol[(localmat)[1][j]] * scale[d];
-              }
-          }
-      }
+    STACK_ARRAY (double, mem, npoly);
+    FlatVector<> polvalues (npoly, &mem[0]);
+    polvalues = 0.0;
+    IterateMonomialBlocks<D> (
+        order, shift, scale, smir, true,
+        [&] (IntRange points, FlatMatrix<SIMD<double>> pol) {
+          for (int d = 0; d < D; d++)
+            polvalues
+                += SIMDAsDouble (pol.Rows (d * npoly, (d + 1) * npoly))
+                   * SIMDAsDouble (points, &values (d, 0));
+        });
+    localmat.MultAdd (polvalues, coefs.Range (0, ndof));
   }
 
   /////////////// non-simd
 
-  template <>
-  void
-  ScalarMappedElement<1>::CalcShape (const BaseMappedIntegrationPoint &mip,
-                                     BareSliceVector<> shape) const
-  {
-    cout << "dim not implemented" << endl;
-  }
-
-  template <>
-  void
-  ScalarMappedElement<2>::CalcShape (const BaseMappedIntegrationPoint &mip,
-                                     BareSliceVector<> shape) const
-  {
-    // auto & smir = static_cast<const SIMD_BaseMappedIntegrationRuleD>&>
-    // (mir);
-    Vec<2> cpoint = mip.GetPoint ();
-    cpoint -= shift;
-    vtimes (cpoint, scale);
-    // calc 1 dimensional monomial basis
-    STACK_ARRAY (double, mem, 2 * (order + 1));
-    double *polxt[2];
-    for (int d = 0; d < 2; d++)
-      {
-        polxt[d] = &mem[d * (order + 1)];
-        Monomial (order, cpoint[d], polxt[d]);
-      }
-    // calc D+1 dimenional monomial basis
-    Vector<double> pol (npoly);
-    for (int i = 0, ii = 0; i <= order; i++)
-      for (int j = 0; j <= order - i; j++)
-        pol[ii++] = polxt[0][i] * polxt[1][j];
-    // TB*monomials for trefftz shape fcts
-    for (int i = 0; i < this->ndof; ++i)
-      {
-        shape (i) = 0.0;
-        for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-          shape (i) += (localmat)[2][j] * pol[(localmat)[1][j]];
-      }
-  }
-
-  template <>
-  void
-  ScalarMappedElement<3>::CalcShape (const BaseMappedIntegrationPoint &mip,
-                                     BareSliceVector<> shape) const
-  {
-    Vec<3> cpoint = mip.GetPoint ();
-    cpoint -= shift;
-    vtimes (cpoint, scale);
-    // calc 1 dimensional monomial basis
-    STACK_ARRAY (double, mem, 3 * (order + 1));
-    // double* polxt[3];
-    Vec<3, double *> polxt;
-    for (int d = 0; d < 3; d++)
-      {
-        polxt[d] = &mem[d * (order + 1)];
-        Monomial (order, cpoint[d], polxt[d]);
-      }
-    // calc D+1 dimenional monomial basis
-    Vector<double> pol (npoly);
-    for (int i = 0, ii = 0; i <= order; i++)
-      for (int j = 0; j <= order - i; j++)
-        for (int k = 0; k <= order - i - j; k++)
-          pol[ii++] = polxt[0][i] * polxt[1][j] * polxt[2][k];
-    // TB*monomials for trefftz shape fcts
-    for (int i = 0; i < this->ndof; ++i)
-      {
-        shape (i) = 0.0;
-        for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-          shape (i) += (localmat)[2][j] * pol[(localmat)[1][j]];
-      }
-  }
-
-  template <>
+  template <int D>
   void
-  ScalarMappedElement<4>::CalcShape (const BaseMappedIntegrationPoint &mip,
+  ScalarMappedElement<D>::CalcShape (const BaseMappedIntegrationPoint &mip,
                                      BareSliceVector<> shape) const
   {
-    Vec<4> cpoint = mip.GetPoint ();
-    cpoint -= shift;
-    vtimes (cpoint, scale);
-    // calc 1 dimensional monomial basis
-    STACK_ARRAY (double, mem, 4 * (order + 1));
-    double *polxt[4];
-    for (int d = 0; d < 4; d++)
-      {
-        polxt[d] = &mem[d * (order + 1)];
-        Monomial (order, cpoint[d], polxt[d]);
-      }
-    // calc D+1 dimenional monomial basis
-    Vector<double> pol (npoly);
-    for (int i = 0, ii = 0; i <= order; i++)
-      for (int j = 0; j <= order - i; j++)
-        for (int k = 0; k <= order - i - j; k++)
-          for (int l = 0; l <= order - i - j - k; l++)
-            pol[ii++] = polxt[0][i] * polxt[1][j] * polxt[2][k] * polxt[3][l];
-    // TB*monomials for trefftz shape fcts
-    for (int i = 0; i < this->ndof; ++i)
-      {
-        shape (i) = 0.0;
-        for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-          shape (i) += (localmat)[2][j] * pol[(localmat)[1][j]];
-      }
-  }
-
-  template <>
-  void
-  ScalarMappedElement<1>::CalcDShape (const BaseMappedIntegrationPoint &mip,
-                                      BareSliceMatrix<> dshape) const
-  {
-    cout << "dim not implemented" << endl;
-  }
-
-  template <>
-  void
-  ScalarMappedElement<2>::CalcDShape (const BaseMappedIntegrationPoint &mip,
-                                      BareSliceMatrix<> dshape) const
-  {
-    Vec<2> cpoint = mip.GetPoint ();
-    cpoint -= shift;
-    vtimes (cpoint, scale);
-    // +1 size to avoid undefined behavior taking deriv, getting [-1] entry
-    STACK_ARRAY (double, mem, 2 * (order + 1) + 1);
-    mem[0] = 0;
-    double *polxt[2];
-    for (int d = 0; d < 2; d++)
-      {
-        polxt[d] = &mem[d * (order + 1) + 1];
-        Monomial (order, cpoint[d], polxt[d]);
-      }
-
-    for (int d = 0; d < 2; d++)
-      {
-        Vector<double> pol (npoly);
-        for (int i = 0, ii = 0; i <= order; i++)
-          for (int j = 0; j <= order - i; j++)
-            pol[ii++] = (d == 0 ? i : (d == 1 ? j : 0))
-                        * polxt[0][i - (d == 0)] * polxt[1][j - (d == 1)];
-
-        for (int i = 0; i < this->ndof; ++i)
-          {
-            dshape (i, d) = 0.0;
-            for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-              dshape (i, d)
-                  += (localmat)[2][j] * pol[(localmat)[1][j]] * scale[d];
-          }
-      }
-  }
-
-  template <>
-  void
-  ScalarMappedElement<3>::CalcDShape (const BaseMappedIntegrationPoint &mip,
-                                      BareSliceMatrix<> dshape) const
-  {
-    Vec<3> cpoint = mip.GetPoint ();
+    Vec<D> cpoint = mip.GetPoint ();
     cpoint -= shift;
     vtimes (cpoint, scale);
-    // +1 size to avoid undefined behavior taking deriv, getting [-1] entry
-    STACK_ARRAY (double, mem, 3 * (order + 1) + 1);
-    mem[0] = 0;
-    // double* polxt[4];
-    Vec<3, double *> polxt;
-    for (int d = 0; d < 3; d++)
-      {
-        polxt[d] = &mem[d * (order + 1) + 1];
-        Monomial (order, cpoint[d], polxt[d]);
-      }
-
-    for (int d = 0; d < 3; d++)
-      {
-        Vector<double> pol (npoly);
-        for (int i = 0, ii = 0; i <= order; i++)
-          for (int j = 0; j <= order - i; j++)
-            for (int k = 0; k <= order - i - j; k++)
-              pol[ii++] = (d == 0 ? i : (d == 1 ? j : (d == 2 ? k : 0)))
-                          * polxt[0][i - (d == 0)] * polxt[1][j - (d == 1)]
-                          * polxt[2][k - (d == 2)];
-
-        for (int i = 0; i < this->ndof; ++i)
-          {
-            dshape (i, d) = 0.0;
-            for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-              dshape (i, d)
-                  += (localmat)[2][j] * pol[(localmat)[1][j]] * scale[d];
-          }
-      }
+    SwitchMonomialOrder<D> (order, [&] (auto ord, auto npoly,
+                                         const int *exps) {
+      STACK_ARRAY (double, pol1d, 3 * D * (ord + 1));
+      STACK_ARRAY (double, pol, npoly);
+      CalcMonomials1D<D> (ord, cpoint, pol1d);
+      CalcMonomials<D> (ord, npoly, exps, pol1d, Vec<D, int> (0), pol);
+      for (int i = 0; i < this->ndof; ++i)
+        shape (i) = localmat.RowTimes (i, pol, npoly);
+    });
   }
 
-  template <>
+  template <int D>
   void
-  ScalarMappedElement<4>::CalcDShape (const BaseMappedIntegrationPoint &mip,
+  ScalarMappedElement<D>::CalcDShape (const BaseMappedIntegrationPoint &mip,
                                       BareSliceMatrix<> dshape) const
   {
-    Vec<4> cpoint = mip.GetPoint ();
+    Vec<D> cpoint = mip.GetPoint ();
     cpoint -= shift;
     vtimes (cpoint, scale);
-    // +1 size to avoid undefined behavior taking deriv, getting [-1] entry
-    STACK_ARRAY (double, mem, 4 * (order + 1) + 1);
-    mem[0] = 0;
-    double *polxt[4];
-    for (int d = 0; d < 4; d++)
-      {
-        polxt[d] = &mem[d * (order + 1) + 1];
-        Monomial (order, cpoint[d], polxt[d]);
-      }
-
-    for (int d = 0; d < 4; d++)
-      {
-        Vector<double> pol (npoly);
-        for (int i = 0, ii = 0; i <= order; i++)
-          for (int j = 0; j <= order - i; j++)
-            for (int k = 0; k <= order - i - j; k++)
-              for (int l = 0; l <= order - i - j - k; l++)
-                pol[ii++]
-                    = (d == 0 ? i
-                              : (d == 1 ? j : (d == 2 ? k : (d == 3 ? l : 0))))
-                      * polxt[0][i - (d == 0)] * polxt[1][j - (d == 1)]
-                      * polxt[2][k - (d == 2)] * polxt[3][l - (d == 3)];
-
-        for (int i = 0; i < this->ndof; ++i)
-          {
-            dshape (i, d) = 0.0;
-            for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-              dshape (i, d)
-                  += (localmat)[2][j] * pol[(localmat)[1][j]] * scale[d];
-          }
-      }
+    SwitchMonomialOrder<D> (order, [&] (auto ord, auto npoly,
+                                         const int *exps) {
+      STACK_ARRAY (double, pol1d, 3 * D * (ord + 1));
+      STACK_ARRAY (double, pol, npoly);
+      CalcMonomials1D<D> (ord, cpoint, pol1d);
+      for (int d = 0; d < D; d++)
+        {
+          CalcMonomials<D> (ord, npoly, exps, pol1d, UnitDeriv<D> (d), pol);
+          for (int i = 0; i < this->ndof; ++i)
+            dshape (i, d) = localmat.RowTimes (i, pol, npoly) * scale[d];
+        }
+    });
   }
 
   template <>
@@ -954,10 +801,7 @@ namespace ngfem
         for (int i = 0; i < this->ndof; ++i)
           {
             dshape (i * 2, imip) = 0.0;
-            dshape (i * 2 + 1, imip) = 0.0;
-            for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-              dshape (i * 2 + 1, imip)
-                  += (localmat)[2][j] * pol[(localmat)[1][j]];
+            dshape (i * 2 + 1, imip) = localmat.RowTimes (i, pol);
           }
       }
   }
@@ -1002,10 +846,7 @@ namespace ngfem
           {
             dshape (i * 3, imip) = 0.0;
             dshape (i * 3 + 1, imip) = 0.0;
-            dshape (i * 3 + 2, imip) = 0.0;
-            for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-              dshape (i * 3 + 2, imip)
-                  += (localmat)[2][j] * pol[(localmat)[1][j]];
+            dshape (i * 3 + 2, imip) = localmat.RowTimes (i, pol);
           }
       }
   }
@@ -1030,93 +871,25 @@ namespace ngfem
     throw Exception ("Not allowed");
   }
 
-  template <>
-  void
-  BlockMappedElement<1>::CalcDShape (const BaseMappedIntegrationPoint &mip,
-                                     BareSliceMatrix<> dshape) const
-  {
-    throw Exception ("Not implemented point ");
-  }
-  template <>
-  void
-  BlockMappedElement<4>::CalcDShape (const BaseMappedIntegrationPoint &mip,
-                                     BareSliceMatrix<> dshape) const
-  {
-    throw Exception ("Not implemented point ");
-  }
-
-  template <>
-  void
-  BlockMappedElement<2>::CalcDShape (const BaseMappedIntegrationPoint &mip,
-                                     BareSliceMatrix<> dshape) const
-  {
-    Vec<2> cpoint = mip.GetPoint ();
-    cpoint -= shift;
-    vtimes (cpoint, scale);
-    // +1 size to avoid undefined behavior taking deriv, getting [-1] entry
-    STACK_ARRAY (double, mem, 2 * (order + 1) + 1);
-    mem[0] = 0;
-    double *polxt[2];
-    for (int d = 0; d < 2; d++)
-      {
-        polxt[d] = &mem[d * (order + 1) + 1];
-        Monomial (order, cpoint[d], polxt[d]);
-      }
-
-    for (int d = 0; d < 2; d++)
-      {
-        Vector<double> pol (npoly);
-        for (int i = 0, ii = 0; i <= order; i++)
-          for (int j = 0; j <= order - i; j++)
-            pol[ii++] = polxt[0][i] * polxt[1][j];
-
-        CSR localmat = localmats[d];
-        for (int i = 0; i < this->ndof; ++i)
-          {
-            dshape (i, d) = 0.0;
-            for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-              dshape (i, d)
-                  += (localmat)[2][j] * pol[(localmat)[1][j]] * scale[d];
-          }
-      }
-  }
-
-  template <>
+  template <int D>
   void
-  BlockMappedElement<3>::CalcDShape (const BaseMappedIntegrationPoint &mip,
+  BlockMappedElement<D>::CalcDShape (const BaseMappedIntegrationPoint &mip,
                                      BareSliceMatrix<> dshape) const
   {
-    Vec<3> cpoint = mip.GetPoint ();
-    cpoint -= shift;
-    vtimes (cpoint, scale);
-    // +1 size to avoid undefined behavior taking deriv, getting [-1] entry
-    STACK_ARRAY (double, mem, 3 * (order + 1) + 1);
-    mem[0] = 0;
-    // double* polxt[4];
-    Vec<3, double *> polxt;
-    for (int d = 0; d < 3; d++)
-      {
-        polxt[d] = &mem[d * (order + 1) + 1];
-        Monomial (order, cpoint[d], polxt[d]);
-      }
-
-    for (int d = 0; d < 3; d++)
-      {
-        Vector<double> pol (npoly);
-        for (int i = 0, ii = 0; i <= order; i++)
-          for (int j = 0; j <= order - i; j++)
-            for (int k = 0; k <= order - i - j; k++)
-              pol[ii++] = polxt[0][i] * polxt[1][j] * polxt[2][k];
-
-        CSR localmat = localmats[d];
+    Vec<D> cpoint = mip.GetPoint ();
+    cpoint -= this->shift;
+    vtimes (cpoint, this->scale);
+    SwitchMonomialOrder<D> (this->order, [&] (auto ord, auto npoly,
+                                               const int *exps) {
+      STACK_ARRAY (double, pol1d, 3 * D * (ord + 1));
+      STACK_ARRAY (double, pol, npoly);
+      CalcMonomials1D<D> (ord, cpoint, pol1d);
+      CalcMonomials<D> (ord, npoly, exps, pol1d, Vec<D, int> (0), pol);
+      for (int d = 0; d < D; d++)
         for (int i = 0; i < this->ndof; ++i)
-          {
-            dshape (i, d) = 0.0;
-            for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-              dshape (i, d)
-                  += (localmat)[2][j] * pol[(localmat)[1][j]] * scale[d];
-          }
-      }
+          dshape (i, d)
+              = localmats[d].RowTimes (i, pol, npoly) * this->scale[d];
+    });
   }
 
   // template<int D>
@@ -1124,239 +897,109 @@ namespace ngfem
   // & mir, BareSliceMatrix<> dshapes) const
   //{ throw Exception("Not implemented no simd "); }
 
-  template <>
-  void BlockMappedElement<1>::CalcDShape (
+  template <int D>
+  void BlockMappedElement<D>::CalcDShape (
       const SIMD_BaseMappedIntegrationRule &smir,
       BareSliceMatrix<SIMD<double>> dshape) const
   {
-    throw Exception ("Not implemented 1d");
+    IterateMonomialBlocks<D> (
+        this->order, this->shift, this->scale, smir, false,
+        [&] (IntRange points, FlatMatrix<SIMD<double>> pol) {
+          for (int d = 0; d < D; d++)
+            {
+              // the rows i * D + d of dshape
+              SliceMatrix<SIMD<double>> dshape_d (
+                  this->ndof, points.Size (), D * dshape.Dist (),
+                  &dshape (d, points.First ()));
+              localmats[d].Mult (SIMDAsDouble (pol), SIMDAsDouble (dshape_d));
+              SIMDAsDouble (dshape_d) *= this->scale[d];
+            }
+        });
   }
 
-  template <>
-  void BlockMappedElement<2>::CalcDShape (
-      const SIMD_BaseMappedIntegrationRule &smir,
-      BareSliceMatrix<SIMD<double>> dshape) const
+  template <int D>
+  void BlockMappedElement<D>::Evaluate (
+      const SIMD_BaseMappedIntegrationRule &smir, BareSliceVector<> coefs,
+      BareVector<SIMD<double>> values) const
   {
-    for (size_t imip = 0; imip < smir.Size (); imip++)
-      {
-        Vec<2, SIMD<double>> cpoint = smir[imip].GetPoint ();
-        cpoint -= shift;
-        vtimes (cpoint, scale);
-        // +1 size to avoid undefined behavior taking deriv, getting [-1] entry
-        STACK_ARRAY (SIMD<double>, mem, 2 * (order + 1) + 1);
-        mem[0] = 0;
-        Vec<2, SIMD<double> *> polxt;
-        for (int d = 0; d < 2; d++)
-          {
-            polxt[d] = &mem[d * (order + 1) + 1];
-            Monomial (order, cpoint[d], polxt[d]);
-          }
-
-        for (int d = 0; d < 2; d++)
-          {
-            Vector<SIMD<double>> pol (npoly);
-            for (int i = 0, ii = 0; i <= order; i++)
-              for (int j = 0; j <= order - i; j++)
-                pol[ii++] = polxt[0][i] * polxt[1][j];
-
-            CSR localmat = localmats[d];
-            for (int i = 0; i < ndof; ++i)
-              {
-                dshape (i * 2 + d, imip) = 0.0;
-                for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-                  dshape (i * 2 + d, imip)
-                      += (localmat)[2][j] * pol[(localmat)[1][j]] * scale[d];
-              }
-          }
-      }
+    throw Exception ("Not allowed");
   }
 
-  template <>
-  void BlockMappedElement<3>::CalcDShape (
+  template <int D>
+  void BlockMappedElement<D>::AddTrans (
       const SIMD_BaseMappedIntegrationRule &smir,
-      BareSliceMatrix<SIMD<double>> dshape) const
+      BareVector<SIMD<double>> values, BareSliceVector<> coefs) const
   {
-    for (size_t imip = 0; imip < smir.Size (); imip++)
-      {
-        Vec<3, SIMD<double>> cpoint = smir[imip].GetPoint ();
-        cpoint -= shift;
-        vtimes (cpoint, scale);
-
-        // +1 size to avoid undefined behavior taking deriv, getting [-1] entry
-        STACK_ARRAY (SIMD<double>, mem, 3 * (order + 1) + 1);
-        mem[0] = 0;
-        Vec<3, SIMD<double> *> polxt;
-        for (int d = 0; d < 3; d++)
-          {
-            polxt[d] = &mem[d * (order + 1) + 1];
-            Monomial (order, cpoint[d], polxt[d]);
-          }
-
-        for (int d = 0; d < 3; d++)
-          {
-            Vector<SIMD<double>> pol (npoly);
-            for (int i = 0, ii = 0; i <= order; i++)
-              for (int j = 0; j <= order - i; j++)
-                for (int k = 0; k <= order - i - j; k++)
-                  pol[ii++] = polxt[0][i] * polxt[1][j] * polxt[2][k];
-
-            CSR localmat = localmats[d];
-            for (int i = 0; i < ndof; ++i)
-              {
-                dshape (i * 3 + d, imip) = 0.0;
-                for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-                  dshape (i * 3 + d, imip)
-                      += (localmat)[2][j] * pol[(localmat)[1][j]] * scale[d];
-              }
-          }
-      }
+    throw Exception ("Not allowed");
   }
 
-  template <>
-  void BlockMappedElement<4>::CalcDShape (
-      const SIMD_BaseMappedIntegrationRule &smir,
-      BareSliceMatrix<SIMD<double>> dshape) const
+  template <int D>
+  void BlockMappedElement<D>::EvaluateGrad (
+      const SIMD_BaseMappedIntegrationRule &smir, BareSliceVector<> coefs,
+      BareSliceMatrix<SIMD<double>> values) const
   {
-    for (size_t imip = 0; imip < smir.Size (); imip++)
+    STACK_ARRAY (double, mem, D * this->npoly);
+    FlatMatrix<> polcoefs (D, this->npoly, &mem[0]);
+    for (int d = 0; d < D; d++)
       {
-        Vec<4, SIMD<double>> cpoint = smir[imip].GetPoint ();
-        cpoint -= shift;
-        vtimes (cpoint, scale);
-
-        // +1 size to avoid undefined behavior taking deriv, getting [-1] entry
-        STACK_ARRAY (SIMD<double>, mem, 4 * (order + 1) + 1);
-        mem[0] = 0;
-        Vec<4, SIMD<double> *> polxt;
-        for (size_t d = 0; d < 4; d++)
-          {
-            polxt[d] = &mem[d * (order + 1) + 1];
-            Monomial (order, cpoint[d], polxt[d]);
-          }
-
-        for (int d = 0; d < 4; d++)
-          {
-            Vector<SIMD<double>> pol (npoly);
-            for (int i = 0, ii = 0; i <= order; i++)
-              for (int j = 0; j <= order - i; j++)
-                for (int k = 0; k <= order - i - j; k++)
-                  for (int l = 0; l <= order - i - j - k; l++)
-                    pol[ii++] = polxt[0][i] * polxt[1][j] * polxt[2][k]
-                                * polxt[3][l];
-
-            CSR localmat = localmats[d];
-            for (int i = 0; i < ndof; ++i)
-              {
-                dshape (i * 4 + d, imip) = 0.0;
-                for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-                  dshape (i * 4 + d, imip)
-                      += (localmat)[2][j] * pol[(localmat)[1][j]] * scale[d];
-              }
-          }
+        localmats[d].MultTrans (coefs.Range (0, this->ndof), polcoefs.Row (d));
+        polcoefs.Row (d) *= this->scale[d];
       }
+    IterateMonomialBlocks<D> (
+        this->order, this->shift, this->scale, smir, false,
+        [&] (IntRange points, FlatMatrix<SIMD<double>> pol) {
+          for (int d = 0; d < D; d++)
+            SIMDAsDouble (points, &values (d, 0))
+                = Trans (SIMDAsDouble (pol)) * polcoefs.Row (d);
+        });
   }
 
-  template <>
-  void BlockMappedElement<1>::CalcMappedDDShape (
-      const BaseMappedIntegrationPoint &bmip, BareSliceMatrix<> hddshape) const
-  {
-    ;
-  }
-
-  template <>
-  void BlockMappedElement<2>::CalcMappedDDShape (
-      const BaseMappedIntegrationPoint &bmip, BareSliceMatrix<> hddshape) const
+  template <int D>
+  void BlockMappedElement<D>::AddGradTrans (
+      const SIMD_BaseMappedIntegrationRule &smir,
+      BareSliceMatrix<SIMD<double>> values, BareSliceVector<> coefs) const
   {
-    auto ddshape = hddshape.AddSize (this->ndof, 2 * 2);
-
-    // auto & mip = static_cast<const MappedIntegrationPoint<2,2> &> (bmip);
-    Vec<2> cpoint = bmip.GetPoint ();
-    cpoint -= shift;
-    vtimes (cpoint, scale);
-
-    // +1 size to avoid undefined behavior taking deriv, getting [-1] entry
-    STACK_ARRAY (double, mem2, 2 * (order + 1) + 1);
-    mem2[0] = 0;
-    double *polxt[2];
-    for (int d = 0; d < 2; d++)
+    STACK_ARRAY (double, mem, D * this->npoly);
+    FlatMatrix<> polvalues (D, this->npoly, &mem[0]);
+    polvalues = 0.0;
+    IterateMonomialBlocks<D> (
+        this->order, this->shift, this->scale, smir, false,
+        [&] (IntRange points, FlatMatrix<SIMD<double>> pol) {
+          for (int d = 0; d < D; d++)
+            polvalues.Row (d)
+                += SIMDAsDouble (pol) * SIMDAsDouble (points, &values (d, 0));
+        });
+    for (int d = 0; d < D; d++)
       {
-        polxt[d] = &mem2[d * (order + 1) + 1];
-        Monomial (order, cpoint[d], polxt[d]);
-      }
-
-    for (int d1 = 0; d1 < 2; d1++)
-      {
-        CSR localmat = localmats[d1];
-        for (int d2 = 0; d2 < 2; d2++)
-          {
-            Vector<double> pol (npoly);
-            for (int i = 0, ii = 0; i <= order; i++)
-              for (int j = 0; j <= order - i; j++)
-                pol[ii++] = (d2 == 0 ? i : j) * polxt[0][i - (d2 == 0)]
-                            * polxt[1][j - (d2 == 1)];
-
-            for (int i = 0; i < this->ndof; ++i)
-              {
-                ddshape (i, d2 * 2 + d1) = 0.0;
-                for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-                  ddshape (i, d2 * 2 + d1) += (localmat)[2][j]
-                                              * pol[(localmat)[1][j]]
-                                              * scale[d1] * scale[d2];
-              }
-          }
+        polvalues.Row (d) *= this->scale[d];
+        localmats[d].MultAdd (polvalues.Row (d), coefs.Range (0, this->ndof));
       }
   }
 
-  template <>
-  void BlockMappedElement<3>::CalcMappedDDShape (
+  template <int D>
+  void BlockMappedElement<D>::CalcMappedDDShape (
       const BaseMappedIntegrationPoint &bmip, BareSliceMatrix<> hddshape) const
   {
-    auto ddshape = hddshape.AddSize (this->ndof, 3 * 3);
-    // auto & mip = static_cast<const MappedIntegrationPoint<2,2> &> (bmip);
-    Vec<3> cpoint = bmip.GetPoint ();
-    cpoint -= shift;
-    vtimes (cpoint, scale);
-
-    // +1 size to avoid undefined behavior taking deriv, getting [-1] entry
-    STACK_ARRAY (double, mem2, 3 * (order + 1) + 1);
-    mem2[0] = 0;
-    double *polxt[3];
-    for (int d = 0; d < 3; d++)
-      {
-        polxt[d] = &mem2[d * (order + 1) + 1];
-        Monomial (order, cpoint[d], polxt[d]);
-      }
-
-    for (int d1 = 0; d1 < 3; d1++)
-      {
-        CSR localmat = localmats[d1];
-        for (int d2 = 0; d2 < 3; d2++)
-          {
-            Vector<double> pol (npoly);
-            for (int i = 0, ii = 0; i <= order; i++)
-              for (int j = 0; j <= order - i; j++)
-                for (int k = 0; k <= order - i - j; k++)
-                  pol[ii++] = (d2 == 0 ? i : (d2 == 1 ? j : k))
-                              * polxt[0][i - (d2 == 0)]
-                              * polxt[1][j - (d2 == 1)]
-                              * polxt[2][k - (d2 == 2)];
-
+    auto ddshape = hddshape.AddSize (this->ndof, D * D);
+    Vec<D> cpoint = bmip.GetPoint ();
+    cpoint -= this->shift;
+    vtimes (cpoint, this->scale);
+
+    SwitchMonomialOrder<D> (this->order, [&] (auto ord, auto npoly,
+                                               const int *exps) {
+      STACK_ARRAY (double, pol1d, 3 * D * (ord + 1));
+      STACK_ARRAY (double, pol, npoly);
+      CalcMonomials1D<D> (ord, cpoint, pol1d);
+      for (int d2 = 0; d2 < D; d2++)
+        {
+          CalcMonomials<D> (ord, npoly, exps, pol1d, UnitDeriv<D> (d2), pol);
+          for (int d1 = 0; d1 < D; d1++)
             for (int i = 0; i < this->ndof; ++i)
-              {
-                ddshape (i, d2 * 3 + d1) = 0.0;
-                for (int j = (localmat)[0][i]; j < (localmat)[0][i + 1]; ++j)
-                  ddshape (i, d2 * 3 + d1) += (localmat)[2][j]
-                                              * pol[(localmat)[1][j]]
-                                              * scale[d1] * scale[d2];
-              }
-          }
-      }
-  }
-
-  template <>
-  void BlockMappedElement<4>::CalcMappedDDShape (
-      const BaseMappedIntegrationPoint &bmip, BareSliceMatrix<> hddshape) const
-  {
-    ;
+              ddshape (i, d2 * D + d1)
+                  = localmats[d1].RowTimes (i, pol, npoly) * this->scale[d1]
+                    * this->scale[d2];
+        }
+    });
   }
 
   template class BlockMappedElement<1>;
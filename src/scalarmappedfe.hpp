@@ -145,10 +145,100 @@ namespace ngfem
 
   //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-  typedef Vec<3, Array<double>>
-      CSR; // CSR sparse matrix in (row,col,val) format
+  /// Basis matrix of a Trefftz space w.r.t. the monomials: shape function
+  /// `i` is the sum of `mat(i,j) * monomial_j`. The matrix is stored in CSR
+  /// format with int row pointers and column indices, or dense (row major)
+  /// if its fill is above `dense_fill`, then the row is a contiguous inner
+  /// product without the indirection.
+  /// The entries are shared by all copies, s.t. the elements can take the
+  /// basis matrix of their space by value without allocating.
+  class CSR
+  {
+    size_t height = 0;
+    size_t width = 0;
+    size_t nze = 0;
+    bool dense = false;
+    /// one allocation: values, row pointers, column indices
+    shared_ptr<char[]> data;
+    const double *values = nullptr;
+    const int *rowptr = nullptr;
+    const int *colind = nullptr;
+
+  public:
+    static constexpr double dense_fill = 2.0 / 3.0;
+
+    CSR () = default;
+    explicit CSR (SliceMatrix<> mat);
+
+    /// a copy which refers to the entries without sharing their ownership,
+    /// for elements which do not outlive the owner of the matrix
+    CSR View () const
+    {
+      CSR view;
+      view.height = height;
+      view.width = width;
+      view.nze = nze;
+      view.dense = dense;
+      view.values = values;
+      view.rowptr = rowptr;
+      view.colind = colind;
+      return view;
+    }
+
+    size_t Height () const { return height; }
+    size_t Width () const { return width; }
+    /// number of stored entries
+    size_t NZE () const { return nze; }
+    bool IsDense () const { return dense; }
+
+    /// row `i` of the basis matrix times the monomials `pol`
+    template <typename TV> INLINE auto RowTimes (size_t i, const TV &pol) const
+    {
+      return RowTimes (i, pol, int (width));
+    }
+
+    /// as above, with the width passed by the caller, as IC<width> the
+    /// dense product has constant bounds
+    template <typename TV, typename TW>
+    INLINE auto RowTimes (size_t i, const TV &pol, TW npoly) const
+    {
+      std::decay_t<decltype (pol[0])> sum = 0.0;
+      if (dense)
+        {
+          const double *row = values + i * npoly;
+          for (int j = 0; j < npoly; j++)
+            sum += row[j] * pol[j];
+        }
+      else
+        for (int j = rowptr[i]; j < rowptr[i + 1]; j++)
+          sum += values[j] * pol[colind[j]];
+      return sum;
+    }
+
+    /// y = mat * x, for the monomials of many points in the columns of x
+    void Mult (SliceMatrix<> x, SliceMatrix<> y) const;
+    /// y = Trans (mat) * x
+    void MultTrans (SliceVector<> x, SliceVector<> y) const;
+    /// y += mat * x
+    void MultAdd (SliceVector<> x, SliceVector<> y) const;
+
+    /// calls `func (col, val)` for the non-zero entries of row `i`
+    template <typename FUNC> INLINE void IterateRow (size_t i, FUNC func) const
+    {
+      if (dense)
+        {
+          const double *row = values + i * width;
+          for (size_t j = 0; j < width; j++)
+            if (row[j] != 0.0)
+              func (int (j), row[j]);
+        }
+      else
+        for (int j = rowptr[i]; j < rowptr[i + 1]; j++)
+          func (colind[j], values[j]);
+    }
+  };
 
-  void MatToCSR (Matrix<> mat, CSR &sparsemat);
+  void MatToCSR (SliceMatrix<> mat, CSR &sparsemat);
 
   constexpr inline int BinCoeff (int n, int k) noexcept
   {
@@ -295,67 +385,20 @@ namespace ngfem
       CalcDShape (mir, dshapes);
     }
 
-    void
-    Evaluate (const SIMD_BaseMappedIntegrationRule &mir,
-              BareSliceVector<> coefs, BareVector<SIMD<double>> values) const
-    {
-      STACK_ARRAY (SIMD<double>, mem, this->ndof * mir.Size ());
-      FlatMatrix<SIMD<double>> shape (this->ndof, mir.Size (), &mem[0]);
-      CalcShape (mir, shape);
-      const int nsimd = SIMD<double>::Size ();
-      FlatMatrix<double> bdbmat (this->ndof, mir.Size () * nsimd,
-                                 reinterpret_cast<double *> (&shape (0, 0)));
-      FlatVector<double> bdbvec (mir.Size () * nsimd,
-                                 reinterpret_cast<double *> (&values (0)));
-      bdbvec = Trans (bdbmat) * coefs;
-    }
-    void
-    AddTrans (const SIMD_BaseMappedIntegrationRule &mir,
-              BareVector<SIMD<double>> values, BareSliceVector<> coefs) const
-    {
-      STACK_ARRAY (SIMD<double>, mem, this->ndof * mir.Size ());
-      FlatMatrix<SIMD<double>> shape (this->ndof, mir.Size (), &mem[0]);
-      CalcShape (mir, shape);
-      const int nsimd = SIMD<double>::Size ();
-      FlatMatrix<double> bdbmat (this->ndof, mir.Size () * nsimd,
-                                 reinterpret_cast<double *> (&shape (0, 0)));
-      FlatVector<double> bdbvec (mir.Size () * nsimd,
-                                 reinterpret_cast<double *> (&values (0)));
-      coefs.Range (0, this->ndof) += bdbmat * bdbvec;
-    }
-
+    // the SIMD evaluations multiply the basis matrix with the monomials of
+    // blocks of points, instead of forming the shape functions per point
+    void Evaluate (const SIMD_BaseMappedIntegrationRule &mir,
+                   BareSliceVector<> coefs,
+                   BareVector<SIMD<double>> values) const;
+    void AddTrans (const SIMD_BaseMappedIntegrationRule &mir,
+                   BareVector<SIMD<double>> values,
+                   BareSliceVector<> coefs) const;
     void EvaluateGrad (const SIMD_BaseMappedIntegrationRule &ir,
                        BareSliceVector<> coefs,
-                       BareSliceMatrix<SIMD<double>> values) const
-    {
-      STACK_ARRAY (SIMD<double>, mem, D * this->ndof * ir.Size ());
-      FlatMatrix<SIMD<double>> simddshapes (D * this->ndof, ir.Size (),
-                                            &mem[0]);
-      CalcDShape (ir, simddshapes);
-      const int nsimd = SIMD<double>::Size ();
-      FlatMatrix<double> dshapes (
-          this->ndof, D * nsimd * ir.Size (),
-          reinterpret_cast<double *> (&simddshapes (0, 0)));
-      FlatVector<double> bdbvec (D * nsimd * ir.Size (),
-                                 reinterpret_cast<double *> (&values (0, 0)));
-      bdbvec = Trans (dshapes) * coefs;
-    }
+                       BareSliceMatrix<SIMD<double>> values) const;
     void AddGradTrans (const SIMD_BaseMappedIntegrationRule &mir,
                        BareSliceMatrix<SIMD<double>> values,
-                       BareSliceVector<> coefs) const
-    {
-      STACK_ARRAY (SIMD<double>, mem, D * this->ndof * mir.Size ());
-      FlatMatrix<SIMD<double>> simddshapes (D * this->ndof, mir.Size (),
-                                            &mem[0]);
-      CalcDShape (mir, simddshapes);
-      const int nsimd = SIMD<double>::Size ();
-      FlatMatrix<double> dshapes (
-          this->ndof, D * nsimd * mir.Size (),
-          reinterpret_cast<double *> (&simddshapes (0, 0)));
-      FlatVector<double> bdbvec (D * nsimd * mir.Size (),
-                                 reinterpret_cast<double *> (&values (0, 0)));
-      coefs.Range (0, this->ndof) += dshapes * bdbvec;
-    }
+                       BareSliceVector<> coefs) const;
   };
 
   template <int D> class BlockMappedElement : public ScalarMappedElement<D>
@@ -396,6 +439,19 @@ namespace ngfem
                      BareSliceMatrix<SIMD<double>> dshape) const override;
     void CalcMappedDDShape (const BaseMappedIntegrationPoint &bmip,
                             BareSliceMatrix<> hddshape) const override;
+
+    void Evaluate (const SIMD_BaseMappedIntegrationRule &mir,
+                   BareSliceVector<> coefs,
+                   BareVector<SIMD<double>> values) const override;
+    void AddTrans (const SIMD_BaseMappedIntegrationRule &mir,
+                   BareVector<SIMD<double>> values,
+                   BareSliceVector<> coefs) const override;
+    void EvaluateGrad (const SIMD_BaseMappedIntegrationRule &ir,
+                       BareSliceVector<> coefs,
+                       BareSliceMatrix<SIMD<double>> values) const override;
+    void AddGradTrans (const SIMD_BaseMappedIntegrationRule &mir,
+                       BareSliceMatrix<SIMD<double>> values,
+                       BareSliceVector<> coefs) const override;
   };
 
 }
@@ -135,6 +135,7 @@ namespace ngcomp
     ndof = local_ndof * nel;
     SetNDof (ndof);
     UpdateCouplingDofArray ();
+    ResetElementBases ();
   }
 
   void TrefftzFESpace ::UpdateCouplingDofArray ()
@@ -197,10 +198,57 @@ namespace ngcomp
       basisUpdate<3> ();
   }
 
+  template <int Dim>
+  CSR TrefftzFESpace::elementBasisCalc (ElementId ei) const
+  {
+    switch (eqtype)
+      {
+      case EqType::qtwave:
+        return static_cast<const QTWaveBasis<Dim> *> (basis)->CalcBasis (
+            order, ElCenter<Dim> (ei));
+      case EqType::qtelliptic:
+        return static_cast<const QTEllipticBasis<Dim> *> (basis)->CalcBasis (
+            ElCenter<Dim> (ei), ElSize<Dim> (ei));
+      case EqType::qtheat:
+        {
+          // the size in space and in time
+          Vec<Dim> xdir = 1.0, tdir = 0.0;
+          xdir[Dim - 1] = 0.0;
+          tdir[Dim - 1] = 1.0;
+          return static_cast<QTHeatBasis<Dim> *> (basis)->Basis (
+              ElCenter<Dim> (ei), ElSize<Dim> (ei, xdir),
+              ElSize<Dim> (ei, tdir));
+        }
+      default:
+        return CSR ();
+      }
+  }
+
+  void TrefftzFESpace ::ResetElementBases ()
+  {
+    elbases = Array<CSR> ();
+    elbases_once = nullptr;
+    if (eqtype != EqType::qtwave && eqtype != EqType::qtelliptic
+        && eqtype != EqType::qtheat)
+      return;
+    elbases = Array<CSR> (nel);
+    elbases_once = make_unique<std::once_flag[]> (nel);
+  }
+
+  const CSR &TrefftzFESpace ::ElementBasis (ElementId ei) const
+  {
+    std::call_once (elbases_once[ei.Nr ()], [&] () {
+      elbases[ei.Nr ()] = D == 2 ? elementBasisCalc<2> (ei)
+                                 : elementBasisCalc<3> (ei);
+    });
+    return elbases[ei.Nr ()];
+  }
+
   void TrefftzFESpace ::SetCoeff (double acoeff_const)
   {
     coeff_const = acoeff_const;
     UpdateBasis ();
+    ResetElementBases ();
   }
 
   void TrefftzFESpace ::SetCoeff (shared_ptr<CoefficientFunction> acoeffA,
@@ -212,6 +260,7 @@ namespace ngcomp
     this->coeffC = acoeffC;
     // if (eqtyp.find ("qt") != std::string::npos)
     UpdateBasis ();
+    ResetElementBases ();
   }
 
   shared_ptr<GridFunction>
@@ -297,18 +346,16 @@ namespace ngcomp
     ELEMENT_TYPE eltype = ngel.GetType ();
     if (eqtype == (EqType::qtwave))
       {
-        CSR basismat = static_cast<QTWaveBasis<Dim> *> (basis)->Basis (
-            order, ElCenter<Dim> (ei));
         return *(new (alloc) ScalarMappedElement<Dim> (
-            local_ndof, order, basismat, eltype, ElCenter<Dim> (ei)));
+            local_ndof, order, ElementBasis (ei).View (), eltype,
+            ElCenter<Dim> (ei)));
       }
     else if (eqtype == (EqType::qtelliptic))
       {
         double scale = 1.0 / ElSize<Dim> (ei);
-        CSR basismat = static_cast<QTEllipticBasis<Dim> *> (basis)->Basis (
-            ElCenter<Dim> (ei), ElSize<Dim> (ei));
         return *(new (alloc) ScalarMappedElement<Dim> (
-            local_ndof, order, basismat, eltype, ElCenter<Dim> (ei), scale));
+            local_ndof, order, ElementBasis (ei).View (), eltype,
+            ElCenter<Dim> (ei), scale));
       }
     else if (eqtype == (EqType::foqtwave))
       {
@@ -348,20 +395,18 @@ namespace ngcomp
         double hx = ElSize<2> (ei, { 1.0, 0 });
         double ht = ElSize<2> (ei, { 0, 1.0 });
         Vec<2> scale ({ 1.0 / hx, 1.0 / ht });
-        CSR basismat = static_cast<QTHeatBasis<Dim> *> (basis)->Basis (
-            ElCenter<2> (ei), hx, ht);
         return *(new (alloc) ScalarMappedElement<2> (
-            local_ndof, order, basismat, eltype, ElCenter<2> (ei), scale));
+            local_ndof, order, ElementBasis (ei).View (), eltype,
+            ElCenter<2> (ei), scale));
       }
     else if (Dim == 3 && eqtype == (EqType::qtheat))
       {
         double hx = ElSize<3> (ei, { 1.0, 1.0, 0 });
         double ht = ElSize<3> (ei, { 0, 0, 1.0 });
         Vec<3> scale ({ 1.0 / hx, 1.0 / hx, 1.0 / ht });
-        CSR basismat = static_cast<QTHeatBasis<3> *> (basis)->Basis (
-            ElCenter<3> (ei), hx, ht);
         return *(new (alloc) ScalarMappedElement<3> (
-            local_ndof, order, basismat, eltype, ElCenter<Dim> (ei), scale));
+            local_ndof, order, ElementBasis (ei).View (), eltype,
+            ElCenter<Dim> (ei), scale));
       }
     else
       {
@@ -852,115 +897,114 @@ namespace ngcomp
   CSR QTEllipticBasis<D>::Basis (Vec<D> ElCenter, double elsize)
   {
     lock_guard<mutex> lock (gentrefftzbasis);
-    int order = this->order;
     string encode = to_string (order) + to_string (elsize);
     for (int i = 0; i < D; i++)
       encode += to_string (ElCenter[i]);
 
-    if (gtbstore[encode][0].Size () == 0)
-      {
-        IntegrationPoint ip (ElCenter, 0);
-        Mat<D, D> dummy;
-        FE_ElementTransformation<D, D> et (D == 3   ? ET_TET
-                                           : D == 2 ? ET_TRIG
-                                                    : ET_SEGM,
-                                           dummy);
-        MappedIntegrationPoint<D, D> mip (ip, et, 0);
-        for (int i = 0; i < D; i++)
-          mip.Point ()[i] = ElCenter[i];
+    if (gtbstore[encode].Height () == 0)
+      gtbstore[encode] = CalcBasis (ElCenter, elsize);
+    return gtbstore[encode];
+  }
 
-        const int ndiffs = (BinCoeff (D + order - 1, order - 1));
-        Vector<Matrix<>> AA (ndiffs);
-        Vector<Vector<>> BB (ndiffs);
-        Vector<> CC (ndiffs);
+  template <int D>
+  CSR QTEllipticBasis<D>::CalcBasis (Vec<D> ElCenter, double elsize) const
+  {
+    IntegrationPoint ip (ElCenter, 0);
+    Mat<D, D> dummy;
+    FE_ElementTransformation<D, D> et (D == 3   ? ET_TET
+                                       : D == 2 ? ET_TRIG
+                                                : ET_SEGM,
+                                       dummy);
+    MappedIntegrationPoint<D, D> mip (ip, et, 0);
+    for (int i = 0; i < D; i++)
+      mip.Point ()[i] = ElCenter[i];
 
-        TraversePol<D> (order - 1, [&] (int i, Vec<D, int> coeff) {
-          int index = PolBasis::IndexMap2<D> (coeff, order - 1);
-          AA[index].SetSize (D, D);
-          BB[index].SetSize (D);
-          AAder[index]->Evaluate (mip, AA[index].AsVector ());
-          BBder[index]->Evaluate (mip, BB[index]);
-          CC[index] = CCder[index]->Evaluate (mip);
-        });
+    const int ndiffs = (BinCoeff (D + order - 1, order - 1));
+    Vector<Matrix<>> AA (ndiffs);
+    Vector<Vector<>> BB (ndiffs);
+    Vector<> CC (ndiffs);
+
+    TraversePol<D> (order - 1, [&] (int i, Vec<D, int> coeff) {
+      int index = PolBasis::IndexMap2<D> (coeff, order - 1);
+      AA[index].SetSize (D, D);
+      BB[index].SetSize (D);
+      AAder[index]->Evaluate (mip, AA[index].AsVector ());
+      BBder[index]->Evaluate (mip, BB[index]);
+      CC[index] = CCder[index]->Evaluate (mip);
+    });
 
-        const int ndof = (BinCoeff (D - 1 + order, order)
-                          + BinCoeff (D - 1 + order - 1, order - 1));
-        const int npoly = (BinCoeff (D + order, order));
-        Matrix<> qtbasis (ndof, npoly);
-        qtbasis = 0;
-        // init qtbasis
-        // TODO: for general direction this needs a counter (see qtheat)
-        TraversePol<D> (order, [&] (int i, Vec<D, int> coeff) {
-          if (coeff[D - 1] > 1)
-            return;
-          int indexmap = PolBasis::IndexMap2<D> (coeff, order);
-          qtbasis (i, indexmap) = 1;
-        });
-        // start recursion
-        TraversePol2<D> (order, [&] (int i, Vec<D, int> coeff) {
-          if (coeff (D - 1) <= 1)
-            return;
-          int indexmap = PolBasis::IndexMap2<D> (coeff, order);
-          Vec<D, int> mii = coeff;
-          mii[D - 1] = mii[D - 1] - 2;
-          for (int j = 0; j < D; j++)
-            {
-              Vec<D, int> ej = 0;
-              ej[j] = 1;
+    const int ndof = (BinCoeff (D - 1 + order, order)
+                      + BinCoeff (D - 1 + order - 1, order - 1));
+    const int npoly = (BinCoeff (D + order, order));
+    Matrix<> qtbasis (ndof, npoly);
+    qtbasis = 0;
+    // init qtbasis
+    // TODO: for general direction this needs a counter (see qtheat)
+    TraversePol<D> (order, [&] (int i, Vec<D, int> coeff) {
+      if (coeff[D - 1] > 1)
+        return;
+      int indexmap = PolBasis::IndexMap2<D> (coeff, order);
+      qtbasis (i, indexmap) = 1;
+    });
+    // start recursion
+    TraversePol2<D> (order, [&] (int i, Vec<D, int> coeff) {
+      if (coeff (D - 1) <= 1)
+        return;
+      int indexmap = PolBasis::IndexMap2<D> (coeff, order);
+      Vec<D, int> mii = coeff;
+      mii[D - 1] = mii[D - 1] - 2;
+      for (int j = 0; j < D; j++)
+        {
+          Vec<D, int> ej = 0;
+          ej[j] = 1;
 
-              TraversePol<D> (mii + ej, [&] (int i2, Vec<D, int> mil) {
-                // matrix coeff A
-                for (int m = 0; m < D; m++)
-                  {
-                    if (i2 == 0 && m == D - 1 && j == D - 1)
-                      continue;
-                    Vec<D, int> em = 0;
-                    em[m] = 1;
-                    qtbasis.Col (indexmap)
-                        -= factorial (mii + ej) / factorial (mil)
-                           * (AA[IndexMap2<D> (mil, order - 1)]) (j, m)
-                           * pow (elsize, vsum<D, int> (mil))
-                           * (mii[m] + ej[m] - mil[m] + 1)
-                           * qtbasis.Col (PolBasis::IndexMap2<D> (
-                               mii + ej - mil + em, order));
-                  }
-                // vec coeff B
+          TraversePol<D> (mii + ej, [&] (int i2, Vec<D, int> mil) {
+            // matrix coeff A
+            for (int m = 0; m < D; m++)
+              {
+                if (i2 == 0 && m == D - 1 && j == D - 1)
+                  continue;
+                Vec<D, int> em = 0;
+                em[m] = 1;
                 qtbasis.Col (indexmap)
-                    += factorial (mii + ej) / factorial (mil)
-                       * (BB[IndexMap2<D> (mil, order - 1)]) (j)*pow (
-                           elsize, vsum<D, int> (mil) + 1)
-                       * qtbasis.Col (
-                           PolBasis::IndexMap2<D> (mii + ej - mil, order));
-
-                // scal coeff C
-                if (j == 0 && mil[0] <= mii[0])
-                  qtbasis.Col (indexmap)
-                      += factorial (mii) / factorial (mil)
-                         * CC[IndexMap2<D> (mil, order - 1)]
-                         * pow (elsize, vsum<D, int> (mil) + 2)
-                         * qtbasis.Col (
-                             PolBasis::IndexMap2<D> (mii - mil, order));
-              });
-            }
-          Vec<D, int> eD = 0;
-          eD[D - 1] = 2;
-          qtbasis.Col (indexmap)
-              *= 1.0 / factorial (mii + eD) / (AA[0](D - 1, D - 1));
-        });
-        MatToCSR (qtbasis, gtbstore[encode]);
-      }
+                    -= factorial (mii + ej) / factorial (mil)
+                       * (AA[IndexMap2<D> (mil, order - 1)]) (j, m)
+                       * pow (elsize, vsum<D, int> (mil))
+                       * (mii[m] + ej[m] - mil[m] + 1)
+                       * qtbasis.Col (PolBasis::IndexMap2<D> (
+                           mii + ej - mil + em, order));
+              }
+            // vec coeff B
+            qtbasis.Col (indexmap)
+                += factorial (mii + ej) / factorial (mil)
+                   * (BB[IndexMap2<D> (mil, order - 1)]) (j)*pow (
+                       elsize, vsum<D, int> (mil) + 1)
+                   * qtbasis.Col (
+                       PolBasis::IndexMap2<D> (mii + ej - mil, order));
 
-    if (gtbstore[encode].Size () == 0)
+            // scal coeff C
+            if (j == 0 && mil[0] <= mii[0])
+              qtbasis.Col (indexmap)
+                  += factorial (mii) / factorial (mil)
+                     * CC[IndexMap2<D> (mil, order - 1)]
+                     * pow (elsize, vsum<D, int> (mil) + 2)
+                     * qtbasis.Col (
+                         PolBasis::IndexMap2<D> (mii - mil, order));
+          });
+        }
+      Vec<D, int> eD = 0;
+      eD[D - 1] = 2;
+      qtbasis.Col (indexmap)
+          *= 1.0 / factorial (mii + eD) / (AA[0](D - 1, D - 1));
+    });
+    CSR tb (qtbasis);
+    if (tb.Height () == 0)
       {
         stringstream str;
         str << "failed to generate trefftz basis of order " << order << endl;
         throw Exception (str.str ());
       }
-
-    return gtbstore[encode];
-    // CSR tb;
-    // MatToCSR (qtbasis, tb);
-    // return tb;
+    return tb;
   }
 
   template <int D>
@@ -1066,143 +1110,147 @@ namespace ngcomp
     for (int i = 0; i < D - 1; i++)
       encode += to_string (ElCenter[i]);
 
-    if (gtbstore[encode][0].Size () == 0)
-      {
-        IntegrationPoint ip (ElCenter, 0);
-        Mat<D - 1, D - 1> dummy;
-        FE_ElementTransformation<D - 1, D - 1> et (D == 4   ? ET_TET
-                                                   : D == 3 ? ET_TRIG
-                                                            : ET_SEGM,
-                                                   dummy);
-        MappedIntegrationPoint<D - 1, D - 1> mip (ip, et, 0);
-        for (int i = 0; i < D - 1; i++)
-          mip.Point ()[i] = ElCenter[i];
+    if (gtbstore[encode].Height () == 0)
+      gtbstore[encode] = CalcBasis (ord, ElCenter, elsize, basistype);
+    return gtbstore[encode];
+  }
 
-        Matrix<> BB (ord, (ord - 1) * (D == 3) + 1);
-        Matrix<> AA (ord - 1, (ord - 2) * (D == 3) + 1);
+  template <int D>
+  CSR QTWaveBasis<D>::CalcBasis (int ord, Vec<D> ElCenter, double elsize,
+                                 int basistype) const
+  {
+    IntegrationPoint ip (ElCenter, 0);
+    Mat<D - 1, D - 1> dummy;
+    FE_ElementTransformation<D - 1, D - 1> et (D == 4   ? ET_TET
+                                               : D == 3 ? ET_TRIG
+                                                        : ET_SEGM,
+                                               dummy);
+    MappedIntegrationPoint<D - 1, D - 1> mip (ip, et, 0);
+    for (int i = 0; i < D - 1; i++)
+      mip.Point ()[i] = ElCenter[i];
 
-        TraversePol<D - 1> (order - 1, [&] (int i, Vec<D - 1, int> coeff) {
-          int nx = coeff[0];
-          int ny = D > 2 ? coeff[1] : 0;
-          double fac = (factorial (nx) * factorial (ny));
-          int index = PolBasis::IndexMap2<D - 1> (coeff, order - 1);
-          BB (nx, ny)
-              = BBder[index]->Evaluate (mip) / fac * pow (elsize, nx + ny);
-          if (vsum<D - 1, int> (coeff) < ord - 1)
-            {
-              index = PolBasis::IndexMap2<D - 1> (coeff, order - 2);
-              AA (nx, ny)
-                  = AAder[index]->Evaluate (mip) / fac * pow (elsize, nx + ny);
-            }
-        });
+    Matrix<> BB (ord, (ord - 1) * (D == 3) + 1);
+    Matrix<> AA (ord - 1, (ord - 2) * (D == 3) + 1);
+
+    TraversePol<D - 1> (order - 1, [&] (int i, Vec<D - 1, int> coeff) {
+      int nx = coeff[0];
+      int ny = D > 2 ? coeff[1] : 0;
+      double fac = (factorial (nx) * factorial (ny));
+      int index = PolBasis::IndexMap2<D - 1> (coeff, order - 1);
+      BB (nx, ny)
+          = BBder[index]->Evaluate (mip) / fac * pow (elsize, nx + ny);
+      if (vsum<D - 1, int> (coeff) < ord - 1)
+        {
+          index = PolBasis::IndexMap2<D - 1> (coeff, order - 2);
+          AA (nx, ny)
+              = AAder[index]->Evaluate (mip) / fac * pow (elsize, nx + ny);
+        }
+    });
 
-        const int ndof
-            = (BinCoeff (D - 1 + ord, ord) + BinCoeff (D + ord - 2, ord - 1));
-        const int npoly = BinCoeff (D + ord, ord);
-        Matrix<> qtbasis (ndof, npoly);
-        qtbasis = 0;
+    const int ndof
+        = (BinCoeff (D - 1 + ord, ord) + BinCoeff (D + ord - 2, ord - 1));
+    const int npoly = BinCoeff (D + ord, ord);
+    Matrix<> qtbasis (ndof, npoly);
+    qtbasis = 0;
 
-        for (int t = 0, basisn = 0; t < 2; t++)
-          for (int x = 0; x <= ord - t; x++)
-            for (int y = 0; y <= (ord - x - t) * (D == 3); y++)
-              {
-                Vec<D, int> index;
-                index[D - 1] = t;
-                index[0] = x;
-                if (D == 3)
-                  index[1] = y;
-                qtbasis (basisn++, PolBasis::IndexMap2<D> (index, ord)) = 1.0;
-              }
+    for (int t = 0, basisn = 0; t < 2; t++)
+      for (int x = 0; x <= ord - t; x++)
+        for (int y = 0; y <= (ord - x - t) * (D == 3); y++)
+          {
+            Vec<D, int> index;
+            index[D - 1] = t;
+            index[0] = x;
+            if (D == 3)
+              index[1] = y;
+            qtbasis (basisn++, PolBasis::IndexMap2<D> (index, ord)) = 1.0;
+          }
 
-        for (int basisn = 0; basisn < ndof; basisn++)
+    for (int basisn = 0; basisn < ndof; basisn++)
+      {
+        for (int ell = 0; ell < ord - 1; ell++)
           {
-            for (int ell = 0; ell < ord - 1; ell++)
+            for (int t = 0; t <= ell; t++)
               {
-                for (int t = 0; t <= ell; t++)
+                for (int x = (D == 2 ? ell - t : 0); x <= ell - t; x++)
                   {
-                    for (int x = (D == 2 ? ell - t : 0); x <= ell - t; x++)
-                      {
-                        int y = ell - t - x;
-                        Vec<D, int> index;
-                        index[1] = y;
-                        index[0] = x;
-                        index[D - 1] = t + 2;
-                        double *newcoeff = &qtbasis (
-                            basisn, PolBasis::IndexMap2<D> (index, ord));
-                        *newcoeff = 0;
-
-                        for (int betax = 0; betax <= x; betax++)
-                          for (int betay = (D == 3) ? 0 : y; betay <= y;
-                               betay++)
-                            {
-                              index[1] = betay;
-                              index[0] = betax + 1;
-                              index[D - 1] = t;
-                              int getcoeffx
-                                  = PolBasis::IndexMap2<D> (index, ord);
-                              index[1] = betay + 1;
-                              index[0] = betax;
-                              index[D - 1] = t;
-                              int getcoeffy
-                                  = PolBasis::IndexMap2<D> (index, ord);
-                              index[1] = betay;
-                              index[0] = betax + 2;
-                              index[D - 1] = t;
-                              int getcoeffxx
-                                  = PolBasis::IndexMap2<D> (index, ord);
-                              index[1] = betay + 2;
-                              index[0] = betax;
-                              index[D - 1] = t;
-                              int getcoeffyy
-                                  = PolBasis::IndexMap2<D> (index, ord);
-
-                              *newcoeff
-                                  += (betax + 2) * (betax + 1)
+                    int y = ell - t - x;
+                    Vec<D, int> index;
+                    index[1] = y;
+                    index[0] = x;
+                    index[D - 1] = t + 2;
+                    double *newcoeff = &qtbasis (
+                        basisn, PolBasis::IndexMap2<D> (index, ord));
+                    *newcoeff = 0;
+
+                    for (int betax = 0; betax <= x; betax++)
+                      for (int betay = (D == 3) ? 0 : y; betay <= y;
+                           betay++)
+                        {
+                          index[1] = betay;
+                          index[0] = betax + 1;
+                          index[D - 1] = t;
+                          int getcoeffx
+                              = PolBasis::IndexMap2<D> (index, ord);
+                          index[1] = betay + 1;
+                          index[0] = betax;
+                          index[D - 1] = t;
+                          int getcoeffy
+                              = PolBasis::IndexMap2<D> (index, ord);
+                          index[1] = betay;
+                          index[0] = betax + 2;
+                          index[D - 1] = t;
+                          int getcoeffxx
+                              = PolBasis::IndexMap2<D> (index, ord);
+                          index[1] = betay + 2;
+                          index[0] = betax;
+                          index[D - 1] = t;
+                          int getcoeffyy
+                              = PolBasis::IndexMap2<D> (index, ord);
+
+                          *newcoeff
+                              += (betax + 2) * (betax + 1)
+                                     / ((t + 2) * (t + 1) * AA (0))
+                                     * BB (x - betax, y - betay)
+                                     * qtbasis (basisn, getcoeffxx)
+                                 + (x - betax + 1) * (betax + 1)
+                                       / ((t + 2) * (t + 1) * AA (0))
+                                       * BB (x - betax + 1, y - betay)
+                                       * qtbasis (basisn, getcoeffx);
+                          if (D == 3)
+                            *newcoeff
+                                += (betay + 2) * (betay + 1)
+                                       / ((t + 2) * (t + 1) * AA (0))
+                                       * BB (x - betax, y - betay)
+                                       * qtbasis (basisn, getcoeffyy)
+                                   + (y - betay + 1) * (betay + 1)
                                          / ((t + 2) * (t + 1) * AA (0))
-                                         * BB (x - betax, y - betay)
-                                         * qtbasis (basisn, getcoeffxx)
-                                     + (x - betax + 1) * (betax + 1)
-                                           / ((t + 2) * (t + 1) * AA (0))
-                                           * BB (x - betax + 1, y - betay)
-                                           * qtbasis (basisn, getcoeffx);
-                              if (D == 3)
-                                *newcoeff
-                                    += (betay + 2) * (betay + 1)
-                                           / ((t + 2) * (t + 1) * AA (0))
-                                           * BB (x - betax, y - betay)
-                                           * qtbasis (basisn, getcoeffyy)
-                                       + (y - betay + 1) * (betay + 1)
-                                             / ((t + 2) * (t + 1) * AA (0))
-                                             * BB (x - betax, y - betay + 1)
-                                             * qtbasis (basisn, getcoeffy);
-                              if (betax + betay == x + y)
-                                continue;
-                              index[1] = betay;
-                              index[0] = betax;
-                              index[D - 1] = t + 2;
-                              int getcoeff
-                                  = PolBasis::IndexMap2<D> (index, ord);
-
-                              *newcoeff -= AA (x - betax, y - betay)
-                                           * qtbasis (basisn, getcoeff)
-                                           / AA (0);
-                            }
-                      }
+                                         * BB (x - betax, y - betay + 1)
+                                         * qtbasis (basisn, getcoeffy);
+                          if (betax + betay == x + y)
+                            continue;
+                          index[1] = betay;
+                          index[0] = betax;
+                          index[D - 1] = t + 2;
+                          int getcoeff
+                              = PolBasis::IndexMap2<D> (index, ord);
+
+                          *newcoeff -= AA (x - betax, y - betay)
+                                       * qtbasis (basisn, getcoeff)
+                                       / AA (0);
+                        }
                   }
               }
           }
-
-        MatToCSR (qtbasis, gtbstore[encode]);
       }
 
-    if (gtbstore[encode].Size () == 0)
+    CSR tb (qtbasis);
+    if (tb.Height () == 0)
       {
         stringstream str;
         str << "failed to generate trefftz basis of order " << ord << endl;
         throw Exception (str.str ());
       }
-
-    return gtbstore[encode];
+    return tb;
   }
 
   template class QTWaveBasis<2>;
@@ -1217,7 +1265,7 @@ namespace ngcomp
     for (int i = 0; i < D - 1; i++)
       encode += to_string (ElCenter[i]);
 
-    if (gtbstore[0][encode][0].Size () == 0)
+    if (gtbstore[0][encode].Height () == 0)
       {
         IntegrationPoint ip (ElCenter, 0);
         Mat<D - 1, D - 1> dummy;
@@ -1325,7 +1373,7 @@ namespace ngcomp
           }
       }
 
-    if (gtbstore[0][encode].Size () == 0)
+    if (gtbstore[0][encode].Height () == 0)
       {
         stringstream str;
         str << "failed to generate trefftz basis of order " << ord << endl;
@@ -1347,7 +1395,7 @@ namespace ngcomp
     // for (int i = 0; i < D-1; i++)
     // encode += to_string (ElCenter[i]);
 
-    // if (gtbstore[encode][0].Size () == 0)
+    // if (gtbstore[encode].Height () == 0)
     {
       IntegrationPoint ip (ElCenter, 0);
       Mat<D, D> dummy;
@@ -1423,7 +1471,7 @@ namespace ngcomp
       return tb;
     }
 
-    // if (gtbstore[encode].Size () == 0)
+    // if (gtbstore[encode].Height () == 0)
     //{
     // stringstream str;
     // str << "failed to generate trefftz basis of order " << order << endl;
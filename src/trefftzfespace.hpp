@@ -158,6 +158,13 @@ namespace ngcomp
     CSR basismat;
     Vector<CSR> basismats;
     PolBasis *basis = nullptr;
+    /// the quasi-Trefftz basis matrices of the volume elements. Each one is
+    /// computed by the first GetFE of its element after Update or SetCoeff,
+    /// s.t. it is computed once with the final coefficients and the later
+    /// GetFE only refer to it
+    mutable Array<CSR> elbases;
+    /// guards the computation of the entries of elbases
+    mutable unique_ptr<std::once_flag[]> elbases_once;
 
     // The following functions are helper functions, that capture behavior
     // which strongly depends on the dimension and the eqtype of the
@@ -168,6 +175,8 @@ namespace ngcomp
     template <int Dim> void setupEvaluators ();
     /// templated version of UpdateBasis
     template <int Dim> void basisUpdate ();
+    /// templated version of ElementBasis, without the caching
+    template <int Dim> CSR elementBasisCalc (ElementId ei) const;
     /// templated version of GetFe
     template <int Dim>
     FiniteElement &TGetFE (ElementId ei, Allocator &alloc) const;
@@ -191,6 +200,11 @@ namespace ngcomp
 
   protected:
     void UpdateBasis ();
+    /// discards the basis matrices of the elements, for the quasi-Trefftz
+    /// spaces whose basis depends on the element
+    void ResetElementBases ();
+    /// @returns the basis matrix of the element, computed on the first call
+    const CSR &ElementBasis (ElementId ei) const;
     template <int D>
     double ElSize (ElementId ei, Vec<D> coeff_const = 1.0) const
     {
@@ -283,6 +297,8 @@ namespace ngcomp
     }
     ~QTEllipticBasis () { ; }
     CSR Basis (Vec<D> ElCenter, double elsize = 1.0);
+    /// as Basis, but without the cache, can be called concurrently
+    CSR CalcBasis (Vec<D> ElCenter, double elsize = 1.0) const;
     void SetRHS (shared_ptr<CoefficientFunction> coeffF) override
     {
       this->ComputeDerivs<D> (order, coeffF, FFder);
@@ -325,6 +341,9 @@ namespace ngcomp
 
     CSR
     Basis (int ord, Vec<D> ElCenter, double elsize = 1.0, int basistype = 0);
+    /// as Basis, but without the cache, can be called concurrently
+    CSR CalcBasis (int ord, Vec<D> ElCenter, double elsize = 1.0,
+                   int basistype = 0) const;
   };
 
   template <int D> class FOQTWaveBasis : public PolBasis
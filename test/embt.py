@@ -112,6 +112,148 @@ def testembtrefftz(fes):
     return sqrt(Integrate((tpgfu-exactlap)**2, mesh))
 
 
+def testembtrefftzdedup(order):
+    """
+    >>> testembtrefftzdedup(5) # doctest:+ELLIPSIS
+    (True, ...e-0...)
+    """
+    from ngsolve.meshes import MakeStructured2DMesh
+    mesh = MakeStructured2DMesh(quads=True, nx=8, ny=8)
+    fes = L2(mesh, order=order, dgjumps=True)
+    u,v = fes.TnT()
+    op = Lap(u)*Lap(v)*dx
+    with TaskManager():
+        PP = TrefftzEmbedding(op,fes,eps=10**-8)
+        PPdedup = TrefftzEmbedding(op,fes,eps=10**-8,dedup=True)
+    a,f = dgell(fes,exactlap)
+    errs = []
+    for P in [PP, PPdedup]:
+        PT = P.CreateTranspose()
+        TA = PT@a.mat@P
+        TU = TA.Inverse()*(PT*f.vec)
+        tpgfu = GridFunction(fes)
+        tpgfu.vec.data = P*TU
+        errs.append(sqrt(Integrate((tpgfu-exactlap)**2, mesh)))
+    return abs(errs[0]-errs[1]) < 1e-10, errs[1]
+
+
+def testembtrefftzmethods(fes):
+    """
+    >>> fes = L2(mesh2d, order=5,  dgjumps=True)
+    >>> testembtrefftzmethods(fes) # doctest:+ELLIPSIS
+    [...e-0..., ...e-0..., ...e-0..., ...e-0...]
+    """
+    u,v = fes.TnT()
+    op = Lap(u)*Lap(v)*dx
+    a,f = dgell(fes,exactlap)
+    errs = []
+    for method in ["svd", "qr", "eig", "jacobi"]:
+        with TaskManager():
+            PP = TrefftzEmbedding(op,fes,eps=10**-7,method=method)
+        PPT = PP.CreateTranspose()
+        TA = PPT@a.mat@PP
+        TU = TA.Inverse()*(PPT*f.vec)
+        tpgfu = GridFunction(fes)
+        tpgfu.vec.data = PP*TU
+        errs.append(sqrt(Integrate((tpgfu-exactlap)**2, fes.mesh)))
+    return errs
+
+
+def testembtrefftzsubspace(fes):
+    """
+    The kernel of the Laplacian on polynomials of order p in 2D has
+    dimension 2p+1. With one more Trefftz dof the subspace iteration does not
+    converge and the SVD is used instead. The subspace iteration computes
+    no singular values, so its elements are left out of the statistics.
+
+    >>> fes = L2(mesh2d, order=5,  dgjumps=True)
+    >>> testembtrefftzsubspace(fes)
+    (True, True, True)
+    """
+    u,v = fes.TnT()
+    op = Lap(u)*Lap(v)*dx
+    a,f = dgell(fes,exactlap)
+    tndof = 2*fes.globalorder+1
+    errs = []
+    for method in ["svd", "subspace"]:
+        with TaskManager():
+            PP = TrefftzEmbedding(op,fes,tndof=tndof,method=method)
+        PPT = PP.CreateTranspose()
+        TA = PPT@a.mat@PP
+        TU = TA.Inverse()*(PPT*f.vec)
+        tpgfu = GridFunction(fes)
+        tpgfu.vec.data = PP*TU
+        errs.append(sqrt(Integrate((tpgfu-exactlap)**2, fes.mesh)))
+
+    P = TrefftzEmbedding(op,fes,tndof=tndof+1,method="svd")
+    Pfallback = TrefftzEmbedding(op,fes,tndof=tndof+1,method="subspace")
+    same = all(list(a) == list(b) for a,b in zip(P.COO(), Pfallback.COO()))
+    stats = {}
+    TrefftzEmbedding(op,fes,tndof=tndof,method="subspace",stats_dict=stats)
+    nostats = sum(stats["condhist"]) == 0 and max(stats["cond"]) == 0
+    return errs[1] < 10 * errs[0], same, nostats
+
+def testembtrefftzcache(fes):
+    """
+    >>> fes = L2(mesh2d, order=4,  dgjumps=True)
+    >>> testembtrefftzcache(fes)
+    (1, True, True)
+
+    The values of parameters and the elements of the forms are part of the
+    key, forms with grid functions are not cached.
+
+    >>> testembtrefftzcacheparams(fes)
+    (2, 0, 2)
+    """
+    import tempfile, os
+    u,v = fes.TnT()
+    op = Lap(u)*Lap(v)*dx
+    lop = -exactlap*Lap(v)*dx
+    with tempfile.TemporaryDirectory() as cache_dir:
+        with TaskManager():
+            PP, uf = TrefftzEmbedding(op,fes,lop,eps=10**-8,cache_dir=cache_dir)
+            PPc, ufc = TrefftzEmbedding(op,fes,lop,eps=10**-8,cache_dir=cache_dir)
+        nfiles = len(os.listdir(cache_dir))
+        # a truncated cache file is recomputed
+        cache_file = os.path.join(cache_dir, os.listdir(cache_dir)[0])
+        os.truncate(cache_file, os.path.getsize(cache_file) // 2)
+        PPt, uft = TrefftzEmbedding(op,fes,lop,eps=10**-8,cache_dir=cache_dir)
+    x = PP.CreateRowVector()
+    x.SetRandom()
+    y = PP.CreateColVector()
+    y.data = PP*x - PPc*x
+    uf.data -= ufc
+    yt = PP.CreateColVector()
+    yt.data = PP*x - PPt*x
+    return nfiles, y.Norm() + uf.Norm() == 0, yt.Norm() == 0
+
+def testembtrefftzcacheparams(fes):
+    import tempfile, os
+    u,v = fes.TnT()
+    op = Lap(u)*Lap(v)*dx
+    coeff = Parameter(1)
+    with tempfile.TemporaryDirectory() as cache_dir:
+        for value in (1,2):
+            coeff.Set(value)
+            TrefftzEmbedding(op,fes,-coeff*exactlap*Lap(v)*dx,eps=10**-8,
+                             cache_dir=cache_dir)
+        nparams = len(os.listdir(cache_dir))
+    gf = GridFunction(fes)
+    with tempfile.TemporaryDirectory() as cache_dir:
+        TrefftzEmbedding(op,fes,-gf*Lap(v)*dx,eps=10**-8,cache_dir=cache_dir)
+        ngf = len(os.listdir(cache_dir))
+    elements = BitArray(fes.mesh.ne)
+    elements.Set()
+    with tempfile.TemporaryDirectory() as cache_dir:
+        for clear in (False, True):
+            if clear:
+                elements.Clear(0)
+            opel = Lap(u)*Lap(v)*dx(definedonelements=elements)
+            TrefftzEmbedding(opel,fes,eps=10**-8,cache_dir=cache_dir)
+        nelements = len(os.listdir(cache_dir))
+    return nparams, ngf, nelements
+
+
 def testembtrefftz_mixed(fes):
     """
     >>> fes = L2(mesh2d, order=5,  dgjumps=True)#,all_dofs_together=True)
@@ -182,6 +324,29 @@ def testembtrefftzpoi(fes):
     return sqrt(Integrate((tpgfu-exactpoi)**2, mesh))
 
 
+def testembtrefftzpoi_multirhs(fes):
+    """
+    >>> fes = L2(mesh2d, order=5,  dgjumps=True)
+    >>> testembtrefftzpoi_multirhs(fes)
+    True
+    """
+    u,v = fes.TnT()
+    uh = u.Operator("hesse")
+    vh = v.Operator("hesse")
+    op = (uh[0,0]+uh[1,1])*(vh[0,0]+vh[1,1])*dx
+    rhs = -exactpoi.Diff(x).Diff(x)-exactpoi.Diff(y).Diff(y)
+    lops = [-rhs*(vh[0,0]+vh[1,1])*dx, -2*rhs*(vh[0,0]+vh[1,1])*dx]
+    with TaskManager():
+        PP,ufvs = TrefftzEmbedding(op,fes,lops,eps)
+        errs = []
+        for lop,ufv in zip(lops,ufvs):
+            _,ufv_single = TrefftzEmbedding(op,fes,lop,eps)
+            diff = ufv_single.CreateVector()
+            diff.data = ufv-ufv_single
+            errs.append(diff.Norm())
+    return len(ufvs) == 2 and max(errs) < 1e-10
+
+
 def testembtrefftzpoi_mixed(fes):
     """
     >>> fes = L2(mesh2d, order=5,  dgjumps=True)#,all_dofs_together=True)
@@ -437,6 +602,364 @@ def testembtrefftzfes(mesh,order):
     return sqrt(Integrate((nsol-exactpoi)**2, mesh))
 
 
+def testembtrefftzoperator(mesh,order):
+    """
+    >>> testembtrefftzoperator(mesh2d,4) # doctest:+ELLIPSIS
+    (...e-1..., ...e-1..., ...e-1...)
+
+    The operator keeps its embedding, when the space is set up again.
+
+    >>> testembtrefftzoperatorsnapshot(mesh2d,4)
+    True
+    """
+    fes = L2(mesh, order=order, dgjumps=True)
+    etfes = EmbeddedTrefftzFES(fes)
+    u,v = fes.TnT()
+    etfes.SetOp(Lap(u)*Lap(v)*dx)
+
+    n = specialcf.normal(2)
+    h = specialcf.mesh_size
+    jump = lambda w: w-w.Other()
+    avgdn = lambda w: 0.5*grad(w)*n+0.5*grad(w.Other())*n
+    forms = [grad(u)*grad(v)*dx,
+             grad(u)*grad(v)*dx - avgdn(u)*jump(v)*dx(skeleton=True)
+             - avgdn(v)*jump(u)*dx(skeleton=True)
+             + 10*order**2/h*jump(u)*jump(v)*dx(skeleton=True)]
+    deformation = GridFunction(VectorH1(mesh, order=1))
+    # x and y are local variables below
+    import ngsolve
+    deformation.Set((0.1*ngsolve.x*ngsolve.y, 0))
+    forms.append(grad(u)*grad(v)*dx(deformation=deformation))
+
+    errors = []
+    for form in forms:
+        a = BilinearForm(etfes, check_unused=False)
+        a += form
+        a.Assemble()
+        anonassemble = BilinearForm(fes, nonassemble=True, check_unused=False)
+        anonassemble += form
+        op = etfes.GetOperator(anonassemble)
+
+        x = a.mat.CreateVector()
+        x.SetRandom()
+        y = x.CreateVector()
+        y.data = a.mat * x - op * x
+        error = y.Norm()/x.Norm()
+
+        # the multi-vector product forms the element matrices
+        xs = MultiVector(x, 5)
+        for xj in xs:
+            xj.SetRandom()
+        ys = MultiVector(x, 5)
+        ys[:] = op * xs
+        for j in range(len(xs)):
+            y.data = a.mat * xs[j] - ys[j]
+            error = max(error, y.Norm()/xs[j].Norm())
+        errors.append(error)
+    return tuple(errors)
+
+def testembtrefftzoperatorsnapshot(mesh,order):
+    fes = L2(mesh, order=order)
+    etfes = EmbeddedTrefftzFES(fes)
+    u,v = fes.TnT()
+    etfes.SetOp(Lap(u)*Lap(v)*dx)
+    a = BilinearForm(fes, nonassemble=True)
+    a += grad(u)*grad(v)*dx
+    op = etfes.GetOperator(a)
+    x = op.CreateRowVector()
+    x.SetRandom()
+    y = op.CreateColVector()
+    y.data = op * x
+    etfes.SetRecompute(True)
+    etfes.SetOp(Lap(u)*Lap(v)*dx)
+    y2 = op.CreateColVector()
+    y2.data = op * x
+    y2.data -= y
+    return y.Norm() > 0 and y2.Norm() == 0
+
+
+def testembtrefftzblockembedding(mesh,order):
+    """
+    >>> testembtrefftzblockembedding(mesh2d,4) # doctest:+ELLIPSIS
+    (True, True, True, True)
+    """
+    fes = L2(mesh, order=order, dgjumps=True)
+    etfes = EmbeddedTrefftzFES(fes)
+    u,v = fes.TnT()
+    etfes.SetOp(Lap(u)*Lap(v)*dx)
+    P = etfes.GetEmbedding()
+    Psparse = etfes.GetEmbedding(sparse=True)
+
+    x = Psparse.CreateRowVector()
+    x.SetRandom()
+    y = Psparse.CreateColVector()
+    y.data = P * x - Psparse * x
+    z = Psparse.CreateColVector()
+    z.SetRandom()
+    xt = Psparse.CreateRowVector()
+    xt.data = P.T * z - Psparse.T * z
+
+    a = BilinearForm(fes)
+    a += grad(u)*grad(v)*dx
+    a.Assemble()
+    PT = P.CreateTranspose()
+    PsparseT = Psparse.CreateTranspose()
+    TA = PT@a.mat@P
+    ya = Psparse.CreateRowVector()
+    ya.data = TA * x
+    xa = Psparse.CreateRowVector()
+    xa.data = ya - PsparseT@a.mat@Psparse * x
+    return (type(P) != type(Psparse), y.Norm() < 1e-12, xt.Norm() < 1e-12,
+            xa.Norm() < 1e-12 * ya.Norm())
+
+def testembtrefftzparallelsparse(mesh,order):
+    """
+    >>> testembtrefftzparallelsparse(mesh2d,4)
+    True
+    """
+    fes = L2(mesh, order=order, dgjumps=True)
+    u,v = fes.TnT()
+    op = Lap(u)*Lap(v)*dx
+    P = TrefftzEmbedding(op,fes,eps=10**-8)
+    with TaskManager():
+        Ppar = TrefftzEmbedding(op,fes,eps=10**-8)
+    return all(list(a) == list(b) for a,b in zip(P.COO(), Ppar.COO()))
+
+def testembtrefftzupdateop(mesh,order):
+    """
+    The block embedding returned before UpdateOp shares the stored one,
+    but is not patched.
+
+    >>> testembtrefftzupdateop(mesh2d,4)
+    (True, True, True)
+    """
+    fes = L2(mesh, order=order, dgjumps=True)
+    u,v = fes.TnT()
+    coef = Parameter(1)
+    c = IfPos(x-0.5, coef, 1)
+    op = c*Lap(u)*Lap(v)*dx
+    lop = -Lap(v)*dx
+
+    etfes = EmbeddedTrefftzFES(fes)
+    uf = etfes.SetOp(op,lf=lop,eps=10**-8)
+    ndof = etfes.ndof
+    Pold = etfes.GetEmbedding()
+    Pold_sparse = etfes.GetEmbedding(sparse=True)
+    coef.Set(4)
+    dirty = BitArray(mesh.ne)
+    dirty.Clear()
+    for el in mesh.Elements(VOL):
+        if any(mesh[vert].point[0] > 0.5 for vert in el.vertices):
+            dirty.Set(el.nr)
+    uf = etfes.UpdateOp(dirty)
+
+    etfes_new = EmbeddedTrefftzFES(fes)
+    uf_new = etfes_new.SetOp(op,lf=lop,eps=10**-8)
+    P = etfes.GetEmbedding(sparse=True)
+    P_new = etfes_new.GetEmbedding(sparse=True)
+    x = P.CreateRowVector()
+    x.SetRandom()
+    y = P.CreateColVector()
+    y.data = P * x - P_new * x
+    diff = uf.CreateVector()
+    diff.data = uf - uf_new
+    yold = P.CreateColVector()
+    yold.data = Pold * x - Pold_sparse * x
+    return (etfes.ndof == ndof and y.Norm() + diff.Norm() < 1e-10,
+            dirty.NumSet() < mesh.ne, yold.Norm() < 1e-12)
+
+def testembtrefftzrecompute(mesh,order):
+    """
+    >>> testembtrefftzrecompute(mesh2d,5)
+    (True, True, True)
+    """
+    rhs = -exactpoi.Diff(x).Diff(x)-exactpoi.Diff(y).Diff(y)
+    fes = L2(mesh, order=order, dgjumps=True)
+    u,v = fes.TnT()
+    op = Lap(u)*Lap(v)*dx
+    lop = -rhs*Lap(v)*dx
+
+    etfes = EmbeddedTrefftzFES(fes)
+    uf = etfes.SetOp(op,lf=lop,eps=10**-7)
+    a,f = dgell(etfes,exactpoi,rhs,GridFunction(fes))
+
+    results = []
+    for cache_size in [0, 4]:
+        etfes_re = EmbeddedTrefftzFES(fes)
+        etfes_re.SetRecompute(True, cache_size)
+        uf_re = etfes_re.SetOp(op,lf=lop,eps=10**-7)
+        with TaskManager():
+            a_re,f_re = dgell(etfes_re,exactpoi,rhs,GridFunction(fes))
+        x = a.mat.CreateVector()
+        x.SetRandom()
+        y = a.mat.CreateColVector()
+        y.data = a.mat * x - a_re.mat * x
+        diff = uf.CreateVector()
+        diff.data = uf - uf_re
+        results.append(etfes_re.ndof == etfes.ndof
+                       and y.Norm() < 1e-8 * x.Norm() and diff.Norm() < 1e-10)
+    return tuple(results) + (etfes_re.GetEmbedding(sparse=True).height == fes.ndof,)
+
+def testembtrefftzsingleprecision(mesh,order):
+    """
+    The embedding is rounded to float, i.e. perturbed by a relative error of
+    about 1e-7. The Trefftz matrices agree up to this error, and the
+    discretization error (about 3e-09 in double precision, see
+    testembtrefftzfes) grows at most to the level of the rounding error.
+
+    >>> testembtrefftzsingleprecision(mesh2d,5)
+    (True, True)
+    """
+    rhs = -exactpoi.Diff(x).Diff(x)-exactpoi.Diff(y).Diff(y)
+    fes = L2(mesh, order=order, dgjumps=True)
+    u,v = fes.TnT()
+    op = Lap(u)*Lap(v)*dx
+    lop = -rhs*Lap(v)*dx
+
+    etfes = EmbeddedTrefftzFES(fes)
+    etfes.SetOp(op,lf=lop,eps=10**-7)
+    a,_ = dgell(etfes,exactpoi,rhs,GridFunction(fes))
+
+    etfes_single = EmbeddedTrefftzFES(fes)
+    etfes_single.SetSinglePrecision(True)
+    uf = GridFunction(fes)
+    uf.vec.data = etfes_single.SetOp(op,lf=lop,eps=10**-7)
+    a_single,f_single = dgell(etfes_single,exactpoi,rhs,uf)
+
+    x = a.mat.CreateVector()
+    x.SetRandom()
+    ax = a.mat.CreateColVector()
+    ax.data = a.mat * x
+    y = a.mat.CreateColVector()
+    y.data = ax - a_single.mat * x
+    matrix_error = y.Norm() / ax.Norm()
+
+    gfu = GridFunction(etfes_single)
+    gfu.vec.data = a_single.mat.Inverse(inverse="sparsecholesky") * f_single.vec
+    error = sqrt(Integrate((gfu + uf - exactpoi)**2, mesh))
+    return matrix_error < 1e-5, error < 1e-5
+
+def testembtrefftzstats(mesh,order):
+    """
+    >>> testembtrefftzstats(mesh2d,4)
+    (True, True, True)
+    """
+    fes = L2(mesh, order=order, dgjumps=True)
+    u,v = fes.TnT()
+    op = Lap(u)*Lap(v)*dx
+    stats = {}
+    P = TrefftzEmbedding(op,fes,eps=10**-8,stats_dict=stats)
+    ndof_trefftz = sum(stats["ndoftrefftz"])
+    return (ndof_trefftz == P.width,
+            sum(stats["condhist"]) == mesh.ne and len(stats["cond"]) == mesh.ne,
+            len(stats["timings"]) == 4 and min(stats["timings"]) >= 0)
+
+def testembtrefftztrace(mesh,order):
+    """
+    >>> testembtrefftztrace(mesh2d,4)
+    (True, True)
+    """
+    import tempfile, os, struct
+    fes = L2(mesh, order=order, dgjumps=True)
+    u,v = fes.TnT()
+    op = Lap(u)*Lap(v)*dx
+    with TaskManager():
+        with tempfile.TemporaryDirectory() as trace_dir:
+            filename = os.path.join(trace_dir, "trace.bin")
+            SetEmbTrefftzTrace(filename, level=1)
+            P = TrefftzEmbedding(op,fes,eps=10**-8)
+            SetEmbTrefftzTrace()
+            with open(filename, "rb") as f:
+                data = f.read()
+    # header of 16 bytes, records of 40 bytes without the embeddings
+    records = [struct.unpack_from("=Q8I", data, offset)
+               for offset in range(16, len(data), 40)]
+    return (data[:7] == b"EMBTTRC" and len(records) == mesh.ne,
+            sum(record[6] for record in records) == P.width)
+
+def testembtrefftzembedmulti(mesh,order):
+    """
+    >>> testembtrefftzembedmulti(mesh2d,4)
+    True
+    """
+    fes = L2(mesh, order=order, dgjumps=True)
+    u,v = fes.TnT()
+    op = Lap(u)*Lap(v)*dx
+    etfes = EmbeddedTrefftzFES(fes)
+    etfes.SetOp(op,eps=10**-8)
+
+    tgfu = GridFunction(etfes)
+    tvecs = MultiVector(tgfu.vec, 5)
+    for tvec in tvecs:
+        tvec.SetRandom()
+    vecs = etfes.Embed(tvecs)
+    diff = vecs[0].CreateVector()
+    error = 0
+    for j in range(len(tvecs)):
+        tgfu.vec.data = tvecs[j]
+        diff.data = vecs[j] - etfes.Embed(tgfu).vec
+        error += diff.Norm()
+    return error < 1e-10
+
+def testembtrefftzsmoothingblocks(mesh,order):
+    """
+    >>> testembtrefftzsmoothingblocks(mesh2d,5)
+    (True, True, True)
+    """
+    from ngsolve.krylovspace import CGSolver
+    rhs = -exactpoi.Diff(x).Diff(x)-exactpoi.Diff(y).Diff(y)
+    fes = L2(mesh, order=order, dgjumps=True)
+    u,v = fes.TnT()
+    op = Lap(u)*Lap(v)*dx
+    lop = -rhs*Lap(v)*dx
+    etfes = EmbeddedTrefftzFES(fes)
+    uf = GridFunction(fes)
+    uf.vec.data = etfes.SetOp(op,lf=lop,eps=10**-8)
+    a,f = dgell(etfes,exactpoi,rhs,uf)
+
+    blocks = etfes.CreateSmoothingBlocks()
+    patches = etfes.CreateSmoothingBlocks(blocktype="facetpatch")
+    covered = len(blocks) == mesh.ne and sum(len(block) for block in blocks) == etfes.ndof
+
+    iterations = []
+    for pre in [IdentityMatrix(etfes.ndof), a.mat.CreateBlockSmoother(blocks),
+                a.mat.CreateBlockSmoother(patches)]:
+        inv = CGSolver(a.mat, pre, tol=1e-10, maxiter=2000)
+        gfu = GridFunction(etfes)
+        gfu.vec.data = inv * f.vec
+        iterations.append(inv.iterations)
+    return covered, iterations[1] < iterations[0], iterations[2] < iterations[0]
+
+def testembtrefftzsetopassemble(mesh,order):
+    """
+    >>> testembtrefftzsetopassemble(mesh2d,5)
+    (True, True)
+    """
+    rhs = -exactpoi.Diff(x).Diff(x)-exactpoi.Diff(y).Diff(y)
+    fes = L2(mesh, order=order, dgjumps=True)
+    u,v = fes.TnT()
+    op = Lap(u)*Lap(v)*dx
+    lop = -rhs*Lap(v)*dx
+
+    etfes = EmbeddedTrefftzFES(fes)
+    uf = etfes.SetOp(op,lf=lop,eps=10**-8)
+    uT,vT = etfes.TnT()
+    a = BilinearForm(etfes)
+    a += grad(uT)*grad(vT)*dx
+    a.Assemble()
+
+    etfes_fused = EmbeddedTrefftzFES(fes)
+    u,v = fes.TnT()
+    mat,uf_fused = etfes_fused.SetOpAssemble(op,grad(u)*grad(v)*dx,lf=lop,eps=10**-8)
+
+    x = a.mat.CreateVector()
+    x.SetRandom()
+    y = a.mat.CreateColVector()
+    y.data = a.mat * x - mat * x
+    diff = uf.CreateVector()
+    diff.data = uf - uf_fused
+    return y.Norm() < 1e-8 * x.Norm(), diff.Norm() < 1e-10
+
 
 if __name__ == "__main__":
     import doctest
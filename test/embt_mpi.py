@@ -0,0 +1,107 @@
+# run with: mpirun -np 4 python3 embt_mpi.py
+from mpi4py import MPI
+from ngsolve import *
+from ngstrefftz import *
+from ngsolve.krylovspace import CGSolver
+from netgen.geom2d import unit_square
+import netgen.meshing
+from dg import exactlap, Lap
+
+comm = MPI.COMM_WORLD
+
+
+def distributedmesh(maxh):
+    if comm.rank == 0:
+        ngmesh = unit_square.GenerateMesh(maxh=maxh).Distribute(comm)
+    else:
+        ngmesh = netgen.meshing.Mesh.Receive(comm)
+    return Mesh(ngmesh)
+
+
+def testembtrefftzmpi(mesh, order):
+    """
+    L2 projection of a harmonic function onto the Trefftz space of the
+    Laplacian on a distributed mesh. The interior penalty forms of the
+    sequential tests need the neighbours across the ranks, a projection only
+    couples the dofs of an element.
+    """
+    fes = L2(mesh, order=order)
+    u, v = fes.TnT()
+    op = Lap(u)*Lap(v)*dx
+    etfes = EmbeddedTrefftzFES(fes)
+    etfes.SetOp(op, eps=10**-8)
+
+    uT, vT = etfes.TnT()
+    a = BilinearForm(etfes)
+    a += uT*vT*dx
+    a.Assemble()
+    f = LinearForm(etfes)
+    f += exactlap*vT*dx
+    f.Assemble()
+    inv = CGSolver(a.mat, a.mat.CreateSmoother(etfes.FreeDofs()), tol=1e-14,
+                   maxiter=2000)
+    gfu = GridFunction(etfes)
+    gfu.vec.data = inv * f.vec
+    error = sqrt(Integrate((gfu-exactlap)**2, mesh))
+
+    # the embedding maps the Trefftz solution to the one on fes
+    P = etfes.GetEmbedding()
+    gfu_fes = GridFunction(fes)
+    gfu_fes.vec.data = P * gfu.vec
+    gfu_fes.vec.Cumulate()
+    error_fes = sqrt(Integrate((gfu_fes-exactlap)**2, mesh))
+
+    # the same projection, with the embedding applied to the forms on fes
+    a_fes = BilinearForm(fes)
+    a_fes += u*v*dx
+    a_fes.Assemble()
+    f_fes = LinearForm(fes)
+    f_fes += exactlap*v*dx
+    f_fes.Assemble()
+    PT = P.CreateTranspose()
+    rhs = gfu.vec.CreateVector()
+    rhs.data = PT * f_fes.vec
+    inv = CGSolver(PT @ a_fes.mat @ P, tol=1e-14, maxiter=2000)
+    gfu_P = GridFunction(etfes)
+    gfu_P.vec.data = inv * rhs
+    error_P = sqrt(Integrate((gfu_P-gfu)**2, mesh))
+    return error < 1e-5, abs(error - error_fes) < 1e-10, error_P < 1e-8
+
+
+def testconformingtrefftzmpi(mesh, order):
+    """
+    L2 projection of a harmonic function onto the Trefftz space of the
+    Laplacian with continuous facet means on a distributed mesh. The
+    conforming dofs are shared between the ranks.
+    """
+    fes = L2(mesh, order=order)
+    u, v = fes.TnT()
+    op = Lap(u)*Lap(v)*dx
+    fes_conformity = FacetFESpace(mesh, order=0)
+    uF, vF = fes_conformity.TnT()
+    cop_lhs = u*vF*dx(element_boundary=True)
+    cop_rhs = uF*vF*dx(element_boundary=True)
+    P = TrefftzEmbedding(op, fes, cop_lhs, cop_rhs, fes_conformity,
+                         2*order+1-3)
+    PT = P.CreateTranspose()
+
+    a = BilinearForm(fes)
+    a += u*v*dx
+    a.Assemble()
+    f = LinearForm(fes)
+    f += exactlap*v*dx
+    f.Assemble()
+    inv = CGSolver(PT @ a.mat @ P, tol=1e-14, maxiter=2000)
+    gfu = GridFunction(fes)
+    gfu.vec.data = P * (inv * (PT * f.vec))
+    gfu.vec.Cumulate()
+    return sqrt(Integrate((gfu-exactlap)**2, mesh)) < 1e-3
+
+
+if __name__ == "__main__":
+    mesh = distributedmesh(0.3)
+    result = testembtrefftzmpi(mesh, 5) \
+        + (testconformingtrefftzmpi(mesh, 5),)
+    if comm.rank == 0:
+        print(result)
+    assert all(result)
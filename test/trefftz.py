@@ -8,6 +8,7 @@ from ngsolve.TensorProductTools import *
 from ngsolve import *
 from dg import *
 import time
+from math import comb
 ngsglobals.msg_level=0
 SetNumThreads(4)
 
@@ -80,6 +81,57 @@ def testlaptrefftz(order,mesh):
     gfu.vec.data = a.mat.Inverse() * f.vec
     return sqrt(Integrate((gfu-exactlap)**2, mesh))
 
+def testlapshapeorders(mesh,order):
+    """
+    The harmonic polynomial Re((x+iy)^order) lies in the Laplace Trefftz
+    space of the same order. Orders up to 10 use the compile-time specialized
+    shape kernels, higher orders the generic ones.
+
+    >>> mesh = Mesh(unit_square.GenerateMesh(maxh=0.5))
+    >>> [testlapshapeorders(mesh,order) for order in (2,10,11)]
+    [(True, True), (True, True), (True, True)]
+
+    In 3D the evaluations on integration rules multiply blocks of a few
+    hundred monomials with the basis matrix.
+
+    >>> mesh = Mesh(unit_cube.GenerateMesh(maxh=1))
+    >>> testlapshapeorders(mesh,8)
+    (True, True)
+    """
+    exact = sum((-1)**(k//2)*comb(order,k)*x**(order-k)*y**k
+                for k in range(0,order+1,2))
+    fes = trefftzfespace(mesh,order=order,eq="laplace")
+    u,v = fes.TnT()
+    a = BilinearForm(u*v*dx).Assemble()
+    f = LinearForm(exact*v*dx).Assemble()
+    gfu = GridFunction(fes)
+    gfu.vec.data = a.mat.Inverse() * f.vec
+    gradexact = CF(tuple(exact.Diff(var) for var in [x,y,z][:mesh.dim]))
+    error = sqrt(Integrate((gfu-exact)**2, mesh)/Integrate(exact**2, mesh))
+    graderror = sqrt(Integrate((gradexact-grad(gfu))*(gradexact-grad(gfu)), mesh)
+                     /Integrate(gradexact*gradexact, mesh))
+    return error < 1e-6, graderror < 1e-6
+
+def testpufe1d(order):
+    """
+    The SIMD shape kernels of the 1D partition of unity elements agree with
+    the ones for single points.
+
+    >>> [testpufe1d(order) for order in (3,11)]
+    [True, True]
+    """
+    from ngsolve.meshes import Make1DMesh
+    mesh = Make1DMesh(5)
+    fes = FESpace("pufespace",mesh,order=order)
+    u,v = fes.TnT()
+    mats = []
+    for simd in (True,False):
+        a = BilinearForm(fes)
+        a += SymbolicBFI(u*v+grad(u)*grad(v),simd_evaluate=simd)
+        a.Assemble()
+        mats.append(a.mat.AsVector())
+    return Norm(mats[0]-mats[1]) < 1e-10*Norm(mats[1])
+
 ########################################################################
 # Helmholtz
 ########################################################################